@@ -1,36 +1,28 @@
 #include "collision.hpp"
 
 #include "query.hpp"
+#include "thread_pool.hpp"
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <chrono>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <format>
+#include <functional>
 #include <numeric>
 #include <omp.h>
 #include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
-
-template<class T>
-bool equals_is_less_than(const FieldQuery& query, const std::optional<T>& value) {
-    const QueryType& type = query.get_type();
-    const T& query_value = std::get<T>(query.get_value());
-
-    if (!value.has_value()) {
-        return false;
-    }
-
-    if constexpr (std::is_same_v<float, T> || std::is_same_v<std::size_t, T> || std::is_same_v<std::chrono::year_month_day, T> ||
-                  std::is_same_v<std::uint8_t, T> || std::is_same_v<std::uint32_t, T>) {
-        switch(type) {
-        case QueryType::EQUALS:
-            return *value < query_value;
-        default:
-            throw std::runtime_error("Unsupported QueryType for float/std::size_t/std::chrono::year_month_day/std::uint8_t/std::uint32_t");
-        }
-    }
-
-    throw std::runtime_error("Unsupported value type");
-}
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 
 template<class T>
 bool do_match(const FieldQuery& query, const std::optional<T>& value) {
@@ -111,124 +103,223 @@ void match_field(const FieldQuery& query,
     }
 }
 
-// Start: AI Generated Binary Search Code
-// ======================================
 template<class T>
-const std::uint32_t* binary_search_find_first_lower_match(const FieldQuery& query,
-                                                          const std::size_t start_index,
-                                                          const std::size_t end_index,
-                                                          const std::vector<T>& items,
-                                                          const std::vector<std::uint32_t>& items_index) {
-    int low = start_index;
-    int high = end_index - 1;
-    const std::uint32_t* result = nullptr;
-
-    while (low <= high) {
-        int mid = low + (high - low) / 2;
-
-        if (do_match(query, items[items_index[mid]])) {
-            result = &items_index[mid];
-            high = mid - 1;
-        } else {
-            if (query.get_type() == QueryType::EQUALS) {
-                if (equals_is_less_than(query, items[items_index[mid]])) {
-                    low = mid + 1;
-                } else {
-                    high = mid - 1;
-                }
-            } else if (query.get_type() == QueryType::LESS_THAN) {
-                high = mid - 1;
-            } else {
-                low = mid + 1;
+void match_field_batch(std::span<const BatchPredicate> predicates,
+                       const std::size_t start_index,
+                       const std::size_t end_index,
+                       const std::vector<T>& items,
+                       std::span<std::vector<std::uint8_t>> selections) {
+    // Row-major over the batch: each item is loaded once and checked against every predicate on this column
+    for (std::size_t index = start_index; index < end_index; ++index) {
+        const std::optional<typename T::value_type>& item = items[index];
+        for (const BatchPredicate& predicate : predicates) {
+            std::uint8_t& matches = selections[predicate.query_index][index - start_index];
+            if (matches) {
+                bool match = do_match(*predicate.query, item);
+                matches = predicate.query->invert_match() ? !match : match;
             }
         }
     }
+}
+
+// Positions [first, last) in items_index of every item matching the query
+template<class T, class Key>
+std::pair<std::size_t, std::size_t> find_index_range(const FieldQuery& query,
+                                                     const std::vector<std::optional<T>>& items,
+                                                     const SortedIndex<Key>& items_index) {
+    if (query.get_type() == QueryType::HAS_VALUE) {
+        return {0, items_index.num_values()};
+    }
+
+    const Key key = index_key(std::get<T>(query.get_value()));
 
-    return result;
+    switch (query.get_type()) {
+    case QueryType::EQUALS:
+        return {items_index.lower_bound(key), items_index.upper_bound(key)};
+    case QueryType::LESS_THAN:
+        return {0, items_index.lower_bound(key)};
+    case QueryType::GREATER_THAN:
+        return {items_index.upper_bound(key), items_index.num_values()};
+    default:
+        throw std::runtime_error("Unsupported QueryType for indexed field");
+    }
 }
 
 template<class T>
-const std::uint32_t* binary_search_find_last_upper_match(const FieldQuery& query,
-                                                         const std::size_t start_index,
-                                                         const std::size_t end_index,
-                                                         const std::vector<T>& items,
-                                                         const std::vector<std::uint32_t>& items_index) {
-    int low = start_index;
-    int high = end_index - 1;
-    const std::uint32_t* result = nullptr;
-
-    while (low <= high) {
-        int mid = low + (high - low) / 2;
-
-        if (do_match(query, items[items_index[mid]])) {
-            result = &items_index[mid];
-            low = mid + 1;
-        } else {
-            if (query.get_type() == QueryType::EQUALS) {
-                if (equals_is_less_than(query, items[items_index[mid]])) {
-                    low = mid + 1;
-                } else {
-                    high = mid - 1;
+bool zone_less(const T& first, const T& second) {
+    if constexpr (std::is_same_v<std::chrono::hh_mm_ss<std::chrono::minutes>, T>) {
+        return first.to_duration() < second.to_duration();
+    } else {
+        return first < second;
+    }
+}
+
+template<class T>
+std::vector<Zone> build_zones(const std::vector<std::optional<T>>& items, const std::size_t zone_size) {
+    std::vector<Zone> zones;
+    for (std::size_t start_index = 0; start_index < items.size(); start_index += zone_size) {
+        const std::size_t end_index = std::min(start_index + zone_size, items.size());
+
+        Zone zone{};
+        zone.num_rows = end_index - start_index;
+
+        std::optional<T> min;
+        std::optional<T> max;
+        std::vector<std::string> values;
+        bool too_many_values = false;
+
+        for (std::size_t index = start_index; index < end_index; ++index) {
+            const std::optional<T>& item = items[index];
+            if (!item.has_value()) {
+                zone.null_count++;
+                continue;
+            }
+
+            if constexpr (std::is_same_v<std::string, T>) {
+                if (!too_many_values && std::find(values.begin(), values.end(), *item) == values.end()) {
+                    too_many_values = values.size() == MAX_ZONE_VALUES;
+                    values.push_back(*item);
                 }
-            } else if (query.get_type() == QueryType::LESS_THAN) {
-                high = mid - 1;
             } else {
-                low = mid + 1;
+                if (!min.has_value() || zone_less(*item, *min)) {
+                    min = item;
+                }
+                if (!max.has_value() || zone_less(*max, *item)) {
+                    max = item;
+                }
             }
         }
-    }
 
-    return result;
+        if constexpr (std::is_same_v<std::string, T>) {
+            if (!too_many_values) {
+                zone.values = std::move(values);
+            }
+        } else if (min.has_value()) {
+            zone.min = *min;
+            zone.max = *max;
+        }
+
+        zones.push_back(std::move(zone));
+    }
+    return zones;
 }
-// End: AI Generated Binary Search Code
-// ====================================
+
+// Whether the non-null values of a zone all match the query, none of them do, or it is unknown.
+// Qualifier::NOT is not applied here.
+enum class ZoneMatch { NONE, SOME, ALL };
 
 template<class T>
-void match_indexed_field(const FieldQuery& query,
-                         const std::size_t start_index,
-                         const std::size_t end_index,
-                         const std::vector<T>& items,
-                         const std::vector<std::uint32_t>& items_index,
-                         std::span<std::uint8_t>& matches) {
-
-    // Using binary search we find the indexes of the first and last matching items.
-    // We therefore know that everything outside this range is not a match, and do not need
-    // to call match on every single item anymore.
-
-    const std::uint32_t* lower_bound = binary_search_find_first_lower_match(
-        query, start_index, end_index, items, items_index
-    );
-    const std::uint32_t* upper_bound = binary_search_find_last_upper_match(
-        query, start_index, end_index, items, items_index
-    );
-
-    // If either lower or upper bound are null then unmatch all indexes
-    if (lower_bound == nullptr || upper_bound == nullptr) {
-        for (std::size_t index = 0; index < end_index - start_index; ++index) {
-            matches[items_index[index + start_index]] = false;
+ZoneMatch match_zone_values(const FieldQuery& query, const Zone& zone) {
+    if (zone.null_count == zone.num_rows) {
+        return ZoneMatch::NONE;
+    }
+
+    const QueryType& type = query.get_type();
+    if (type == QueryType::HAS_VALUE) {
+        return ZoneMatch::ALL;
+    }
+
+    if constexpr (std::is_same_v<std::string, T>) {
+        if (!zone.values.has_value()) {
+            return ZoneMatch::SOME;
+        }
+
+        std::size_t num_matches = 0;
+        for (const std::string& value : *zone.values) {
+            num_matches += do_match(query, std::optional<std::string>{value});
+        }
+        return num_matches == 0 ? ZoneMatch::NONE :
+               num_matches == zone.values->size() ? ZoneMatch::ALL : ZoneMatch::SOME;
+    } else {
+        const T& min = std::get<T>(*zone.min);
+        const T& max = std::get<T>(*zone.max);
+        const T& query_value = std::get<T>(query.get_value());
+
+        switch (type) {
+        case QueryType::EQUALS:
+            if (zone_less(query_value, min) || zone_less(max, query_value)) {
+                return ZoneMatch::NONE;
+            }
+            return !zone_less(min, query_value) && !zone_less(query_value, max) ? ZoneMatch::ALL : ZoneMatch::SOME;
+        case QueryType::LESS_THAN:
+            if (!zone_less(min, query_value)) {
+                return ZoneMatch::NONE;
+            }
+            return zone_less(max, query_value) ? ZoneMatch::ALL : ZoneMatch::SOME;
+        case QueryType::GREATER_THAN:
+            if (!zone_less(query_value, max)) {
+                return ZoneMatch::NONE;
+            }
+            return zone_less(query_value, min) ? ZoneMatch::ALL : ZoneMatch::SOME;
+        default:
+            return ZoneMatch::SOME;
         }
-        return;
     }
+}
 
-    const std::uint32_t lower_bound_index = lower_bound - &(items_index.begin() + start_index)[0];
-    const std::uint32_t upper_bound_index = upper_bound - &(items_index.begin() + start_index)[0] + 1;
+bool zone_may_match(const FieldQuery& query, const Zone& zone) {
+    const ZoneMatch zone_match = std::visit([&query, &zone](auto&& value) {
+        using T = std::decay_t<decltype(value)>;
+        return match_zone_values<T>(query, zone);
+    }, query.get_value());
 
-    // Unmatch anything before lower_bound
-    for (std::size_t index = 0; index < lower_bound_index; ++index) {
-        matches[items_index[index + start_index]] = false;
+    // Rows without a value always match a negated query
+    if (query.invert_match()) {
+        return zone.null_count > 0 || zone_match != ZoneMatch::ALL;
     }
+    return zone_match != ZoneMatch::NONE;
+}
+
+std::pair<std::size_t, std::size_t> find_index_range(const FieldQuery& query,
+                                                     const std::vector<std::optional<std::uint8_t>>& items,
+                                                     const BucketIndex& items_index) {
+    const std::size_t value = std::get<std::uint8_t>(query.get_value());
+    const auto& offsets = items_index.offsets;
 
-    // Unmatch anything after upper_bound
-    for (std::size_t index = upper_bound_index; index < end_index - start_index; ++index) {
-        matches[items_index[index + start_index]] = false;
+    switch (query.get_type()) {
+    case QueryType::HAS_VALUE:
+        return {0, offsets[BucketIndex::NULL_BUCKET]};
+    case QueryType::EQUALS:
+        return {offsets[value], offsets[value + 1]};
+    case QueryType::LESS_THAN:
+        return {0, offsets[value]};
+    case QueryType::GREATER_THAN:
+        return {offsets[value + 1], offsets[BucketIndex::NULL_BUCKET]};
+    default:
+        throw std::runtime_error("Unsupported QueryType for std::uint8_t");
     }
 }
 
-IndexedCollisions::IndexedCollisions(Collisions& collisions)
-  : collisions_{collisions}
+template<class Key>
+const std::vector<std::uint32_t>& index_rows(const SortedIndex<Key>& items_index) {
+    return items_index.rows();
+}
+
+const std::vector<std::uint32_t>& index_rows(const BucketIndex& items_index) {
+    return items_index.rows;
+}
+
+IndexedCollisions::IndexedCollisions(Collisions collisions, const LoadOptions& options)
+  : collisions_{std::move(collisions)}
 {
+    cluster(options.cluster_key);
     init_proxies();
-    init_indexes();
+    index_layout_ = options.index_layout;
+    index_build_ = options.index_build;
+    init_indexes(options.eager_indexes);
+    init_cracking_indexes(options.cracked_indexes);
+
+    for (const CompositeKey composite_key : options.composite_indexes) {
+        composite_indexes.emplace_back(composite_key, LazyIndex<CompositeIndex>{});
+    }
+
+    // Built in the background otherwise, and until then the planner goes without them
+    if (index_build_ == IndexBuild::ON_FIRST_USE) {
+        zone_maps_.get([this](auto& zone_maps) { build_zone_maps(zone_maps); });
+        for (const auto& [composite_key, composite_index] : composite_indexes) {
+            composite_index.get([&](CompositeIndex& index) { build_composite_index(composite_key, index); });
+        }
+    }
 }
 
 IndexedCollisions::IndexedCollisions()
@@ -270,6 +361,88 @@ const CollisionProxy IndexedCollisions::index_to_collision(const std::size_t ind
     return collision;
 }
 
+// Orders rows by value with rows without a value last
+template<class T>
+int compare_cluster_key(const std::optional<T>& first, const std::optional<T>& second) {
+    if (first.has_value() != second.has_value()) {
+        return first.has_value() ? -1 : 1;
+    }
+    if (!first.has_value() || *first == *second) {
+        return 0;
+    }
+    return *first < *second ? -1 : 1;
+}
+
+void IndexedCollisions::cluster(const ClusterKey& cluster_key) {
+    if (cluster_key == ClusterKey::NONE) {
+        return;
+    }
+
+    std::vector<std::uint32_t> order(collisions_.crash_dates.size());
+    std::iota(order.begin(), order.end(), 0);
+
+    if (cluster_key == ClusterKey::LATITUDE_LONGITUDE) {
+        cluster_spatially(order);
+        cluster_order_ = std::move(order);
+        return;
+    }
+
+    // Stable so that rows with equal keys keep the order they had in the csv
+    std::stable_sort(order.begin(), order.end(), [this, &cluster_key](const std::uint32_t first, const std::uint32_t second) {
+        if (cluster_key == ClusterKey::BOROUGH_CRASH_DATE) {
+            const int borough_order = compare_cluster_key(collisions_.boroughs[first], collisions_.boroughs[second]);
+            if (borough_order != 0) {
+                return borough_order < 0;
+            }
+        }
+        return compare_cluster_key(collisions_.crash_dates[first], collisions_.crash_dates[second]) < 0;
+    });
+
+    collisions_.permute(order);
+    cluster_order_ = std::move(order);
+}
+
+void IndexedCollisions::cluster_spatially(std::vector<std::uint32_t>& order) {
+    const auto& latitudes = collisions_.latitudes;
+    const auto& longitudes = collisions_.longitudes;
+    auto has_location = [&](const std::uint32_t index) {
+        return latitudes[index].has_value() && longitudes[index].has_value();
+    };
+
+    float min_latitude = std::numeric_limits<float>::max();
+    float max_latitude = std::numeric_limits<float>::lowest();
+    float min_longitude = std::numeric_limits<float>::max();
+    float max_longitude = std::numeric_limits<float>::lowest();
+    for (const std::uint32_t index : order) {
+        if (has_location(index)) {
+            min_latitude = std::min(min_latitude, *latitudes[index]);
+            max_latitude = std::max(max_latitude, *latitudes[index]);
+            min_longitude = std::min(min_longitude, *longitudes[index]);
+            max_longitude = std::max(max_longitude, *longitudes[index]);
+        }
+    }
+    spatial_grid_ = SpatialGrid(min_latitude, max_latitude, min_longitude, max_longitude);
+
+    // Rows without a location go last, they can never be inside a box
+    std::vector<std::uint32_t> keys(order.size(), 0);
+    for (const std::uint32_t index : order) {
+        if (has_location(index)) {
+            keys[index] = spatial_grid_.key(*latitudes[index], *longitudes[index]);
+        }
+    }
+    const auto located_end = std::stable_partition(order.begin(), order.end(), has_location);
+    std::stable_sort(order.begin(), located_end, [&keys](const std::uint32_t first, const std::uint32_t second) {
+        return keys[first] < keys[second];
+    });
+
+    spatial_keys_.clear();
+    for (auto position = order.begin(); position != located_end; ++position) {
+        spatial_keys_.push_back(keys[*position]);
+    }
+
+    collisions_.permute(order);
+}
+
 void IndexedCollisions::init_proxies() {
     this->proxies_ = {};
     for (std::size_t index = 0; index < collisions_.size(); ++index) {
@@ -282,162 +455,894 @@ void IndexedCollisions::init_proxies() {
     }
 }
 
-template<class T>
-void init_index(T& vec_data, std::vector<uint32_t>& sorted_indexes) {
-    sorted_indexes = std::vector<uint32_t>(vec_data.size());
-    std::iota(sorted_indexes.begin(), sorted_indexes.end(), 0);
-    std::sort(sorted_indexes.begin(), sorted_indexes.end(), [&vec_data, &sorted_indexes](const uint32_t first, const uint32_t second) {
-        if (!vec_data[first].has_value() && !vec_data[second].has_value()) {
-            return false;
-        } else if (!vec_data[first].has_value()) {
-            return false;
-        } else if (!vec_data[second].has_value()) {
-            return true;
-        } else {
-            return vec_data[first].value() < vec_data[second].value();
-        }});
-}
+// Stable parallel LSD radix sort of (key, row) pairs, one byte per pass.
+// Every thread histograms and then scatters its own contiguous chunk, so a single sort uses all threads.
+template<class Key>
+void radix_sort(std::vector<Key>& keys, std::vector<std::uint32_t>& rows) {
+    const std::size_t size = keys.size();
+    std::vector<Key> keys_buffer(size);
+    std::vector<std::uint32_t> rows_buffer(size);
 
-void IndexedCollisions::init_indexes() {
-    #pragma omp parallel
-    {
-        #pragma omp single
+    // On a pool worker the other workers have tasks of their own, a full team on top would oversubscribe the cores
+    const int max_threads = ThreadPool::is_worker() ? 1 : omp_get_max_threads();
+    std::vector<std::array<std::size_t, 256>> offsets(max_threads);
+
+    for (unsigned shift = 0; shift < sizeof(Key) * 8; shift += 8) {
+        bool skip_pass = false;
+
+        #pragma omp parallel num_threads(max_threads)
         {
-            #pragma omp task
-            {
-                init_index(collisions_.crash_dates, sorted_crash_dates);
+            const std::size_t thread = omp_get_thread_num();
+            const std::size_t num_threads = omp_get_num_threads();
+            const std::size_t start_index = size * thread / num_threads;
+            const std::size_t end_index = size * (thread + 1) / num_threads;
+
+            std::array<std::size_t, 256>& thread_offsets = offsets[thread];
+            thread_offsets.fill(0);
+            for (std::size_t index = start_index; index < end_index; ++index) {
+                thread_offsets[(keys[index] >> shift) & 0xFF]++;
             }
-            #pragma omp task
+
+            #pragma omp barrier
+            #pragma omp single
             {
-                init_index(collisions_.zip_codes, sorted_zip_codes);
+                // Turn the counts into where each thread writes its first key of each digit:
+                // all keys with a lower digit come first, then those of earlier threads
+                std::size_t position = 0;
+                for (std::size_t digit = 0; digit < 256; ++digit) {
+                    std::size_t digit_count = 0;
+                    for (std::size_t other_thread = 0; other_thread < num_threads; ++other_thread) {
+                        const std::size_t count = offsets[other_thread][digit];
+                        offsets[other_thread][digit] = position;
+                        position += count;
+                        digit_count += count;
+                    }
+                    // Keys that all share this digit are already in order for it
+                    skip_pass = skip_pass || digit_count == size;
+                }
             }
-            #pragma omp task
-            {
-                init_index(collisions_.latitudes, sorted_latitudes);
+
+            if (!skip_pass) {
+                for (std::size_t index = start_index; index < end_index; ++index) {
+                    const std::size_t position = thread_offsets[(keys[index] >> shift) & 0xFF]++;
+                    keys_buffer[position] = keys[index];
+                    rows_buffer[position] = rows[index];
+                }
             }
-            #pragma omp task
-            {
-                init_index(collisions_.longitudes, sorted_longitudes);
+        }
+
+        if (!skip_pass) {
+            keys.swap(keys_buffer);
+            rows.swap(rows_buffer);
+        }
+    }
+}
+
+template<class T, class Key>
+void init_index(const std::vector<std::optional<T>>& vec_data, SortedIndex<Key>& sorted_index, const IndexLayout& layout) {
+
+    // Rows without a value are partitioned off up front and go to the end of the index
+    std::vector<Key> keys;
+    std::vector<std::uint32_t> rows;
+    std::vector<std::uint32_t> null_rows;
+    keys.reserve(vec_data.size());
+    rows.reserve(vec_data.size());
+    for (std::uint32_t index = 0; index < vec_data.size(); ++index) {
+        if (vec_data[index].has_value()) {
+            keys.push_back(index_key(*vec_data[index]));
+            rows.push_back(index);
+        } else {
+            null_rows.push_back(index);
+        }
+    }
+
+    radix_sort(keys, rows);
+
+    rows.insert(rows.end(), null_rows.begin(), null_rows.end());
+    sorted_index = SortedIndex<Key>(std::move(keys), std::move(rows), layout);
+}
+
+void init_bucket_index(const std::vector<std::optional<std::uint8_t>>& vec_data, BucketIndex& bucket_index) {
+    auto bucket = [](const std::optional<std::uint8_t>& value) -> std::size_t {
+        return value.has_value() ? *value : BucketIndex::NULL_BUCKET;
+    };
+
+    // Count every value, turn the counts into the first position of each bucket, then place the rows.
+    // Rows are placed in row order, so rows with the same value stay in row order.
+    std::array<std::uint32_t, BucketIndex::NULL_BUCKET + 2> counts{};
+    for (const std::optional<std::uint8_t>& value : vec_data) {
+        counts[bucket(value) + 1]++;
+    }
+
+    std::partial_sum(counts.begin(), counts.end(), bucket_index.offsets.begin());
+
+    std::array<std::uint32_t, BucketIndex::NULL_BUCKET + 2> next_positions = bucket_index.offsets;
+    bucket_index.rows = std::vector<std::uint32_t>(vec_data.size());
+    for (std::uint32_t index = 0; index < vec_data.size(); ++index) {
+        bucket_index.rows[next_positions[bucket(vec_data[index])]++] = index;
+    }
+}
+
+// Call func with the column that stores the given field, its lazy index and the function that builds that index
+template<class Func>
+void visit_lazy_index(const IndexedCollisions& indexed, const CollisionField& name, Func&& func) {
+    const Collisions& collisions = indexed.collisions_;
+    auto sorted = [&](const auto& items, const auto& lazy_index) {
+        func(items, lazy_index, [&](auto& index) { init_index(items, index, indexed.get_index_layout(name)); });
+    };
+    auto bucketed = [&](const auto& items, const auto& lazy_index) {
+        func(items, lazy_index, [&](auto& index) { init_bucket_index(items, index); });
+    };
+
+    switch (name) {
+        case CollisionField::CRASH_DATE: sorted(collisions.crash_dates, indexed.sorted_crash_dates); break;
+        case CollisionField::ZIP_CODE: sorted(collisions.zip_codes, indexed.sorted_zip_codes); break;
+        case CollisionField::LATITUDE: sorted(collisions.latitudes, indexed.sorted_latitudes); break;
+        case CollisionField::LONGITUDE: sorted(collisions.longitudes, indexed.sorted_longitudes); break;
+        case CollisionField::NUMBER_OF_PERSONS_INJURED: bucketed(collisions.numbers_of_persons_injured, indexed.bucketed_numbers_of_persons_injured); break;
+        case CollisionField::NUMBER_OF_PERSONS_KILLED: bucketed(collisions.numbers_of_persons_killed, indexed.bucketed_numbers_of_persons_killed); break;
+        case CollisionField::NUMBER_OF_PEDESTRIANS_INJURED: bucketed(collisions.numbers_of_pedestrians_injured, indexed.bucketed_numbers_of_pedestrians_injured); break;
+        case CollisionField::NUMBER_OF_PEDESTRIANS_KILLED: bucketed(collisions.numbers_of_pedestrians_killed, indexed.bucketed_numbers_of_pedestrians_killed); break;
+        case CollisionField::NUMBER_OF_CYCLIST_INJURED: bucketed(collisions.numbers_of_cyclist_injured, indexed.bucketed_numbers_of_cyclist_injured); break;
+        case CollisionField::NUMBER_OF_CYCLIST_KILLED: bucketed(collisions.numbers_of_cyclist_killed, indexed.bucketed_numbers_of_cyclist_killed); break;
+        case CollisionField::NUMBER_OF_MOTORIST_INJURED: bucketed(collisions.numbers_of_motorist_injured, indexed.bucketed_numbers_of_motorist_injured); break;
+        case CollisionField::NUMBER_OF_MOTORIST_KILLED: bucketed(collisions.numbers_of_motorist_killed, indexed.bucketed_numbers_of_motorist_killed); break;
+        case CollisionField::COLLISION_ID: sorted(collisions.collision_ids, indexed.sorted_collision_ids); break;
+        default:
+            throw std::runtime_error("CollisionField is not indexed");
+    }
+}
+
+// Call func with the column that stores the given field and its index, building the index if this is its first use
+template<class Func>
+void visit_indexed_column(const IndexedCollisions& indexed, const CollisionField& name, Func&& func) {
+    visit_lazy_index(indexed, name, [&](const auto& items, const auto& lazy_index, auto&& build) {
+        func(items, lazy_index.get(build));
+    });
+}
+
+IndexLayout IndexedCollisions::get_index_layout(const CollisionField& field) const {
+    // A learned model only stays small for keys that grow close to linearly with their position,
+    // zip codes and coordinates jump around too much and keep binary search
+    if (index_layout_ == IndexLayout::LEARNED && field != CollisionField::CRASH_DATE && field != CollisionField::COLLISION_ID) {
+        return IndexLayout::SORTED;
+    }
+    return index_layout_;
+}
+
+void IndexedCollisions::build_index(const CollisionField& field) const {
+    visit_lazy_index(*this, field, [](const auto& items, const auto& lazy_index, auto&& build) {
+        lazy_index.get(build);
+    });
+    if (field == CollisionField::COLLISION_ID) {
+        get_collision_id_hash();
+    }
+}
+
+void IndexedCollisions::start_index_build(const CollisionField& field) const {
+    static_assert(static_cast<std::size_t>(CollisionField::UNDEFINED) <= 64, "One bit per CollisionField");
+    {
+        std::lock_guard<std::mutex> lock(index_builds_->mutex);
+        const std::uint64_t field_bit = std::uint64_t{1} << static_cast<std::size_t>(field);
+        if (index_builds_->started_builds & field_bit) {
+            return;
+        }
+        index_builds_->started_builds |= field_bit;
+    }
+
+    // The task only touches this once it is counted as running, which the destructor waits for
+    const std::shared_ptr<IndexBuildState> state = index_builds_;
+    ThreadPool::shared().submit(1, [this, state, field](std::size_t) {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (state->stop.stop_requested()) {
+                return;
             }
-            #pragma omp task
-            {
-                init_index(collisions_.numbers_of_persons_injured, sorted_numbers_of_persons_injured);
+            ++state->num_running_builds;
+        }
+        try {
+            build_index(field);
+        } catch (...) {
+            // Queries keep scanning the field
+        }
+        std::lock_guard<std::mutex> lock(state->mutex);
+        --state->num_running_builds;
+        state->builds_done.notify_all();
+    }, [](std::exception_ptr) {});
+}
+
+IndexedCollisions::~IndexedCollisions() {
+    std::unique_lock<std::mutex> lock(index_builds_->mutex);
+    index_builds_->stop.request_stop();
+    index_builds_->builds_done.wait(lock, [this]() { return index_builds_->num_running_builds == 0; });
+}
+
+bool IndexedCollisions::is_index_built(const CollisionField& field) const {
+    bool is_built = false;
+    visit_lazy_index(*this, field, [&](const auto& items, const auto& lazy_index, auto&& build) {
+        is_built = lazy_index.is_built();
+    });
+    return is_built;
+}
+
+void IndexedCollisions::build_all_indexes(std::stop_token stop_token) const {
+    zone_maps_.get([this](auto& zone_maps) { build_zone_maps(zone_maps); });
+
+    for (const auto& [composite_key, composite_index] : composite_indexes) {
+        if (stop_token.stop_requested()) {
+            return;
+        }
+        composite_index.get([&](CompositeIndex& index) { build_composite_index(composite_key, index); });
+    }
+
+    for (std::size_t field = 0; field < static_cast<std::size_t>(CollisionField::UNDEFINED); ++field) {
+        if (stop_token.stop_requested()) {
+            return;
+        }
+        if (is_indexed_field(static_cast<CollisionField>(field))) {
+            build_index(static_cast<CollisionField>(field));
+        }
+    }
+}
+
+const std::vector<std::uint32_t>& IndexedCollisions::get_cluster_order() const {
+    return cluster_order_;
+}
+
+const HashIndex& IndexedCollisions::get_collision_id_hash() const {
+    return collision_id_hash.get([&](HashIndex& index) { index = HashIndex(collisions_.collision_ids); });
+}
+
+std::uint32_t IndexedCollisions::find_collision_id(const std::size_t collision_id) const {
+    std::uint32_t row = HashIndex::NOT_FOUND;
+    find_collision_ids(std::span{&collision_id, 1}, std::span{&row, 1});
+    return row;
+}
+
+void IndexedCollisions::find_collision_ids(std::span<const std::size_t> collision_ids, std::span<std::uint32_t> rows) const {
+    if (collision_id_hash.is_built() || index_build_ == IndexBuild::ON_FIRST_USE) {
+        get_collision_id_hash().find(collision_ids, rows);
+        return;
+    }
+
+    std::unordered_map<std::size_t, std::vector<std::size_t>> indexes_by_id;
+    for (std::size_t index = 0; index < collision_ids.size(); ++index) {
+        indexes_by_id[collision_ids[index]].push_back(index);
+        rows[index] = HashIndex::NOT_FOUND;
+    }
+    for (std::uint32_t row = 0; row < collisions_.collision_ids.size() && !indexes_by_id.empty(); ++row) {
+        if (!collisions_.collision_ids[row].has_value()) {
+            continue;
+        }
+        const auto found = indexes_by_id.find(*collisions_.collision_ids[row]);
+        if (found != indexes_by_id.end()) {
+            for (const std::size_t index : found->second) {
+                rows[index] = row;
             }
-            #pragma omp task
-            {
-                init_index(collisions_.numbers_of_persons_killed, sorted_numbers_of_persons_killed);
+            indexes_by_id.erase(found);
+        }
+    }
+}
+
+bool IndexedCollisions::is_dictionary_field(const CollisionField& field) const {
+    bool is_string = false;
+    visit_column(collisions_, field, [&](const auto& items) {
+        using Item = typename std::decay_t<decltype(items)>::value_type::value_type;
+        is_string = std::is_same_v<Item, std::string>;
+    });
+    return is_string;
+}
+
+void IndexedCollisions::build_dictionary_index(const CollisionField& field) {
+    if (!is_dictionary_field(field)) {
+        throw std::runtime_error("Dictionary indexes are only supported for string fields");
+    }
+
+    visit_column(collisions_, field, [&](const auto& items) {
+        if constexpr (std::is_same_v<typename std::decay_t<decltype(items)>::value_type, std::optional<std::string>>) {
+            auto index = std::make_shared<DictionaryIndex>();
+
+            // Codes are handed out in order of first appearance, then remapped so they follow the sorted values
+            std::unordered_map<std::string_view, std::uint32_t> codes;
+            std::vector<std::uint32_t> row_codes(items.size());
+            for (std::size_t row = 0; row < items.size(); ++row) {
+                if (!items[row].has_value()) {
+                    continue;
+                }
+                const auto [code, inserted] = codes.try_emplace(*items[row], codes.size());
+                row_codes[row] = code->second;
             }
-            #pragma omp task
-            {
-                init_index(collisions_.numbers_of_pedestrians_injured, sorted_numbers_of_pedestrians_injured);
+
+            std::vector<std::string_view> values(codes.size());
+            for (const auto& [value, code] : codes) {
+                values[code] = value;
             }
-            #pragma omp task
-            {
-                init_index(collisions_.numbers_of_pedestrians_killed, sorted_numbers_of_pedestrians_killed);
+            std::vector<std::uint32_t> order(values.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&](const std::uint32_t first, const std::uint32_t second) {
+                return values[first] < values[second];
+            });
+            std::vector<std::uint32_t> sorted_codes(values.size());
+            for (std::uint32_t position = 0; position < order.size(); ++position) {
+                sorted_codes[order[position]] = position;
+                index->values.emplace_back(values[order[position]]);
             }
-            #pragma omp task
-            {
-                init_index(collisions_.numbers_of_cyclist_injured, sorted_numbers_of_cyclist_injured);
+
+            // Counting sort of the rows by code, rows without a value go to the bucket after the last code
+            const std::size_t null_bucket = values.size();
+            auto bucket = [&](const std::size_t row) -> std::size_t {
+                return items[row].has_value() ? sorted_codes[row_codes[row]] : null_bucket;
+            };
+            index->offsets.assign(null_bucket + 2, 0);
+            for (std::size_t row = 0; row < items.size(); ++row) {
+                index->offsets[bucket(row) + 1]++;
             }
-            #pragma omp task
-            {
-                init_index(collisions_.numbers_of_cyclist_killed, sorted_numbers_of_cyclist_killed);
+            std::partial_sum(index->offsets.begin(), index->offsets.end(), index->offsets.begin());
+
+            std::vector<std::uint32_t> next_positions(index->offsets.begin(), index->offsets.end() - 1);
+            index->rows.resize(items.size());
+            for (std::uint32_t row = 0; row < items.size(); ++row) {
+                index->rows[next_positions[bucket(row)]++] = row;
             }
-            #pragma omp task
-            {
-                init_index(collisions_.numbers_of_motorist_injured, sorted_numbers_of_motorist_injured);
+
+            dictionary_indexes_[static_cast<std::size_t>(field)].store(std::move(index));
+        }
+    });
+}
+
+void IndexedCollisions::drop_dictionary_index(const CollisionField& field) {
+    dictionary_indexes_[static_cast<std::size_t>(field)].store(nullptr);
+}
+
+std::size_t IndexedCollisions::dictionary_index_memory(const CollisionField& field) const {
+    const std::shared_ptr<const DictionaryIndex> index = dictionary_indexes_[static_cast<std::size_t>(field)].load();
+    return index ? index->memory_usage() : 0;
+}
+
+bool IndexedCollisions::dictionary_lookup(const FieldQuery& query,
+                                          const std::size_t max_rows,
+                                          std::vector<std::uint64_t>& rows) const {
+    // Held until the lookup is done, so the advisor can drop the index at any time
+    const std::shared_ptr<const DictionaryIndex> index = dictionary_indexes_[static_cast<std::size_t>(query.get_name())].load();
+    if (!index) {
+        return false;
+    }
+
+    // The predicate is evaluated once per distinct value, including the bucket of rows without a value
+    std::vector<std::pair<std::size_t, std::size_t>> ranges;
+    std::size_t num_rows = 0;
+    for (std::size_t code = 0; code <= index->values.size(); ++code) {
+        const std::optional<std::string> value = code < index->values.size() ?
+            std::optional<std::string>{index->values[code]} : std::nullopt;
+        if (do_match(query, value) != query.invert_match()) {
+            ranges.emplace_back(index->offsets[code], index->offsets[code + 1]);
+            num_rows += index->offsets[code + 1] - index->offsets[code];
+        }
+    }
+    if (num_rows > max_rows) {
+        return false;
+    }
+
+    rows.assign((proxies_.size() + 63) / 64, 0);
+    for (const auto& [first, last] : ranges) {
+        for (std::size_t position = first; position < last; ++position) {
+            const std::uint32_t row = index->rows[position];
+            rows[row / 64] |= std::uint64_t{1} << (row % 64);
+        }
+    }
+    return true;
+}
+
+void IndexedCollisions::init_cracking_indexes(const std::vector<CollisionField>& cracked_indexes) {
+    for (const CollisionField& field : cracked_indexes) {
+        if (is_indexed_field(field) || is_dictionary_field(field)) {
+            throw std::runtime_error("Cracking indexes are only supported for numeric fields without a sorted index");
+        }
+
+        // Only a copy of the column, the cracks do the rest
+        visit_column(collisions_, field, [&](const auto& items) {
+            if constexpr (!std::is_same_v<typename std::decay_t<decltype(items)>::value_type, std::optional<std::string>>) {
+                std::vector<std::uint32_t> keys;
+                std::vector<std::uint32_t> rows;
+                std::vector<std::uint32_t> null_rows;
+                for (std::uint32_t index = 0; index < items.size(); ++index) {
+                    if (items[index].has_value()) {
+                        keys.push_back(index_key(*items[index]));
+                        rows.push_back(index);
+                    } else {
+                        null_rows.push_back(index);
+                    }
+                }
+                rows.insert(rows.end(), null_rows.begin(), null_rows.end());
+                cracking_indexes_[static_cast<std::size_t>(field)] = std::make_unique<CrackingIndex>(std::move(keys), std::move(rows));
             }
-            #pragma omp task
-            {
-                init_index(collisions_.numbers_of_motorist_killed, sorted_numbers_of_motorist_killed);
+        });
+    }
+}
+
+const CrackingIndex* IndexedCollisions::get_cracking_index(const CollisionField& field) const {
+    return cracking_indexes_[static_cast<std::size_t>(field)].get();
+}
+
+bool IndexedCollisions::cracking_lookup(const FieldQuery& query,
+                                        const std::size_t max_rows,
+                                        std::vector<std::uint64_t>& rows) const {
+    CrackingIndex* index = cracking_indexes_[static_cast<std::size_t>(query.get_name())].get();
+    if (index == nullptr) {
+        return false;
+    }
+
+    // Keys of the query as a range [low, high), bounds go one past the largest 32 bit key
+    const std::uint64_t end_key = std::uint64_t{1} << 32;
+    std::uint64_t low = 0;
+    std::uint64_t high = end_key;
+    if (query.get_type() != QueryType::HAS_VALUE) {
+        visit_column(collisions_, query.get_name(), [&](const auto& items) {
+            using Item = typename std::decay_t<decltype(items)>::value_type::value_type;
+            if constexpr (!std::is_same_v<Item, std::string>) {
+                const std::uint64_t key = index_key(std::get<Item>(query.get_value()));
+                switch (query.get_type()) {
+                case QueryType::EQUALS:
+                    low = key;
+                    high = key + 1;
+                    break;
+                case QueryType::LESS_THAN:
+                    high = key;
+                    break;
+                case QueryType::GREATER_THAN:
+                    low = key + 1;
+                    break;
+                default:
+                    throw std::runtime_error("Unsupported QueryType for indexed field");
+                }
             }
-            #pragma omp task
-            {
-                init_index(collisions_.collision_ids, sorted_collision_ids);
+        });
+    }
+
+    bool found = false;
+    index->with_range(low, high, [&](const std::size_t first, const std::size_t last, const std::vector<std::uint32_t>& rows_by_value) {
+        // Same as a sorted index, rows without a value come last and only match a negated predicate
+        std::vector<std::pair<std::size_t, std::size_t>> ranges{{first, last}};
+        if (query.invert_match()) {
+            ranges = {{0, first}, {last, rows_by_value.size()}};
+        }
+
+        std::size_t num_rows = 0;
+        for (const auto& [range_first, range_last] : ranges) {
+            num_rows += range_last - range_first;
+        }
+        if (num_rows > max_rows) {
+            return;
+        }
+
+        rows.assign((proxies_.size() + 63) / 64, 0);
+        for (const auto& [range_first, range_last] : ranges) {
+            for (std::size_t position = range_first; position < range_last; ++position) {
+                const std::uint32_t index = rows_by_value[position];
+                rows[index / 64] |= std::uint64_t{1} << (index % 64);
             }
         }
+        found = true;
+    });
+    return found;
+}
+
+void IndexedCollisions::init_indexes(const std::vector<CollisionField>& eager_indexes) {
+    std::vector<CollisionField> sorted_fields;
+    std::vector<CollisionField> bucketed_fields;
+    for (const CollisionField& field : eager_indexes) {
+        if (!is_indexed_field(field)) {
+            throw std::runtime_error("CollisionField is not indexed");
+        }
+        visit_column(collisions_, field, [&](const auto& items) {
+            using Item = typename std::decay_t<decltype(items)>::value_type::value_type;
+            (std::is_same_v<Item, std::uint8_t> ? bucketed_fields : sorted_fields).push_back(field);
+        });
+    }
+
+    // Each sort runs on all threads by itself, so they are built one after another
+    for (const CollisionField& field : sorted_fields) {
+        build_index(field);
+    }
+
+    // A bucket index is a single cheap pass, so these are built side by side instead
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (std::size_t index = 0; index < bucketed_fields.size(); ++index) {
+        build_index(bucketed_fields[index]);
     }
 
 // TODO: support crash_times (requires converting all entries to durations for sorting comparisons to work)
 //    init_index(collisions_.crash_times, sorted_crash_times);
 }
 
-void IndexedCollisions::match(const FieldQuery& query,
-                       const std::size_t start_index,
-                       const std::size_t end_index,
-                       std::vector<std::uint8_t>& matches) const {
-    const CollisionField& name = query.get_name();
-
-    std::span<std::uint8_t> matches_span;
-    if (is_indexed_field(name)) {
-        // Send whole matches vector to match function
-        // because the indexes can reference anywhere in the global collisions
-        matches_span = {matches.data(), matches.size()};
+void IndexedCollisions::build_composite_index(const CompositeKey& composite_key, CompositeIndex& composite_index) const {
+    std::vector<std::uint64_t> leading_values(collisions_.crash_dates.size());
+    std::vector<std::uint8_t> has_leading_value(collisions_.crash_dates.size(), false);
+
+    if (composite_key == CompositeKey::BOROUGH_CRASH_DATE) {
+        std::vector<std::string>& borough_codes = composite_index.borough_codes;
+        for (const std::optional<std::string>& borough : collisions_.boroughs) {
+            if (borough.has_value()) {
+                borough_codes.push_back(*borough);
+            }
+        }
+        std::sort(borough_codes.begin(), borough_codes.end());
+        borough_codes.erase(std::unique(borough_codes.begin(), borough_codes.end()), borough_codes.end());
+
+        for (std::size_t index = 0; index < collisions_.boroughs.size(); ++index) {
+            if (collisions_.boroughs[index].has_value()) {
+                leading_values[index] = std::lower_bound(borough_codes.begin(), borough_codes.end(),
+                                                         *collisions_.boroughs[index]) - borough_codes.begin();
+                has_leading_value[index] = true;
+            }
+        }
     } else {
-        // Send subset of matches vector to match function
-        // because the indexes operated on will be inside the chunk only
-        matches_span = {matches.data() + start_index, end_index - start_index};
-    }
-
-    if (name == CollisionField::CRASH_DATE) {
-        match_indexed_field(query, start_index, end_index, collisions_.crash_dates, sorted_crash_dates, matches_span);
-    } else if (name == CollisionField::CRASH_TIME) {
-        match_field(query, start_index, end_index, collisions_.crash_times, matches_span);
-    } else if (name == CollisionField::BOROUGH) {
-        match_field(query, start_index, end_index, collisions_.boroughs, matches_span);
-    } else if (name == CollisionField::ZIP_CODE) {
-        match_indexed_field(query, start_index, end_index, collisions_.zip_codes, sorted_zip_codes, matches_span);
-    } else if (name == CollisionField::LATITUDE) {
-        match_indexed_field(query, start_index, end_index, collisions_.latitudes, sorted_latitudes, matches_span);
-    } else if (name == CollisionField::LONGITUDE) {
-        match_indexed_field(query, start_index, end_index, collisions_.longitudes, sorted_longitudes, matches_span);
-    } else if (name == CollisionField::LOCATION) {
-        match_field(query, start_index, end_index, collisions_.locations, matches_span);
-    } else if (name == CollisionField::ON_STREET_NAME) {
-        match_field(query, start_index, end_index, collisions_.on_street_names, matches_span);
-    } else if (name == CollisionField::CROSS_STREET_NAME) {
-        match_field(query, start_index, end_index, collisions_.cross_street_names, matches_span);
-    } else if (name == CollisionField::OFF_STREET_NAME) {
-        match_field(query, start_index, end_index, collisions_.off_street_names, matches_span);
-    } else if (name == CollisionField::NUMBER_OF_PERSONS_INJURED) {
-        match_indexed_field(query, start_index, end_index, collisions_.numbers_of_persons_injured, sorted_numbers_of_persons_injured, matches_span);
-    } else if (name == CollisionField::NUMBER_OF_PERSONS_KILLED) {
-        match_indexed_field(query, start_index, end_index, collisions_.numbers_of_persons_killed, sorted_numbers_of_persons_killed, matches_span);
-    } else if (name == CollisionField::NUMBER_OF_PEDESTRIANS_INJURED) {
-        match_indexed_field(query, start_index, end_index, collisions_.numbers_of_pedestrians_injured, sorted_numbers_of_pedestrians_injured, matches_span);
-    } else if (name == CollisionField::NUMBER_OF_PEDESTRIANS_KILLED) {
-        match_indexed_field(query, start_index, end_index, collisions_.numbers_of_pedestrians_killed, sorted_numbers_of_pedestrians_killed, matches_span);
-    } else if (name == CollisionField::NUMBER_OF_CYCLIST_INJURED) {
-        match_indexed_field(query, start_index, end_index, collisions_.numbers_of_cyclist_injured, sorted_numbers_of_cyclist_injured, matches_span);
-    } else if (name == CollisionField::NUMBER_OF_CYCLIST_KILLED) {
-        match_indexed_field(query, start_index, end_index, collisions_.numbers_of_cyclist_killed, sorted_numbers_of_cyclist_killed, matches_span);
-    } else if (name == CollisionField::NUMBER_OF_MOTORIST_INJURED) {
-        match_indexed_field(query, start_index, end_index, collisions_.numbers_of_motorist_injured, sorted_numbers_of_motorist_injured, matches_span);
-    } else if (name == CollisionField::NUMBER_OF_MOTORIST_KILLED) {
-        match_indexed_field(query, start_index, end_index, collisions_.numbers_of_motorist_killed, sorted_numbers_of_motorist_killed, matches_span);
-    } else if (name == CollisionField::CONTRIBUTING_FACTOR_VEHICLE_1) {
-        match_field(query, start_index, end_index, collisions_.contributing_factor_vehicles_1, matches_span);
-    } else if (name == CollisionField::CONTRIBUTING_FACTOR_VEHICLE_2) {
-        match_field(query, start_index, end_index, collisions_.contributing_factor_vehicles_2, matches_span);
-    } else if (name == CollisionField::CONTRIBUTING_FACTOR_VEHICLE_3) {
-        match_field(query, start_index, end_index, collisions_.contributing_factor_vehicles_3, matches_span);
-    } else if (name == CollisionField::CONTRIBUTING_FACTOR_VEHICLE_4) {
-        match_field(query, start_index, end_index, collisions_.contributing_factor_vehicles_4, matches_span);
-    } else if (name == CollisionField::CONTRIBUTING_FACTOR_VEHICLE_5) {
-        match_field(query, start_index, end_index, collisions_.contributing_factor_vehicles_5, matches_span);
-    } else if (name == CollisionField::COLLISION_ID) {
-        match_indexed_field(query, start_index, end_index, collisions_.collision_ids, sorted_collision_ids, matches_span);
-    } else if (name == CollisionField::VEHICLE_TYPE_CODE_1) {
-        match_field(query, start_index, end_index, collisions_.vehicle_type_codes_1, matches_span);
-    } else if (name == CollisionField::VEHICLE_TYPE_CODE_2) {
-        match_field(query, start_index, end_index, collisions_.vehicle_type_codes_2, matches_span);
-    } else if (name == CollisionField::VEHICLE_TYPE_CODE_3) {
-        match_field(query, start_index, end_index, collisions_.vehicle_type_codes_3, matches_span);
-    } else if (name == CollisionField::VEHICLE_TYPE_CODE_4) {
-        match_field(query, start_index, end_index, collisions_.vehicle_type_codes_4, matches_span);
-    } else if (name == CollisionField::VEHICLE_TYPE_CODE_5) {
-        match_field(query, start_index, end_index, collisions_.vehicle_type_codes_5, matches_span);
+        for (std::size_t index = 0; index < collisions_.zip_codes.size(); ++index) {
+            if (collisions_.zip_codes[index].has_value()) {
+                leading_values[index] = index_key(*collisions_.zip_codes[index]);
+                has_leading_value[index] = true;
+            }
+        }
+    }
+
+    // A composite lookup never matches a row missing either value, so those rows are left out entirely
+    std::vector<std::uint64_t> keys;
+    std::vector<std::uint32_t> rows;
+    for (std::uint32_t index = 0; index < collisions_.crash_dates.size(); ++index) {
+        if (has_leading_value[index] && collisions_.crash_dates[index].has_value()) {
+            keys.push_back(leading_values[index] << 32 | index_key(*collisions_.crash_dates[index]));
+            rows.push_back(index);
+        }
+    }
+
+    // Keys jump at every change of the leading value, which is what the leading field's own layout is chosen for
+    const CollisionField leading_field = composite_key == CompositeKey::BOROUGH_CRASH_DATE ? CollisionField::BOROUGH : CollisionField::ZIP_CODE;
+    radix_sort(keys, rows);
+    composite_index.index = SortedIndex<std::uint64_t>(std::move(keys), std::move(rows), get_index_layout(leading_field));
+}
+
+bool IndexedCollisions::composite_lookup(const Query& query,
+                                         const std::size_t max_rows,
+                                         std::vector<std::uint64_t>& rows,
+                                         std::vector<const FieldQuery*>& resolved_queries) const {
+    for (const auto& [composite_key, lazy_composite_index] : composite_indexes) {
+        const CompositeIndex* composite_index = lazy_composite_index.try_get();
+        if (composite_index == nullptr) {
+            continue;
+        }
+        const CollisionField leading_field = composite_key == CompositeKey::BOROUGH_CRASH_DATE ?
+            CollisionField::BOROUGH : CollisionField::ZIP_CODE;
+
+        const FieldQuery* leading_query = nullptr;
+        std::vector<const FieldQuery*> date_queries;
+        for (const FieldQuery& field_query : query.get()) {
+            if (field_query.invert_match()) {
+                continue;
+            }
+            if (field_query.get_name() == leading_field && field_query.get_type() == QueryType::EQUALS &&
+                !field_query.case_insensitive() && leading_query == nullptr) {
+                leading_query = &field_query;
+            } else if (field_query.get_name() == CollisionField::CRASH_DATE) {
+                date_queries.push_back(&field_query);
+            }
+        }
+        if (leading_query == nullptr || date_queries.empty()) {
+            continue;
+        }
+
+        // Every crash_date predicate narrows the same inclusive window of date keys
+        std::uint64_t first_date = 0;
+        std::uint64_t last_date = std::numeric_limits<std::uint32_t>::max();
+        for (const FieldQuery* date_query : date_queries) {
+            if (date_query->get_type() == QueryType::HAS_VALUE) {
+                continue;
+            }
+            const std::uint64_t date = index_key(std::get<std::chrono::year_month_day>(date_query->get_value()));
+            switch (date_query->get_type()) {
+            case QueryType::EQUALS:
+                first_date = std::max(first_date, date);
+                last_date = std::min(last_date, date);
+                break;
+            case QueryType::LESS_THAN:
+                if (date == 0) {
+                    first_date = 1;
+                    last_date = 0;
+                } else {
+                    last_date = std::min(last_date, date - 1);
+                }
+                break;
+            case QueryType::GREATER_THAN:
+                first_date = std::max(first_date, date + 1);
+                break;
+            default:
+                throw std::runtime_error("Unsupported QueryType for indexed field");
+            }
+        }
+
+        std::size_t first = 0;
+        std::size_t last = 0;
+        const std::vector<std::string>& borough_codes = composite_index->borough_codes;
+        if (composite_key == CompositeKey::BOROUGH_CRASH_DATE) {
+            const std::string& borough = std::get<std::string>(leading_query->get_value());
+            const auto code = std::lower_bound(borough_codes.begin(), borough_codes.end(), borough);
+            if (code != borough_codes.end() && *code == borough && first_date <= last_date) {
+                const std::uint64_t leading_value = code - borough_codes.begin();
+                first = composite_index->index.lower_bound(leading_value << 32 | first_date);
+                last = composite_index->index.upper_bound(leading_value << 32 | last_date);
+            }
+        } else if (first_date <= last_date) {
+            const std::uint64_t leading_value = index_key(std::get<std::uint32_t>(leading_query->get_value()));
+            first = composite_index->index.lower_bound(leading_value << 32 | first_date);
+            last = composite_index->index.upper_bound(leading_value << 32 | last_date);
+        }
+
+        // Another composite index on the query may still narrow it down enough
+        if (last - first > max_rows) {
+            continue;
+        }
+
+        rows.assign((proxies_.size() + 63) / 64, 0);
+        const std::vector<std::uint32_t>& rows_by_value = composite_index->index.rows();
+        for (std::size_t position = first; position < last; ++position) {
+            const std::uint32_t index = rows_by_value[position];
+            rows[index / 64] |= std::uint64_t{1} << (index % 64);
+        }
+
+        resolved_queries.push_back(leading_query);
+        resolved_queries.insert(resolved_queries.end(), date_queries.begin(), date_queries.end());
+        return true;
+    }
+    return false;
+}
+
+bool IndexedCollisions::lookup(const FieldQuery& query,
+                               const std::size_t max_rows,
+                               std::vector<std::uint64_t>& rows) const {
+    if (!is_indexed_field(query.get_name())) {
+        return cracking_lookup(query, max_rows, rows) || dictionary_lookup(query, max_rows, rows);
+    }
+
+    // Until its index is published the field is scanned, the first query on it starts the build for ON_FIRST_USE
+    if (!is_index_built(query.get_name())) {
+        if (index_build_ == IndexBuild::ON_FIRST_USE) {
+            start_index_build(query.get_name());
+        }
+        return false;
+    }
+
+    bool found = false;
+    visit_indexed_column(*this, query.get_name(), [&](const auto& items, const auto& items_index) {
+        const auto [first, last] = find_index_range(query, items, items_index);
+        const std::vector<std::uint32_t>& rows_by_value = index_rows(items_index);
+
+        // Rows without a value never match a predicate but always match its negation. They are sorted
+        // to the end of the index, so a negated range is the complement [0, first) and [last, size)
+        std::vector<std::pair<std::size_t, std::size_t>> ranges{{first, last}};
+        if (query.invert_match()) {
+            ranges = {{0, first}, {last, rows_by_value.size()}};
+        }
+
+        std::size_t num_rows = 0;
+        for (const auto& [range_first, range_last] : ranges) {
+            num_rows += range_last - range_first;
+        }
+        if (num_rows > max_rows) {
+            return;
+        }
+
+        // The ranges are resolved once for the whole table, afterwards every morsel only reads the bits of its own rows
+        rows.assign((items.size() + 63) / 64, 0);
+        for (const auto& [range_first, range_last] : ranges) {
+            for (std::size_t position = range_first; position < range_last; ++position) {
+                const std::uint32_t index = rows_by_value[position];
+                rows[index / 64] |= std::uint64_t{1} << (index % 64);
+            }
+        }
+        found = true;
+    });
+    return found;
+}
+
+std::vector<std::uint64_t> hash_rows(const Collisions& collisions) {
+    std::vector<std::uint64_t> hashes(collisions.crash_dates.size(), 0);
+    for (std::size_t field = 0; field < static_cast<std::size_t>(CollisionField::UNDEFINED); ++field) {
+        visit_column(collisions, static_cast<CollisionField>(field), [&](const auto& items) {
+            using Item = typename std::decay_t<decltype(items)>::value_type::value_type;
+
+            #pragma omp parallel for
+            for (std::size_t index = 0; index < hashes.size(); ++index) {
+                const auto& item = items[index];
+                std::uint64_t value = 0x9E3779B97F4A7C15ull;
+                if (item.has_value()) {
+                    if constexpr (std::is_same_v<Item, std::string>) {
+                        value = std::hash<std::string>{}(*item);
+                    } else {
+                        value = index_key(*item);
+                    }
+                }
+                hashes[index] = (std::rotl(hashes[index], 5) ^ value) * 0xFF51AFD7ED558CCDull;
+            }
+        });
+    }
+    return hashes;
+}
+
+const std::vector<std::uint64_t>& IndexedCollisions::get_row_hashes() const {
+    return row_hashes_.get([this](std::vector<std::uint64_t>& hashes) { hashes = hash_rows(collisions_); });
+}
+
+void IndexedCollisions::build_zone_maps(std::vector<std::vector<Zone>>& zone_maps) const {
+    const std::size_t num_fields = static_cast<std::size_t>(CollisionField::UNDEFINED);
+    zone_maps = std::vector<std::vector<Zone>>(num_fields);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (std::size_t field = 0; field < num_fields; ++field) {
+        visit_column(collisions_, static_cast<CollisionField>(field), [&](const auto& items) {
+            zone_maps[field] = build_zones(items, ZONE_SIZE);
+        });
+    }
+}
+
+bool IndexedCollisions::spatial_lookup(const Query& query, std::vector<std::uint64_t>& rows) const {
+    if (spatial_keys_.empty()) {
+        return false;
+    }
+
+    // Bounding box of the rows the query can match, from the coordinate predicates that narrow it
+    float min_latitude = -std::numeric_limits<float>::infinity();
+    float max_latitude = std::numeric_limits<float>::infinity();
+    float min_longitude = -std::numeric_limits<float>::infinity();
+    float max_longitude = std::numeric_limits<float>::infinity();
+    bool bounded = false;
+
+    for (const FieldQuery& field_query : query.get()) {
+        const CollisionField& name = field_query.get_name();
+        if ((name != CollisionField::LATITUDE && name != CollisionField::LONGITUDE) || field_query.invert_match() ||
+            field_query.get_type() == QueryType::HAS_VALUE) {
+            continue;
+        }
+
+        float& min = name == CollisionField::LATITUDE ? min_latitude : min_longitude;
+        float& max = name == CollisionField::LATITUDE ? max_latitude : max_longitude;
+        const float value = std::get<float>(field_query.get_value());
+
+        if (field_query.get_type() != QueryType::LESS_THAN) {
+            min = std::max(min, value);
+        }
+        if (field_query.get_type() != QueryType::GREATER_THAN) {
+            max = std::min(max, value);
+        }
+        bounded = true;
+    }
+
+    if (!bounded) {
+        return false;
     }
+
+    rows.assign((proxies_.size() + 63) / 64, 0);
+    for (const auto& [first_key, last_key] : spatial_grid_.cover(min_latitude, max_latitude, min_longitude, max_longitude, MAX_SPATIAL_RANGES)) {
+        const std::size_t first_row = std::lower_bound(spatial_keys_.begin(), spatial_keys_.end(), first_key) - spatial_keys_.begin();
+        const std::size_t last_row = std::upper_bound(spatial_keys_.begin(), spatial_keys_.end(), last_key) - spatial_keys_.begin();
+        for (std::size_t index = first_row; index < last_row; ++index) {
+            rows[index / 64] |= std::uint64_t{1} << (index % 64);
+        }
+    }
+    return true;
+}
+
+QueryPlan IndexedCollisions::plan(const Query& query, std::span<const std::uint64_t> erased_rows) const {
+    QueryPlan plan{};
+    const std::size_t max_index_rows = proxies_.size() / INDEX_SCAN_THRESHOLD;
+
+    auto add_candidates = [&plan](std::vector<std::uint64_t>& rows) {
+        if (!plan.use_candidates) {
+            plan.candidates = std::move(rows);
+            plan.use_candidates = true;
+        } else {
+            for (std::size_t word_index = 0; word_index < plan.candidates.size(); ++word_index) {
+                plan.candidates[word_index] &= rows[word_index];
+            }
+        }
+    };
+
+    // The box only narrows down the candidates, the coordinate predicates are still checked exactly on those
+    std::vector<std::uint64_t> rows;
+    const bool use_spatial = spatial_lookup(query, rows);
+    if (use_spatial) {
+        add_candidates(rows);
+    }
+
+    // Erased rows stay in the columns and indexes, every query drops them here
+    if (!erased_rows.empty()) {
+        std::vector<std::uint64_t> live_rows(erased_rows.size());
+        for (std::size_t word_index = 0; word_index < live_rows.size(); ++word_index) {
+            live_rows[word_index] = ~erased_rows[word_index];
+        }
+        add_candidates(live_rows);
+    }
+
+    // A composite range is exact, so its predicates are neither looked up again nor scanned
+    std::vector<const FieldQuery*> resolved_queries;
+    if (composite_lookup(query, max_index_rows, rows, resolved_queries)) {
+        add_candidates(rows);
+    }
+
+    for (const FieldQuery& field_query : query.get()) {
+        if (std::find(resolved_queries.begin(), resolved_queries.end(), &field_query) != resolved_queries.end()) {
+            continue;
+        }
+
+        const bool is_coordinate = field_query.get_name() == CollisionField::LATITUDE ||
+                                   field_query.get_name() == CollisionField::LONGITUDE;
+        if ((use_spatial && is_coordinate) || !lookup(field_query, max_index_rows, rows)) {
+            plan.scanned_queries.push_back(&field_query);
+        } else {
+            add_candidates(rows);
+        }
+    }
+
+    // Scanned predicates are checked against the zone maps once here instead of in every morsel
+    const std::vector<std::vector<Zone>>* zone_maps = zone_maps_.try_get();
+    if (!plan.scanned_queries.empty() && zone_maps != nullptr) {
+        const std::size_t num_zones = (proxies_.size() + ZONE_SIZE - 1) / ZONE_SIZE;
+        plan.zones = std::vector<std::uint8_t>(num_zones, true);
+        for (const FieldQuery* field_query : plan.scanned_queries) {
+            const std::vector<Zone>& zones = (*zone_maps)[static_cast<std::size_t>(field_query->get_name())];
+            for (std::size_t zone_index = 0; zone_index < num_zones; ++zone_index) {
+                plan.zones[zone_index] = plan.zones[zone_index] && zone_may_match(*field_query, zones[zone_index]);
+            }
+        }
+    }
+    return plan;
+}
+
+bool IndexedCollisions::init_selection(const QueryPlan& plan,
+                                       const std::size_t start_index,
+                                       const std::size_t end_index,
+                                       std::vector<std::uint8_t>& selection) const {
+    if (!plan.zones.empty()) {
+        bool any_zone_matches = false;
+        for (std::size_t zone_index = start_index / ZONE_SIZE; zone_index * ZONE_SIZE < end_index; ++zone_index) {
+            any_zone_matches = any_zone_matches || plan.zones[zone_index];
+        }
+        if (!any_zone_matches) {
+            selection.assign(end_index - start_index, false);
+            return false;
+        }
+    }
+
+    if (!plan.use_candidates) {
+        selection.assign(end_index - start_index, true);
+        return true;
+    }
+
+    selection.assign(end_index - start_index, false);
+    bool any_candidates = false;
+    for (std::size_t index = start_index; index < end_index; ++index) {
+        const bool candidate = (plan.candidates[index / 64] >> (index % 64)) & 1;
+        selection[index - start_index] = candidate;
+        any_candidates = any_candidates || candidate;
+    }
+    return any_candidates;
+}
+
+void IndexedCollisions::match(const FieldQuery& query,
+                              const std::size_t start_index,
+                              const std::size_t end_index,
+                              std::span<std::uint8_t> matches) const {
+    visit_column(collisions_, query.get_name(), [&](const auto& items) {
+        match_field(query, start_index, end_index, items, matches);
+    });
+}
+
+void IndexedCollisions::match_batch(const CollisionField& name,
+                                    std::span<const BatchPredicate> predicates,
+                                    const std::size_t start_index,
+                                    const std::size_t end_index,
+                                    std::span<std::vector<std::uint8_t>> selections) const {
+    visit_column(collisions_, name, [&](const auto& items) {
+        match_field_batch(predicates, start_index, end_index, items, selections);
+    });
 }
 
 std::ostream& operator<<(std::ostream& os, const CollisionProxy& collision) {
@@ -506,6 +1411,40 @@ std::ostream& operator<<(std::ostream& os, const CollisionProxy& collision) {
     return os;
 }
 
+Collision to_collision(const CollisionProxy& proxy) {
+    Collision collision{};
+    collision.crash_date = *proxy.crash_date;
+    collision.crash_time = *proxy.crash_time;
+    collision.borough = *proxy.borough;
+    collision.zip_code = *proxy.zip_code;
+    collision.latitude = *proxy.latitude;
+    collision.longitude = *proxy.longitude;
+    collision.location = *proxy.location;
+    collision.on_street_name = *proxy.on_street_name;
+    collision.cross_street_name = *proxy.cross_street_name;
+    collision.off_street_name = *proxy.off_street_name;
+    collision.number_of_persons_injured = *proxy.number_of_persons_injured;
+    collision.number_of_persons_killed = *proxy.number_of_persons_killed;
+    collision.number_of_pedestrians_injured = *proxy.number_of_pedestrians_injured;
+    collision.number_of_pedestrians_killed = *proxy.number_of_pedestrians_killed;
+    collision.number_of_cyclist_injured = *proxy.number_of_cyclist_injured;
+    collision.number_of_cyclist_killed = *proxy.number_of_cyclist_killed;
+    collision.number_of_motorist_injured = *proxy.number_of_motorist_injured;
+    collision.number_of_motorist_killed = *proxy.number_of_motorist_killed;
+    collision.contributing_factor_vehicle_1 = *proxy.contributing_factor_vehicle_1;
+    collision.contributing_factor_vehicle_2 = *proxy.contributing_factor_vehicle_2;
+    collision.contributing_factor_vehicle_3 = *proxy.contributing_factor_vehicle_3;
+    collision.contributing_factor_vehicle_4 = *proxy.contributing_factor_vehicle_4;
+    collision.contributing_factor_vehicle_5 = *proxy.contributing_factor_vehicle_5;
+    collision.collision_id = *proxy.collision_id;
+    collision.vehicle_type_code_1 = *proxy.vehicle_type_code_1;
+    collision.vehicle_type_code_2 = *proxy.vehicle_type_code_2;
+    collision.vehicle_type_code_3 = *proxy.vehicle_type_code_3;
+    collision.vehicle_type_code_4 = *proxy.vehicle_type_code_4;
+    collision.vehicle_type_code_5 = *proxy.vehicle_type_code_5;
+    return collision;
+}
+
 void Collisions::add(const Collision& collision) {
     crash_dates.push_back(collision.crash_date);
     crash_times.push_back(collision.crash_time);
@@ -574,6 +1513,23 @@ void Collisions::combine(const Collisions& other) {
     size_ = crash_dates.size();
 }
 
+void Collisions::permute(const std::vector<std::uint32_t>& order) {
+    const std::size_t num_fields = static_cast<std::size_t>(CollisionField::UNDEFINED);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (std::size_t field = 0; field < num_fields; ++field) {
+        visit_column(*this, static_cast<CollisionField>(field), [&order](auto& items) {
+            std::remove_reference_t<decltype(items)> permuted_items;
+            permuted_items.reserve(order.size());
+            for (const std::uint32_t index : order) {
+                permuted_items.push_back(std::move(items[index]));
+            }
+            items = std::move(permuted_items);
+        });
+    }
+    size_ = order.size();
+}
+
 std::size_t Collisions::size() {
     return size_;
 }
@@ -1,12 +1,24 @@
 #pragma once
 
+#include "collision_index.hpp"
 #include "query.hpp"
+#include "spatial_index.hpp"
 
+#include <array>
 #include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <format>
 #include <optional>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 
 struct Collision {
@@ -106,16 +118,136 @@ struct Collisions {
 
     void add(const Collision& collision);
     void combine(const Collisions& other);
+
+    // Reorder all columns so that row index becomes row order[index], rows missing from order are dropped
+    void permute(const std::vector<std::uint32_t>& order);
     std::size_t size();
 
 private:
     std::size_t size_;
 };
 
+// Call func with the column that stores the given field
+template<class CollisionsType, class Func>
+void visit_column(CollisionsType& collisions, const CollisionField& name, Func&& func) {
+    switch (name) {
+        case CollisionField::CRASH_DATE: func(collisions.crash_dates); break;
+        case CollisionField::CRASH_TIME: func(collisions.crash_times); break;
+        case CollisionField::BOROUGH: func(collisions.boroughs); break;
+        case CollisionField::ZIP_CODE: func(collisions.zip_codes); break;
+        case CollisionField::LATITUDE: func(collisions.latitudes); break;
+        case CollisionField::LONGITUDE: func(collisions.longitudes); break;
+        case CollisionField::LOCATION: func(collisions.locations); break;
+        case CollisionField::ON_STREET_NAME: func(collisions.on_street_names); break;
+        case CollisionField::CROSS_STREET_NAME: func(collisions.cross_street_names); break;
+        case CollisionField::OFF_STREET_NAME: func(collisions.off_street_names); break;
+        case CollisionField::NUMBER_OF_PERSONS_INJURED: func(collisions.numbers_of_persons_injured); break;
+        case CollisionField::NUMBER_OF_PERSONS_KILLED: func(collisions.numbers_of_persons_killed); break;
+        case CollisionField::NUMBER_OF_PEDESTRIANS_INJURED: func(collisions.numbers_of_pedestrians_injured); break;
+        case CollisionField::NUMBER_OF_PEDESTRIANS_KILLED: func(collisions.numbers_of_pedestrians_killed); break;
+        case CollisionField::NUMBER_OF_CYCLIST_INJURED: func(collisions.numbers_of_cyclist_injured); break;
+        case CollisionField::NUMBER_OF_CYCLIST_KILLED: func(collisions.numbers_of_cyclist_killed); break;
+        case CollisionField::NUMBER_OF_MOTORIST_INJURED: func(collisions.numbers_of_motorist_injured); break;
+        case CollisionField::NUMBER_OF_MOTORIST_KILLED: func(collisions.numbers_of_motorist_killed); break;
+        case CollisionField::CONTRIBUTING_FACTOR_VEHICLE_1: func(collisions.contributing_factor_vehicles_1); break;
+        case CollisionField::CONTRIBUTING_FACTOR_VEHICLE_2: func(collisions.contributing_factor_vehicles_2); break;
+        case CollisionField::CONTRIBUTING_FACTOR_VEHICLE_3: func(collisions.contributing_factor_vehicles_3); break;
+        case CollisionField::CONTRIBUTING_FACTOR_VEHICLE_4: func(collisions.contributing_factor_vehicles_4); break;
+        case CollisionField::CONTRIBUTING_FACTOR_VEHICLE_5: func(collisions.contributing_factor_vehicles_5); break;
+        case CollisionField::COLLISION_ID: func(collisions.collision_ids); break;
+        case CollisionField::VEHICLE_TYPE_CODE_1: func(collisions.vehicle_type_codes_1); break;
+        case CollisionField::VEHICLE_TYPE_CODE_2: func(collisions.vehicle_type_codes_2); break;
+        case CollisionField::VEHICLE_TYPE_CODE_3: func(collisions.vehicle_type_codes_3); break;
+        case CollisionField::VEHICLE_TYPE_CODE_4: func(collisions.vehicle_type_codes_4); break;
+        case CollisionField::VEHICLE_TYPE_CODE_5: func(collisions.vehicle_type_codes_5); break;
+        case CollisionField::UNDEFINED:
+        default:
+            throw std::runtime_error("Unknown CollisionField");
+    }
+}
+
+// Content hash of every row over all of its fields, rows with equal contents hash the same in any Collisions
+std::vector<std::uint64_t> hash_rows(const Collisions& collisions);
+
+// Physical order of the rows, established once at load time. Clustering rows that are queried together
+// makes their matches contiguous, so zone maps skip more and results are read from fewer cache lines.
+// LATITUDE_LONGITUDE orders rows along a Z-order curve, which turns latitude/longitude boxes into a few row ranges.
+enum class ClusterKey { NONE, CRASH_DATE, BOROUGH_CRASH_DATE, LATITUDE_LONGITUDE };
+
+// Indexes over (leading column, crash_date), so an equality on the leading column together with a
+// crash_date window resolves as a single contiguous index range
+enum class CompositeKey { BOROUGH_CRASH_DATE, ZIP_CODE_CRASH_DATE };
+
+// When the indexes that are not pinned in LoadOptions::eager_indexes are built.
+// ON_FIRST_USE starts building an index on a thread of its own in the first query on its field. That query
+// and every other one until the index is published scan the field instead. Zone maps and composite indexes
+// are built at load time.
+// BACKGROUND has the CollisionManager build the zone maps, composite indexes and every other index on a
+// background thread right after loading. Until an index is published, queries scan its field instead.
+enum class IndexBuild { ON_FIRST_USE, BACKGROUND };
+
+struct LoadOptions {
+    ClusterKey cluster_key = ClusterKey::NONE;
+    IndexLayout index_layout = IndexLayout::SORTED;
+    std::vector<CompositeKey> composite_indexes;
+
+    // Indexes of these fields are built at load time. Every other index is built the first time a query
+    // uses its field, so load time and memory only go to indexes that are actually used.
+    std::vector<CollisionField> eager_indexes;
+    IndexBuild index_build = IndexBuild::ON_FIRST_USE;
+
+    // Numeric fields without a sorted index, like crash_time, to index by cracking instead. Nothing is
+    // sorted at load time, every range query on the field refines the index a little further.
+    std::vector<CollisionField> cracked_indexes;
+};
+
+// One field predicate of a query in a batch, together with the position of that query in the batch
+struct BatchPredicate {
+    const FieldQuery* query;
+    std::size_t query_index;
+};
+
+// Summary of one block of rows of a column, used to skip blocks that cannot contain matches
+struct Zone {
+    std::size_t num_rows = 0;
+    std::size_t null_count = 0;
+
+    // Smallest and largest value in the block, unset for string columns and blocks without values
+    std::optional<Value> min;
+    std::optional<Value> max;
+
+    // Every distinct value of a string column in the block, unset if there are more than MAX_ZONE_VALUES
+    std::optional<std::vector<std::string>> values;
+};
+
+static constexpr std::size_t MAX_ZONE_VALUES = 16;
+
+// Returns false only if the zone metadata proves that no row in the block matches the query
+bool zone_may_match(const FieldQuery& query, const Zone& zone);
+
+// How a query is evaluated. Predicates that can use an index are resolved once up front into
+// a bitmap of candidate rows, the remaining predicates are checked row by row within each morsel.
+// Points into the query it was planned from, so it must not outlive that query.
+struct QueryPlan {
+    bool use_candidates = false;
+    std::vector<std::uint64_t> candidates;
+    std::vector<const FieldQuery*> scanned_queries;
+
+    // One entry per zone, false if the zone maps prove that none of its rows match. Empty if no zone can be skipped.
+    std::vector<std::uint8_t> zones;
+};
+
 class IndexedCollisions {
 public:
     IndexedCollisions();
-    IndexedCollisions(Collisions& collisions);
+    IndexedCollisions(Collisions collisions, const LoadOptions& options = LoadOptions{});
+
+    // Indexes built on first use point into it, so it stays where it was constructed
+    IndexedCollisions(const IndexedCollisions&) = delete;
+    IndexedCollisions& operator=(const IndexedCollisions&) = delete;
+
+    // Builds started on first use that have not begun yet are dropped, the ones running are waited for
+    ~IndexedCollisions();
 
     // Underlying data from csv
     Collisions collisions_;
@@ -124,31 +256,174 @@ public:
     std::vector<CollisionProxy> proxies_;
     std::vector<CollisionProxy*> proxy_ptrs_;
 
-    // Sorted indexes by various fields for fast queries
-    std::vector<std::uint32_t> sorted_crash_dates;
+    // Sorted indexes by various fields for fast queries, each built on first use unless listed in LoadOptions::eager_indexes
+    LazyIndex<SortedIndex<std::uint32_t>> sorted_crash_dates;
     std::vector<std::uint32_t> sorted_crash_times;
-    std::vector<std::uint32_t> sorted_zip_codes;
-    std::vector<std::uint32_t> sorted_latitudes;
-    std::vector<std::uint32_t> sorted_longitudes;
-    std::vector<std::uint32_t> sorted_numbers_of_persons_injured;
-    std::vector<std::uint32_t> sorted_numbers_of_persons_killed;
-    std::vector<std::uint32_t> sorted_numbers_of_pedestrians_injured;
-    std::vector<std::uint32_t> sorted_numbers_of_pedestrians_killed;
-    std::vector<std::uint32_t> sorted_numbers_of_cyclist_injured;
-    std::vector<std::uint32_t> sorted_numbers_of_cyclist_killed;
-    std::vector<std::uint32_t> sorted_numbers_of_motorist_injured;
-    std::vector<std::uint32_t> sorted_numbers_of_motorist_killed;
-    std::vector<std::uint32_t> sorted_collision_ids;
+    LazyIndex<SortedIndex<std::uint32_t>> sorted_zip_codes;
+    LazyIndex<SortedIndex<std::uint32_t>> sorted_latitudes;
+    LazyIndex<SortedIndex<std::uint32_t>> sorted_longitudes;
+
+    // The numbers_of_* columns only hold small counts, so they are indexed by value instead of sorted
+    LazyIndex<BucketIndex> bucketed_numbers_of_persons_injured;
+    LazyIndex<BucketIndex> bucketed_numbers_of_persons_killed;
+    LazyIndex<BucketIndex> bucketed_numbers_of_pedestrians_injured;
+    LazyIndex<BucketIndex> bucketed_numbers_of_pedestrians_killed;
+    LazyIndex<BucketIndex> bucketed_numbers_of_cyclist_injured;
+    LazyIndex<BucketIndex> bucketed_numbers_of_cyclist_killed;
+    LazyIndex<BucketIndex> bucketed_numbers_of_motorist_injured;
+    LazyIndex<BucketIndex> bucketed_numbers_of_motorist_killed;
+
+    LazyIndex<SortedIndex<std::uint64_t>> sorted_collision_ids;
+
+    // For point lookups by collision_id
+    LazyIndex<HashIndex> collision_id_hash;
+
+    // Entries are keyed by (leading value << 32 | crash_date key), only rows that have both values are indexed
+    struct CompositeIndex {
+        SortedIndex<std::uint64_t> index;
+
+        // Distinct boroughs in sorted order, the leading value of a borough is its position here. Empty when led by zip code.
+        std::vector<std::string> borough_codes;
+    };
+    std::vector<std::pair<CompositeKey, LazyIndex<CompositeIndex>>> composite_indexes;
 
+    // Index lookups matching more than 1 / INDEX_SCAN_THRESHOLD of all rows are cheaper to evaluate by scanning
+    static constexpr std::size_t INDEX_SCAN_THRESHOLD = 4;
+
+    // Rows per zone of the zone maps, a multiple of the morsel size so a morsel never spans two zones
+    static constexpr std::size_t ZONE_SIZE = 64 * 1024;
+
+    // Upper bound on the number of Z-order key ranges a latitude/longitude box is decomposed into
+    static constexpr std::size_t MAX_SPATIAL_RANGES = 64;
+
+    // erased_rows holds one bit per row, set for rows that no query may return anymore. Empty if there are none.
+    QueryPlan plan(const Query& query, std::span<const std::uint64_t> erased_rows = {}) const;
+
+    // Content hash of every row over all of its fields, computed on the first request
+    const std::vector<std::uint64_t>& get_row_hashes() const;
+
+    // Row of the collisions given to the constructor that each row was moved from by clustering, empty if unclustered
+    const std::vector<std::uint32_t>& get_cluster_order() const;
+
+    // Build the index of an indexed field now if it has not been built yet, or wait for the build in progress
+    void build_index(const CollisionField& field) const;
+    bool is_index_built(const CollisionField& field) const;
+
+    // Build the zone maps, the composite indexes and then every index that is not built yet.
+    // Stops between two indexes once a stop is requested.
+    void build_all_indexes(std::stop_token stop_token) const;
+
+    const HashIndex& get_collision_id_hash() const;
+
+    // First row holding each collision_id, HashIndex::NOT_FOUND if none does. Probes the collision_id hash index if
+    // it is built or indexes are built on first use. Otherwise the column is scanned once for all of them, rather
+    // than building the index on the caller's thread ahead of the background builder.
+    std::uint32_t find_collision_id(const std::size_t collision_id) const;
+    void find_collision_ids(std::span<const std::size_t> collision_ids, std::span<std::uint32_t> rows) const;
+
+    // Dictionary indexes of the string fields. These are not built by default, the index advisor
+    // builds and drops them while queries run.
+    bool is_dictionary_field(const CollisionField& field) const;
+    void build_dictionary_index(const CollisionField& field);
+    void drop_dictionary_index(const CollisionField& field);
+    // Memory used by the dictionary index of field, 0 if it has none
+    std::size_t dictionary_index_memory(const CollisionField& field) const;
+
+    // The cracking index of a field from LoadOptions::cracked_indexes, nullptr for other fields
+    const CrackingIndex* get_cracking_index(const CollisionField& field) const;
+
+    // Layout of every sorted index, except that LEARNED is only used where the keys suit it
+    IndexLayout get_index_layout(const CollisionField& field) const;
+
+    // Set a bit in rows for every row matching the query, using the sorted index of its field.
+    // Negated queries set the complement of the matching index range, including rows without a value.
+    // Returns false without touching rows if the field is not indexed or more than max_rows rows match.
+    bool lookup(const FieldQuery& query, const std::size_t max_rows, std::vector<std::uint64_t>& rows) const;
+
+    // Set a bit in rows for every row in the latitude/longitude box of the query, and possibly some rows close to it.
+    // Returns false if the rows are not clustered by LATITUDE_LONGITUDE or the query does not bound either coordinate.
+    bool spatial_lookup(const Query& query, std::vector<std::uint64_t>& rows) const;
+
+    // Set a bit in rows for every row matching both the equality on the leading column of a composite index and
+    // every crash_date predicate of the query, and add those predicates to resolved_queries.
+    // Returns false if no composite index applies or more than max_rows rows match.
+    bool composite_lookup(const Query& query,
+                          const std::size_t max_rows,
+                          std::vector<std::uint64_t>& rows,
+                          std::vector<const FieldQuery*>& resolved_queries) const;
+
+    // Initialize selection for the rows in [start_index, end_index) from the candidates of the plan.
+    // Returns false if none of these rows can match, either because there are no candidates or the zones are skipped.
+    bool init_selection(const QueryPlan& plan,
+                        const std::size_t start_index,
+                        const std::size_t end_index,
+                        std::vector<std::uint8_t>& selection) const;
+
+    // Scan the rows in [start_index, end_index), matches holds one entry per row of that range
     void match(const FieldQuery& query,
                const std::size_t start_index,
                const std::size_t end_index,
-               std::vector<std::uint8_t>& matches) const;
+               std::span<std::uint8_t> matches) const;
+
+    // Evaluate predicates from many queries that all target the same field in a single pass over its column.
+    // selections[query_index] holds one entry per row of [start_index, end_index) for each query in the batch.
+    void match_batch(const CollisionField& name,
+                     std::span<const BatchPredicate> predicates,
+                     const std::size_t start_index,
+                     const std::size_t end_index,
+                     std::span<std::vector<std::uint8_t>> selections) const;
 
 private:
+    void cluster(const ClusterKey& cluster_key);
+    void cluster_spatially(std::vector<std::uint32_t>& order);
     void init_proxies();
-    void init_indexes();
+    void init_indexes(const std::vector<CollisionField>& eager_indexes);
+    void build_composite_index(const CompositeKey& composite_key, CompositeIndex& composite_index) const;
+    void build_zone_maps(std::vector<std::vector<Zone>>& zone_maps) const;
+    bool dictionary_lookup(const FieldQuery& query, const std::size_t max_rows, std::vector<std::uint64_t>& rows) const;
+    bool cracking_lookup(const FieldQuery& query, const std::size_t max_rows, std::vector<std::uint64_t>& rows) const;
+    void init_cracking_indexes(const std::vector<CollisionField>& cracked_indexes);
+
+    // Queues the build of the index of field on the shared thread pool, unless a build of it was started before
+    void start_index_build(const CollisionField& field) const;
+
+    IndexLayout index_layout_ = IndexLayout::SORTED;
+    IndexBuild index_build_ = IndexBuild::ON_FIRST_USE;
+
+    // Zones of every column, indexed by CollisionField
+    LazyIndex<std::vector<std::vector<Zone>>> zone_maps_;
+
+    LazyIndex<std::vector<std::uint64_t>> row_hashes_;
+
+    // Indexed by CollisionField, empty slots for fields that are not strings
+    std::vector<SwappableIndex<DictionaryIndex>> dictionary_indexes_ =
+        std::vector<SwappableIndex<DictionaryIndex>>(static_cast<std::size_t>(CollisionField::UNDEFINED));
+
+    // Indexed by CollisionField, nullptr for fields that are not cracked
+    std::vector<std::unique_ptr<CrackingIndex>> cracking_indexes_ =
+        std::vector<std::unique_ptr<CrackingIndex>>(static_cast<std::size_t>(CollisionField::UNDEFINED));
+
+    // Z-order keys of the rows that have both a latitude and a longitude, only when clustered by LATITUDE_LONGITUDE.
+    // These rows come first and are sorted by key, so spatial_keys_[index] is the key of row index.
+    SpatialGrid spatial_grid_;
+    std::vector<std::uint32_t> spatial_keys_;
     const CollisionProxy index_to_collision(const std::size_t index);
+
+    std::vector<std::uint32_t> cluster_order_;
+
+    // Builds started on first use. Shared with the pool tasks, which may only get to run after the collisions are gone.
+    struct IndexBuildState {
+        std::mutex mutex;
+        std::condition_variable builds_done;
+        std::stop_source stop;
+        // One bit per CollisionField
+        std::uint64_t started_builds = 0;
+        std::size_t num_running_builds = 0;
+    };
+    std::shared_ptr<IndexBuildState> index_builds_ = std::make_shared<IndexBuildState>();
 };
 
 std::ostream& operator<<(std::ostream& os, const CollisionProxy& collision);
+
+// A copy of the fields a proxy points to
+Collision to_collision(const CollisionProxy& proxy);
@@ -0,0 +1,140 @@
+#include "collision_index.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <span>
+#include <utility>
+#include <vector>
+
+
+void HashIndex::init_slots(const std::size_t num_keys) {
+    const std::size_t num_slots = std::bit_ceil(std::max<std::size_t>(2 * num_keys, 16));
+    slots_ = std::vector<Slot>(num_slots, Slot{0, NOT_FOUND});
+    shift_ = 64 - std::countr_zero(num_slots);
+}
+
+std::size_t HashIndex::home_slot(const std::size_t key) const {
+    // Fibonacci hashing, the top bits of the product are well mixed even for sequential keys
+    return (key * 0x9E3779B97F4A7C15ull) >> shift_;
+}
+
+void HashIndex::insert(const std::size_t key, const std::uint32_t row) {
+    const std::size_t mask = slots_.size() - 1;
+    for (std::size_t slot = home_slot(key); ; slot = (slot + 1) & mask) {
+        if (slots_[slot].row == NOT_FOUND) {
+            slots_[slot] = Slot{key, row};
+            return;
+        }
+        if (slots_[slot].key == key) {
+            return;
+        }
+    }
+}
+
+std::uint32_t HashIndex::find(const std::size_t key) const {
+    if (slots_.empty()) {
+        return NOT_FOUND;
+    }
+
+    const std::size_t mask = slots_.size() - 1;
+    for (std::size_t slot = home_slot(key); ; slot = (slot + 1) & mask) {
+        const Slot& candidate = slots_[slot];
+        if (candidate.row == NOT_FOUND || candidate.key == key) {
+            return candidate.row;
+        }
+    }
+}
+
+void HashIndex::find(std::span<const std::size_t> keys, std::span<std::uint32_t> rows) const {
+    constexpr std::size_t BATCH_SIZE = 16;
+
+    for (std::size_t first = 0; first < keys.size(); first += BATCH_SIZE) {
+        const std::size_t last = std::min(first + BATCH_SIZE, keys.size());
+
+        if (!slots_.empty()) {
+            for (std::size_t index = first; index < last; ++index) {
+                __builtin_prefetch(&slots_[home_slot(keys[index])]);
+            }
+        }
+
+        for (std::size_t index = first; index < last; ++index) {
+            rows[index] = find(keys[index]);
+        }
+    }
+}
+
+std::size_t HashIndex::memory_usage() const {
+    return slots_.size() * sizeof(Slot);
+}
+
+CrackingIndex::CrackingIndex(std::vector<std::uint32_t> keys, std::vector<std::uint32_t> rows)
+  : keys_{std::move(keys)},
+    rows_{std::move(rows)}
+{
+    pieces_.emplace(0, Piece{0, false});
+}
+
+std::size_t CrackingIndex::num_values() const {
+    return keys_.size();
+}
+
+std::size_t CrackingIndex::num_pieces() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pieces_.size();
+}
+
+std::size_t CrackingIndex::crack(const std::uint64_t key) {
+    auto next = pieces_.upper_bound(key);
+    auto piece = std::prev(next);
+    if (piece->first == key) {
+        return piece->second.position;
+    }
+
+    const std::size_t first = piece->second.position;
+    const std::size_t last = next == pieces_.end() ? keys_.size() : next->second.position;
+
+    // Small pieces are sorted once, after which every crack inside them is a binary search
+    if (!piece->second.sorted && last - first <= SORT_PIECE_SIZE) {
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> entries;
+        entries.reserve(last - first);
+        for (std::size_t position = first; position < last; ++position) {
+            entries.emplace_back(keys_[position], rows_[position]);
+        }
+        std::sort(entries.begin(), entries.end());
+        for (std::size_t position = first; position < last; ++position) {
+            keys_[position] = entries[position - first].first;
+            rows_[position] = entries[position - first].second;
+        }
+        piece->second.sorted = true;
+    }
+
+    std::size_t position;
+    if (piece->second.sorted) {
+        position = std::lower_bound(keys_.begin() + first, keys_.begin() + last, key) - keys_.begin();
+    } else {
+        // Hoare style partition of the piece into keys less than key followed by the rest
+        std::size_t low = first;
+        std::size_t high = last;
+        while (true) {
+            while (low < high && keys_[low] < key) {
+                ++low;
+            }
+            while (low < high && keys_[high - 1] >= key) {
+                --high;
+            }
+            if (low >= high) {
+                break;
+            }
+            std::swap(keys_[low], keys_[high - 1]);
+            std::swap(rows_[low], rows_[high - 1]);
+        }
+        position = low;
+    }
+
+    pieces_.emplace_hint(next, key, Piece{position, piece->second.sorted});
+    return position;
+}
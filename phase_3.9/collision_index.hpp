@@ -0,0 +1,428 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Map keys to unsigned integers that sort in the same order, so they can be radix sorted
+// and compared without going back to the column
+inline std::uint32_t index_key(const float value) {
+    // -0 and 0 compare equal, so they get the same key
+    const std::uint32_t bits = std::bit_cast<std::uint32_t>(value == 0.0f ? 0.0f : value);
+    return (bits & 0x80000000u) ? ~bits : bits ^ 0x80000000u;
+}
+
+inline std::uint32_t index_key(const std::uint8_t value) {
+    return value;
+}
+
+inline std::uint32_t index_key(const std::uint32_t value) {
+    return value;
+}
+
+inline std::uint64_t index_key(const std::size_t value) {
+    return value;
+}
+
+inline std::uint32_t index_key(const std::chrono::hh_mm_ss<std::chrono::minutes>& value) {
+    return static_cast<std::uint32_t>(value.to_duration().count());
+}
+
+inline std::uint32_t index_key(const std::chrono::year_month_day& value) {
+    const std::int32_t days = std::chrono::sys_days{value}.time_since_epoch().count();
+    return static_cast<std::uint32_t>(days) ^ 0x80000000u;
+}
+
+// How the search structure of a SortedIndex is laid out in memory
+enum class IndexLayout {
+    // Binary search over the sorted keys
+    SORTED,
+    // Keys stored in breadth first order of the implicit search tree, so the first levels share
+    // a few cache lines and the next levels can be prefetched while the current one is compared
+    EYTZINGER,
+    // Piecewise linear model of key to position (PGM style) that predicts a position within
+    // LEARNED_MAX_ERROR of the answer, so only a small window of keys is searched. Best for keys that
+    // grow close to linearly with their position, like collision_id and crash_date.
+    LEARNED
+};
+
+// Row ids sorted by key, with the keys stored inline next to them so a search never touches the column.
+// Rows without a value come after all rows with a value.
+template<class Key>
+class SortedIndex {
+public:
+    SortedIndex() = default;
+
+    // keys and rows are sorted by key, rows is followed by the rows without a value
+    SortedIndex(std::vector<Key> keys, std::vector<std::uint32_t> rows, const IndexLayout layout)
+      : keys_{std::move(keys)},
+        rows_{std::move(rows)}
+    {
+        if (layout == IndexLayout::EYTZINGER) {
+            eytzinger_keys_.resize(keys_.size() + 1);
+            eytzinger_positions_.resize(keys_.size() + 1);
+            std::size_t position = 0;
+            init_eytzinger(1, position);
+        } else if (layout == IndexLayout::LEARNED) {
+            init_segments();
+        }
+    }
+
+    // Position of the first key that is not less than key, or num_values() if there is none
+    std::size_t lower_bound(const Key key) const {
+        if (!segments_.empty()) {
+            return learned_lower_bound(key);
+        }
+        return search(key, [](const Key first, const Key second) { return first < second; });
+    }
+
+    // Position of the first key that is greater than key, or num_values() if there is none
+    std::size_t upper_bound(const Key key) const {
+        if (!segments_.empty()) {
+            return key == std::numeric_limits<Key>::max() ? keys_.size() : learned_lower_bound(key + 1);
+        }
+        return search(key, [](const Key first, const Key second) { return first <= second; });
+    }
+
+    // Bytes used by the keys and the search structure, not counting the row ids
+    std::size_t memory_usage() const {
+        return keys_.size() * sizeof(Key) + eytzinger_keys_.size() * sizeof(Key) +
+               eytzinger_positions_.size() * sizeof(std::uint32_t) + segments_.size() * sizeof(Segment);
+    }
+
+    // Rows in key order, rows without a value last
+    const std::vector<std::uint32_t>& rows() const {
+        return rows_;
+    }
+
+    std::size_t num_values() const {
+        return keys_.size();
+    }
+
+    // Largest distance between the position a segment predicts for one of its keys and the actual position
+    static constexpr std::size_t LEARNED_MAX_ERROR = 32;
+
+private:
+    // Predicts first_position + slope * (key - first_key) for keys from first_key up to the next segment
+    struct Segment {
+        Key first_key;
+        double slope;
+        std::size_t first_position;
+    };
+
+    // Greedy shrinking cone: extend the segment while some slope keeps every distinct key within
+    // LEARNED_MAX_ERROR of its first position, then start a new one. A single pass over the keys.
+    void init_segments() {
+        const double max_error = LEARNED_MAX_ERROR;
+        double min_slope = 0.0;
+        double max_slope = std::numeric_limits<double>::infinity();
+
+        for (std::size_t position = 0; position < keys_.size(); ++position) {
+            if (position > 0 && keys_[position] == keys_[position - 1]) {
+                continue;
+            }
+
+            if (!segments_.empty()) {
+                const Segment& segment = segments_.back();
+                const double distance = static_cast<double>(keys_[position] - segment.first_key);
+                const double offset = static_cast<double>(position) - static_cast<double>(segment.first_position);
+                const double lowest_slope = (offset - max_error) / distance;
+                const double highest_slope = (offset + max_error) / distance;
+
+                if (lowest_slope <= max_slope && highest_slope >= min_slope) {
+                    min_slope = std::max(min_slope, lowest_slope);
+                    max_slope = std::min(max_slope, highest_slope);
+                    continue;
+                }
+                segments_.back().slope = std::isinf(max_slope) ? min_slope : (min_slope + max_slope) / 2;
+            }
+
+            segments_.push_back(Segment{keys_[position], 0.0, position});
+            min_slope = 0.0;
+            max_slope = std::numeric_limits<double>::infinity();
+        }
+
+        if (!segments_.empty()) {
+            segments_.back().slope = std::isinf(max_slope) ? min_slope : (min_slope + max_slope) / 2;
+        }
+    }
+
+    std::size_t learned_lower_bound(const Key key) const {
+        const std::size_t size = keys_.size();
+        auto segment = std::upper_bound(segments_.begin(), segments_.end(), key, [](const Key key, const Segment& segment) {
+            return key < segment.first_key;
+        });
+        if (segment == segments_.begin()) {
+            return 0;
+        }
+        --segment;
+
+        const double predicted = segment->first_position + segment->slope * static_cast<double>(key - segment->first_key);
+        const std::size_t position = std::min(static_cast<std::size_t>(std::max(predicted, 0.0)), size);
+
+        // The model bounds the error only for keys that are in the index. For other keys, widen the window
+        // until it is known to contain the answer: the key before it is smaller and the key at its end is not.
+        std::size_t first = position > LEARNED_MAX_ERROR ? position - LEARNED_MAX_ERROR : 0;
+        std::size_t last = std::min(position + LEARNED_MAX_ERROR + 1, size);
+        for (std::size_t step = 2 * LEARNED_MAX_ERROR; first > 0 && keys_[first - 1] >= key; step *= 2) {
+            first = first > step ? first - step : 0;
+        }
+        for (std::size_t step = 2 * LEARNED_MAX_ERROR; last < size && keys_[last - 1] < key; step *= 2) {
+            last = std::min(last + step, size);
+        }
+
+        return std::lower_bound(keys_.begin() + first, keys_.begin() + last, key) - keys_.begin();
+    }
+
+    // Number of keys in a cache line. Prefetching the node this many positions further down
+    // the Eytzinger order fetches all of its descendants a few levels down in one go.
+    static constexpr std::size_t KEYS_PER_CACHE_LINE = 64 / sizeof(Key);
+
+    // In order walk of the implicit tree assigns the sorted keys to their breadth first slots
+    void init_eytzinger(const std::size_t node, std::size_t& position) {
+        if (node > keys_.size()) {
+            return;
+        }
+        init_eytzinger(2 * node, position);
+        eytzinger_keys_[node] = keys_[position];
+        eytzinger_positions_[node] = position++;
+        init_eytzinger(2 * node + 1, position);
+    }
+
+    // Position of the first key for which goes_right(key_at_position, key) is false
+    template<class GoesRight>
+    std::size_t search(const Key key, GoesRight goes_right) const {
+        if (eytzinger_keys_.empty()) {
+            std::size_t first = 0;
+            std::size_t count = keys_.size();
+            while (count > 0) {
+                const std::size_t half = count / 2;
+                if (goes_right(keys_[first + half], key)) {
+                    first += half + 1;
+                    count -= half + 1;
+                } else {
+                    count = half;
+                }
+            }
+            return first;
+        }
+
+        const std::size_t size = keys_.size();
+        std::size_t node = 1;
+        while (node <= size) {
+            if (node * KEYS_PER_CACHE_LINE <= size) {
+                __builtin_prefetch(eytzinger_keys_.data() + node * KEYS_PER_CACHE_LINE);
+            }
+            node = 2 * node + goes_right(eytzinger_keys_[node], key);
+        }
+
+        // Undo the right turns taken after the last left turn, that left turn was at the answer
+        node >>= std::countr_one(node) + 1;
+        return node == 0 ? size : eytzinger_positions_[node];
+    }
+
+    std::vector<Key> keys_;
+    std::vector<std::uint32_t> rows_;
+
+    // Only filled for IndexLayout::EYTZINGER, slot 0 is unused
+    std::vector<Key> eytzinger_keys_;
+    std::vector<std::uint32_t> eytzinger_positions_;
+
+    // Only filled for IndexLayout::LEARNED
+    std::vector<Segment> segments_;
+};
+
+// Row ids grouped by value for a column of std::uint8_t, built in O(N) with a counting sort.
+// Rows with value v are rows[offsets[v]] up to rows[offsets[v + 1]], rows without a value come last,
+// so rows is ordered the same way as a sorted index and every lookup is a couple of offset reads.
+struct BucketIndex {
+    static constexpr std::size_t NULL_BUCKET = 256;
+
+    std::array<std::uint32_t, NULL_BUCKET + 2> offsets{};
+    std::vector<std::uint32_t> rows;
+};
+
+// Row ids grouped by the distinct values of a string column. A predicate is evaluated once per distinct value
+// instead of once per row, so any string predicate becomes a union of row ranges.
+// Rows with values[code] are rows[offsets[code]] up to rows[offsets[code + 1]], rows without a value come last.
+struct DictionaryIndex {
+    std::vector<std::string> values;
+    std::vector<std::uint32_t> offsets;
+    std::vector<std::uint32_t> rows;
+
+    std::size_t memory_usage() const {
+        std::size_t memory_usage = offsets.size() * sizeof(std::uint32_t) + rows.size() * sizeof(std::uint32_t);
+        for (const std::string& value : values) {
+            memory_usage += sizeof(std::string) + value.capacity();
+        }
+        return memory_usage;
+    }
+};
+
+// Open addressing hash table from a unique key to the row holding it, for point lookups without any search.
+// Linear probing at a load factor of at most one half, so a lookup usually reads a single cache line.
+class HashIndex {
+public:
+    static constexpr std::uint32_t NOT_FOUND = UINT32_MAX;
+
+    HashIndex() = default;
+
+    // keys[row] is the key of row, rows without a value are left out.
+    // If a key appears more than once, find returns the first row holding it.
+    template<class T>
+    HashIndex(const std::vector<T>& keys)
+    {
+        init_slots(keys.size());
+        for (std::uint32_t row = 0; row < keys.size(); ++row) {
+            if (keys[row].has_value()) {
+                insert(*keys[row], row);
+            }
+        }
+    }
+
+    std::uint32_t find(const std::size_t key) const;
+
+    // Same as calling find for each key, but looks up several keys at once so their cache misses overlap
+    void find(std::span<const std::size_t> keys, std::span<std::uint32_t> rows) const;
+
+    std::size_t memory_usage() const;
+
+private:
+    struct Slot {
+        std::size_t key;
+        std::uint32_t row;
+    };
+
+    void init_slots(const std::size_t num_keys);
+    void insert(const std::size_t key, const std::uint32_t row);
+    std::size_t home_slot(const std::size_t key) const;
+
+    std::vector<Slot> slots_;
+    unsigned shift_ = 64;
+};
+
+// Adaptive index (database cracking) over a copy of a column. Nothing is sorted up front, instead every range
+// lookup partitions the piece of the copy holding each of its bounds around that bound, so the pieces get smaller
+// as queries arrive. Pieces of at most SORT_PIECE_SIZE keys are sorted outright, so the copy converges to sorted order.
+// Safe to use from many threads at once, lookups take turns.
+class CrackingIndex {
+public:
+    static constexpr std::size_t SORT_PIECE_SIZE = 4096;
+
+    // keys[position] is the key of rows[position], in any order. rows is followed by the rows without a value.
+    CrackingIndex(std::vector<std::uint32_t> keys, std::vector<std::uint32_t> rows);
+
+    // Call func(first, last, rows) with the positions [first, last) of the keys in [low, high) after cracking at
+    // both bounds. Bounds go up to 2^32, so every key can be included. rows is in the order the cracks left it.
+    template<class Func>
+    void with_range(const std::uint64_t low, const std::uint64_t high, Func&& func) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const std::size_t first = crack(low);
+        const std::size_t last = std::max(first, crack(high));
+        func(first, last, static_cast<const std::vector<std::uint32_t>&>(rows_));
+    }
+
+    std::size_t num_values() const;
+    std::size_t num_pieces() const;
+
+private:
+    struct Piece {
+        // First position of the keys that are not less than the key of the piece
+        std::size_t position;
+        bool sorted;
+    };
+
+    // Position of the first key not less than key, splitting the piece that holds it if needed
+    std::size_t crack(const std::uint64_t key);
+
+    mutable std::mutex mutex_;
+    std::vector<std::uint32_t> keys_;
+    std::vector<std::uint32_t> rows_;
+
+    // Pieces by their smallest possible key, the piece of key 0 always starts at position 0
+    std::map<std::uint64_t, Piece> pieces_;
+};
+
+// An index that is only built the first time it is requested. Safe to request from many threads at once,
+// exactly one of them builds it while the others wait for it. The built index is published with a
+// release store, so a reader that sees is_built() also sees the whole index. Moving it moves the built index along.
+template<class Index>
+class LazyIndex {
+public:
+    LazyIndex()
+      : state_{std::make_unique<State>()}
+    {
+    }
+
+    // The index, built by calling build(index) on the first request
+    template<class Build>
+    const Index& get(Build&& build) const {
+        std::call_once(state_->once, [&]() {
+            build(state_->index);
+            state_->built.store(true, std::memory_order_release);
+        });
+        return state_->index;
+    }
+
+    // The index if it has been built, nullptr otherwise. Never waits for a build in progress.
+    const Index* try_get() const {
+        return is_built() ? &state_->index : nullptr;
+    }
+
+    bool is_built() const {
+        return state_->built.load(std::memory_order_acquire);
+    }
+
+private:
+    struct State {
+        std::once_flag once;
+        std::atomic<bool> built{false};
+        Index index;
+    };
+
+    std::unique_ptr<State> state_;
+};
+
+// An index that can be built, replaced and dropped while queries run. A reader keeps the index it loaded
+// alive until it is done with it, so dropping the index never pulls it out from under a query.
+template<class Index>
+class SwappableIndex {
+public:
+    SwappableIndex()
+      : state_{std::make_unique<State>()}
+    {
+    }
+
+    // The current index, nullptr if there is none
+    std::shared_ptr<const Index> load() const {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->index;
+    }
+
+    void store(std::shared_ptr<const Index> index) {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        state_->index = std::move(index);
+    }
+
+private:
+    struct State {
+        std::mutex mutex;
+        std::shared_ptr<const Index> index;
+    };
+
+    std::unique_ptr<State> state_;
+};
@@ -0,0 +1,329 @@
+#include "collision.hpp"
+#include "collision_index.hpp"
+#include "collision_parser.hpp"
+#include "collision_snapshot.hpp"
+#include "subscription_index.hpp"
+
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <utility>
+#include <vector>
+
+
+static std::unique_ptr<Collisions> collisions;
+static std::once_flag collisions_loaded;
+
+static Collisions& load_collisions() {
+    std::call_once(collisions_loaded, []() {
+        CollisionParser collision_parser{std::string("../Motor_Vehicle_Collisions_-_Crashes_20250123.csv")};
+        collisions = std::make_unique<Collisions>(collision_parser.parse());
+    });
+    return *collisions;
+}
+
+static std::vector<CollisionField> all_indexed_fields() {
+    std::vector<CollisionField> fields;
+    for (std::size_t field = 0; field < static_cast<std::size_t>(CollisionField::UNDEFINED); ++field) {
+        if (is_indexed_field(static_cast<CollisionField>(field))) {
+            fields.push_back(static_cast<CollisionField>(field));
+        }
+    }
+    return fields;
+}
+
+// Copying the columns, building the proxies, every index and the zone maps
+static void BM_BuildIndexedCollisions(benchmark::State& state) {
+    Collisions& all_collisions = load_collisions();
+    for (auto _ : state) {
+        IndexedCollisions indexed_collisions{all_collisions, LoadOptions{.eager_indexes = all_indexed_fields()}};
+        benchmark::DoNotOptimize(indexed_collisions);
+    }
+}
+
+// Same, but every index is left to be built on first use
+static void BM_BuildIndexedCollisionsLazily(benchmark::State& state) {
+    Collisions& all_collisions = load_collisions();
+    for (auto _ : state) {
+        IndexedCollisions indexed_collisions{all_collisions};
+        benchmark::DoNotOptimize(indexed_collisions);
+    }
+}
+
+// Time until queries can run when the zone maps and indexes are left to the background builder
+static void BM_BuildIndexedCollisionsForBackgroundIndexing(benchmark::State& state) {
+    Collisions& all_collisions = load_collisions();
+    for (auto _ : state) {
+        IndexedCollisions indexed_collisions{all_collisions, LoadOptions{.index_build = IndexBuild::BACKGROUND}};
+        benchmark::DoNotOptimize(indexed_collisions);
+    }
+}
+
+static void BM_BuildIndexedCollisionsClusteredByDate(benchmark::State& state) {
+    Collisions& all_collisions = load_collisions();
+    for (auto _ : state) {
+        IndexedCollisions indexed_collisions{all_collisions, LoadOptions{.cluster_key = ClusterKey::CRASH_DATE,
+                                                                         .eager_indexes = all_indexed_fields()}};
+        benchmark::DoNotOptimize(indexed_collisions);
+    }
+}
+
+// Random lookups into an index of the size of the collision_ids index, keys of the column are never touched
+static void BM_IndexLookup(benchmark::State& state) {
+    const IndexLayout layout = static_cast<IndexLayout>(state.range(0));
+    const std::size_t size = 2 * 1024 * 1024;
+
+    std::vector<std::uint64_t> keys(size);
+    std::iota(keys.begin(), keys.end(), 0);
+    for (std::uint64_t& key : keys) {
+        key *= 3;
+    }
+    std::vector<std::uint32_t> rows(size);
+    std::iota(rows.begin(), rows.end(), 0);
+    SortedIndex<std::uint64_t> index{keys, rows, layout};
+
+    std::mt19937_64 random{42};
+    std::uniform_int_distribution<std::uint64_t> distribution{0, 3 * size};
+    std::vector<std::uint64_t> lookups(4096);
+    for (std::uint64_t& lookup : lookups) {
+        lookup = distribution(random);
+    }
+
+    for (auto _ : state) {
+        for (const std::uint64_t lookup : lookups) {
+            benchmark::DoNotOptimize(index.lower_bound(lookup));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * lookups.size());
+}
+
+// Random lookups of keys that exist in a real column, with the bytes used by the keys and search structure
+template<class T>
+static void BM_ColumnIndexLookup(benchmark::State& state, std::vector<std::optional<T>> Collisions::* column) {
+    const IndexLayout layout = static_cast<IndexLayout>(state.range(0));
+    const std::vector<std::optional<T>>& values = load_collisions().*column;
+
+    using Key = decltype(index_key(std::declval<T>()));
+    std::vector<Key> keys;
+    for (const std::optional<T>& value : values) {
+        if (value.has_value()) {
+            keys.push_back(index_key(*value));
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    std::vector<std::uint32_t> rows(keys.size());
+    std::iota(rows.begin(), rows.end(), 0);
+    SortedIndex<Key> index{keys, rows, layout};
+
+    std::mt19937_64 random{42};
+    std::uniform_int_distribution<std::size_t> distribution{0, keys.size() - 1};
+    std::vector<Key> lookups(4096);
+    for (Key& lookup : lookups) {
+        lookup = keys[distribution(random)];
+    }
+
+    for (auto _ : state) {
+        for (const Key lookup : lookups) {
+            benchmark::DoNotOptimize(index.lower_bound(lookup));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * lookups.size());
+    state.counters["index_bytes"] = index.memory_usage();
+}
+
+// Plan and evaluate a query morsel by morsel on one thread, returns the number of matches
+static std::size_t evaluate(const IndexedCollisions& indexed_collisions, const Query& query) {
+    const std::size_t num_rows = indexed_collisions.proxies_.size();
+    const std::size_t morsel_size = 16 * 1024;
+    thread_local std::vector<std::uint8_t> selection;
+
+    const QueryPlan plan = indexed_collisions.plan(query);
+    std::size_t num_matches = 0;
+    for (std::size_t start_index = 0; start_index < num_rows; start_index += morsel_size) {
+        const std::size_t end_index = std::min(start_index + morsel_size, num_rows);
+        if (!indexed_collisions.init_selection(plan, start_index, end_index, selection)) {
+            continue;
+        }
+        for (const FieldQuery* field_query : plan.scanned_queries) {
+            indexed_collisions.match(*field_query, start_index, end_index, selection);
+        }
+        num_matches += std::count(selection.begin(), selection.end(), 1);
+    }
+    return num_matches;
+}
+
+// Planning and evaluating a borough + crash_date window query on one thread,
+// with and without the (borough, crash_date) composite index
+static void BM_EvaluateBoroughDateWindow(benchmark::State& state) {
+    LoadOptions options{};
+    if (state.range(0)) {
+        options.composite_indexes = {CompositeKey::BOROUGH_CRASH_DATE};
+    }
+    IndexedCollisions indexed_collisions{load_collisions(), options};
+
+    std::chrono::year_month_day date1{std::chrono::year{2021}, std::chrono::month{9}, std::chrono::day{1}};
+    std::chrono::year_month_day date2{std::chrono::year{2021}, std::chrono::month{10}, std::chrono::day{1}};
+    Query query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN")
+        .add(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date1)
+        .add(CollisionField::CRASH_DATE, QueryType::LESS_THAN, date2);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(evaluate(indexed_collisions, query));
+    }
+    state.counters["scanned_predicates"] = indexed_collisions.plan(query).scanned_queries.size();
+}
+
+// A street name filter scanned over every row, or resolved through a dictionary index as the index advisor would build
+static void BM_EvaluateStreetName(benchmark::State& state) {
+    IndexedCollisions indexed_collisions{load_collisions()};
+    if (state.range(0)) {
+        indexed_collisions.build_dictionary_index(CollisionField::ON_STREET_NAME);
+    }
+    Query query = Query::create(CollisionField::ON_STREET_NAME, QueryType::EQUALS, "BROADWAY");
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(evaluate(indexed_collisions, query));
+    }
+    state.counters["index_bytes"] = indexed_collisions.dictionary_index_memory(CollisionField::ON_STREET_NAME);
+}
+
+// Appending range(0) rows to the full table with every index built. Each append adds a segment and merges it with
+// the newest segments now and then. A reload costs a whole BM_BuildIndexedCollisions.
+static void BM_AppendRows(benchmark::State& state) {
+    Collisions& all_collisions = load_collisions();
+    const LoadOptions options{.eager_indexes = all_indexed_fields()};
+    std::shared_ptr<const CollisionSnapshot> snapshot = std::make_shared<const CollisionSnapshot>(all_collisions, options);
+
+    Collisions delta{};
+    for (std::size_t index = 0; index < static_cast<std::size_t>(state.range(0)); ++index) {
+        delta.add(Collision{.crash_date = all_collisions.crash_dates[index],
+                            .borough = all_collisions.boroughs[index],
+                            .zip_code = all_collisions.zip_codes[index],
+                            .collision_id = all_collisions.collision_ids[index]});
+    }
+
+    for (auto _ : state) {
+        snapshot = snapshot->apply(delta, {}, options);
+    }
+    state.counters["segments"] = snapshot->get_segments().size();
+}
+
+// One batch of new rows matched against range(0) standing queries, each a zip code with cyclists killed or a
+// borough with a crash_date window. The cost grows with the predicates the rows satisfy, not with the subscriptions.
+static void BM_MatchSubscriptions(benchmark::State& state) {
+    Collisions& all_collisions = load_collisions();
+    Collisions batch{};
+    for (std::size_t index = 0; index < 64 * 1024; ++index) {
+        batch.add(Collision{.crash_date = all_collisions.crash_dates[index],
+                            .borough = all_collisions.boroughs[index],
+                            .zip_code = all_collisions.zip_codes[index],
+                            .number_of_cyclist_killed = all_collisions.numbers_of_cyclist_killed[index],
+                            .collision_id = all_collisions.collision_ids[index]});
+    }
+
+    const std::vector<std::string> boroughs{"QUEENS", "BROOKLYN", "BRONX", "MANHATTAN", "STATEN ISLAND"};
+    SubscriptionIndex subscriptions;
+    for (std::size_t index = 0; index < static_cast<std::size_t>(state.range(0)); ++index) {
+        if (index % 2 == 0) {
+            subscriptions.subscribe(Query::create(CollisionField::NUMBER_OF_CYCLIST_KILLED, QueryType::GREATER_THAN, std::uint8_t{0})
+                                        .add(CollisionField::ZIP_CODE, QueryType::EQUALS, static_cast<std::uint32_t>(10000 + index / 2)));
+        } else {
+            const std::chrono::sys_days start = std::chrono::sys_days{std::chrono::year{2015}/1/1} + std::chrono::days{index % 3000};
+            subscriptions.subscribe(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, boroughs[index % boroughs.size()])
+                                        .add(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, std::chrono::year_month_day{start})
+                                        .add(CollisionField::CRASH_DATE, QueryType::LESS_THAN, std::chrono::year_month_day{start + std::chrono::days{7}}));
+        }
+    }
+
+    std::size_t num_matches = 0;
+    for (auto _ : state) {
+        num_matches = 0;
+        for (const SubscriptionMatch& match : subscriptions.match(batch)) {
+            num_matches += match.rows.size();
+        }
+    }
+    state.counters["matches"] = num_matches;
+}
+
+// Cumulative cost of range(1) random half hour crash_time windows, by scanning the column every time (0),
+// sorting a copy up front and binary searching it (1), or cracking a copy a little more with each window (2)
+static void BM_CrashTimeRangeQueries(benchmark::State& state) {
+    const auto& crash_times = load_collisions().crash_times;
+    std::mt19937 generator{42};
+    std::uniform_int_distribution<std::uint32_t> distribution{0, 24 * 60 - 30};
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> windows(state.range(1));
+    for (auto& [low, high] : windows) {
+        low = distribution(generator);
+        high = low + 30;
+    }
+
+    for (auto _ : state) {
+        std::size_t num_matches = 0;
+        if (state.range(0) == 0) {
+            for (const auto& [low, high] : windows) {
+                for (const auto& crash_time : crash_times) {
+                    num_matches += crash_time.has_value() && index_key(*crash_time) >= low && index_key(*crash_time) < high;
+                }
+            }
+            benchmark::DoNotOptimize(num_matches);
+            continue;
+        }
+
+        std::vector<std::uint32_t> keys;
+        std::vector<std::uint32_t> rows;
+        for (std::uint32_t index = 0; index < crash_times.size(); ++index) {
+            if (crash_times[index].has_value()) {
+                keys.push_back(index_key(*crash_times[index]));
+                rows.push_back(index);
+            }
+        }
+
+        if (state.range(0) == 1) {
+            std::sort(keys.begin(), keys.end());
+            for (const auto& [low, high] : windows) {
+                num_matches += std::lower_bound(keys.begin(), keys.end(), high) - std::lower_bound(keys.begin(), keys.end(), low);
+            }
+        } else {
+            CrackingIndex index{std::move(keys), std::move(rows)};
+            for (const auto& [low, high] : windows) {
+                index.with_range(low, high, [&](const std::size_t first, const std::size_t last, const auto&) {
+                    num_matches += last - first;
+                });
+            }
+            state.counters["pieces"] = index.num_pieces();
+        }
+        benchmark::DoNotOptimize(num_matches);
+    }
+}
+
+BENCHMARK(BM_BuildIndexedCollisions)->Iterations(5)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_BuildIndexedCollisionsLazily)->Iterations(5)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_BuildIndexedCollisionsForBackgroundIndexing)->Iterations(5)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_BuildIndexedCollisionsClusteredByDate)->Iterations(5)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK(BM_IndexLookup)->Arg(static_cast<int>(IndexLayout::SORTED))->Arg(static_cast<int>(IndexLayout::EYTZINGER))
+                        ->Arg(static_cast<int>(IndexLayout::LEARNED));
+
+BENCHMARK_CAPTURE(BM_ColumnIndexLookup, collision_ids, &Collisions::collision_ids)
+    ->Arg(static_cast<int>(IndexLayout::SORTED))
+    ->Arg(static_cast<int>(IndexLayout::EYTZINGER))
+    ->Arg(static_cast<int>(IndexLayout::LEARNED));
+BENCHMARK_CAPTURE(BM_ColumnIndexLookup, crash_dates, &Collisions::crash_dates)
+    ->Arg(static_cast<int>(IndexLayout::SORTED))
+    ->Arg(static_cast<int>(IndexLayout::EYTZINGER))
+    ->Arg(static_cast<int>(IndexLayout::LEARNED));
+
+BENCHMARK(BM_EvaluateBoroughDateWindow)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_EvaluateStreetName)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_AppendRows)->Arg(1000)->Arg(10000)->Iterations(50)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_MatchSubscriptions)->Arg(1)->Arg(100)->Arg(1000)->Arg(10000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_CrashTimeRangeQueries)->ArgsProduct({{0, 1, 2}, {1, 10, 100, 1000}})->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -2,33 +2,367 @@
 
 #include "collision_parser.hpp"
 #include "query.hpp"
+#include "query_cache.hpp"
+#include "thread_pool.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
 #include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
 
 #include <omp.h>
 
-CollisionManager::CollisionManager(const std::string& filename) {
+namespace {
+
+// Morsels are pulled one at a time by whichever thread is free, so a slow or preempted
+// thread only holds up the morsel it is working on instead of a whole static chunk
+void openmp_parallel_for(const std::size_t num_tasks, const std::function<void(std::size_t)>& func) {
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (std::size_t task_index = 0; task_index < num_tasks; ++task_index) {
+        func(task_index);
+    }
+}
+
+void pool_parallel_for(const std::size_t num_tasks, const std::function<void(std::size_t)>& func) {
+    ThreadPool::shared().parallel_for(num_tasks, func);
+}
+
+// Results are cached per snapshot, so a query that still runs on an older snapshot never serves its results to newer ones
+std::string cache_key(const CollisionSnapshot& snapshot, const Query& query) {
+    return std::to_string(snapshot.get_version()) + ":" + query.canonical();
+}
+
+}  // namespace
+
+CollisionManager::CollisionManager(const std::string& filename, const LoadOptions& options)
+  : options_{options},
+    snapshot_{std::make_unique<std::atomic<std::shared_ptr<const CollisionSnapshot>>>(std::make_shared<const CollisionSnapshot>())},
+    ingest_mutex_{std::make_unique<std::mutex>()},
+    query_cache_{std::make_unique<QueryCache>(DEFAULT_QUERY_CACHE_BUDGET)},
+    index_advisor_{std::make_unique<IndexAdvisor>()},
+    index_advisor_mutex_{std::make_unique<std::mutex>()},
+    recommendation_applier_mutex_{std::make_unique<std::mutex>()},
+    subscription_index_{std::make_unique<SubscriptionIndex>()}
+{
     CollisionParser parser{filename};
 
     try {
-        Collisions collisions = parser.parse();
-        this->indexed_collisions_ = IndexedCollisions(collisions);
+        // The parsed columns are moved in rather than copied, so queries can start right after parsing
+        snapshot_->store(std::make_shared<const CollisionSnapshot>(parser.parse(), options));
         this->initialization_error_ = "";
+        start_index_build();
     } catch (const std::runtime_error& e) {
         this->initialization_error_ = e.what();
     }
 }
 
-CollisionManager::CollisionManager(Collisions& collisions) {
-    this->indexed_collisions_ = IndexedCollisions(collisions);
+CollisionManager::CollisionManager(Collisions& collisions, const LoadOptions& options)
+  : options_{options},
+    snapshot_{std::make_unique<std::atomic<std::shared_ptr<const CollisionSnapshot>>>(std::make_shared<const CollisionSnapshot>(collisions, options))},
+    ingest_mutex_{std::make_unique<std::mutex>()},
+    query_cache_{std::make_unique<QueryCache>(DEFAULT_QUERY_CACHE_BUDGET)},
+    index_advisor_{std::make_unique<IndexAdvisor>()},
+    index_advisor_mutex_{std::make_unique<std::mutex>()},
+    recommendation_applier_mutex_{std::make_unique<std::mutex>()},
+    subscription_index_{std::make_unique<SubscriptionIndex>()}
+{
+    start_index_build();
+}
+
+CollisionManager::CollisionManager(const std::vector<Collision>& collisions_list, const LoadOptions& options)
+  : options_{options},
+    snapshot_{std::make_unique<std::atomic<std::shared_ptr<const CollisionSnapshot>>>()},
+    ingest_mutex_{std::make_unique<std::mutex>()},
+    query_cache_{std::make_unique<QueryCache>(DEFAULT_QUERY_CACHE_BUDGET)},
+    index_advisor_{std::make_unique<IndexAdvisor>()},
+    index_advisor_mutex_{std::make_unique<std::mutex>()},
+    recommendation_applier_mutex_{std::make_unique<std::mutex>()},
+    subscription_index_{std::make_unique<SubscriptionIndex>()}
+{
+    Collisions collisions{};
+    for (const Collision& collision : collisions_list) {
+        collisions.add(collision);
+    }
+    snapshot_->store(std::make_shared<const CollisionSnapshot>(std::move(collisions), options));
+    start_index_build();
+}
+
+CollisionManager::CollisionManager(CollisionManager&& other) noexcept {
+    *this = std::move(other);
+}
+
+CollisionManager& CollisionManager::operator=(CollisionManager&& other) noexcept {
+    // The compactor publishes through the manager that started it, so neither one may run while it moves
+    stop_compaction();
+    other.stop_compaction();
+    stop_applying_index_recommendations();
+    other.stop_applying_index_recommendations();
+
+    initialization_error_ = std::move(other.initialization_error_);
+    options_ = std::move(other.options_);
+    // The builder of this manager is joined before the queue it reads from goes away
+    index_builder_ = std::move(other.index_builder_);
+    index_build_queue_ = std::move(other.index_build_queue_);
+    snapshot_ = std::move(other.snapshot_);
+    retired_snapshots_ = std::move(other.retired_snapshots_);
+    ingest_mutex_ = std::move(other.ingest_mutex_);
+    query_cache_ = std::move(other.query_cache_);
+    index_advisor_ = std::move(other.index_advisor_);
+    index_advisor_mode_ = other.index_advisor_mode_.load();
+    index_memory_budget_ = other.index_memory_budget_.load();
+    index_advisor_mutex_ = std::move(other.index_advisor_mutex_);
+    recommendation_applier_mutex_ = std::move(other.recommendation_applier_mutex_);
+    subscription_index_ = std::move(other.subscription_index_);
+    notifications_ = std::move(other.notifications_);
+    return *this;
+}
+
+CollisionManager::~CollisionManager() {
+    stop_applying_index_recommendations();
+
+    // Before the builder, which a compaction restarts when it publishes
+    stop_compaction();
+    if (index_builder_.joinable()) {
+        index_builder_.request_stop();
+        index_builder_.join();
+    }
+}
+
+void CollisionManager::start_index_build() {
+    if (options_.index_build != IndexBuild::BACKGROUND) {
+        return;
+    }
+
+    if (index_build_queue_ == nullptr) {
+        index_build_queue_ = std::make_unique<IndexBuildQueue>();
+        index_builder_ = std::jthread([queue = index_build_queue_.get()](std::stop_token stop_token) {
+            build_indexes(*queue, stop_token);
+        });
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(index_build_queue_->mutex);
+        index_build_queue_->snapshot = snapshot_->load();
+        index_build_queue_->build_stop.request_stop();
+    }
+    index_build_queue_->snapshot_published.notify_one();
+}
+
+void CollisionManager::build_indexes(IndexBuildQueue& queue, std::stop_token stop_token) {
+    while (true) {
+        std::shared_ptr<const CollisionSnapshot> snapshot;
+        std::stop_source build_stop;
+        {
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            if (!queue.snapshot_published.wait(lock, stop_token, [&queue]() { return queue.snapshot != nullptr; })) {
+                return;
+            }
+            snapshot = std::move(queue.snapshot);
+            queue.build_stop = build_stop;
+        }
+
+        // Stops for a newer snapshot as well as for the manager going away
+        std::stop_callback stop_build{stop_token, [&build_stop]() { build_stop.request_stop(); }};
+        for (const CollisionSegment& segment : snapshot->get_segments()) {
+            segment.collisions->build_all_indexes(build_stop.get_token());
+        }
+    }
 }
 
-CollisionManager::CollisionManager(const std::vector<Collision>& collisions_list) {
+void CollisionManager::append(const std::string& filename) {
+    CollisionParser parser{filename};
+    append_collisions(parser.parse());
+}
+
+void CollisionManager::append(std::span<const Collision> collisions_list) {
     Collisions collisions{};
     for (const Collision& collision : collisions_list) {
         collisions.add(collision);
     }
-    this->indexed_collisions_ = IndexedCollisions(collisions);
+    append_collisions(std::move(collisions));
+}
+
+RefreshResult CollisionManager::refresh(const std::string& filename) {
+    // The release is parsed and compared without holding up other writers. If one of them published in the meantime
+    // the row ids of the diff are stale, and the release is compared again against the newer snapshot.
+    while (true) {
+        const std::shared_ptr<const CollisionSnapshot> snapshot = snapshot_->load();
+
+        RefreshResult result{};
+        Collisions changed{};
+        std::vector<std::uint32_t> erased;
+        std::vector<std::uint8_t> in_release(snapshot->num_rows(), false);
+        std::unordered_set<std::size_t> inserted_ids;
+
+        CollisionParser parser{filename};
+        parser.parse_chunks(REFRESH_CHUNK_SIZE, [&](Collisions& chunk) {
+            const ReleaseDiff diff = snapshot->diff(chunk, in_release, inserted_ids);
+
+            // Only the new and changed rows of the chunk are kept, in the order they appear in it
+            std::vector<std::uint32_t> changed_rows = diff.inserted;
+            changed_rows.insert(changed_rows.end(), diff.updated.begin(), diff.updated.end());
+            std::sort(changed_rows.begin(), changed_rows.end());
+            chunk.permute(changed_rows);
+            changed.combine(chunk);
+
+            erased.insert(erased.end(), diff.replaced.begin(), diff.replaced.end());
+            result.num_inserted += diff.inserted.size();
+            result.num_updated += diff.updated.size();
+        });
+
+        const std::vector<std::uint32_t> deleted = snapshot->missing_rows(in_release);
+        result.num_deleted = deleted.size();
+        erased.insert(erased.end(), deleted.begin(), deleted.end());
+
+        std::lock_guard<std::mutex> lock(*ingest_mutex_);
+        if (snapshot_->load() != snapshot) {
+            continue;
+        }
+        if (!erased.empty() || !changed.crash_dates.empty()) {
+            apply_change(std::move(changed), erased);
+        }
+        return result;
+    }
+}
+
+bool CollisionManager::update(const std::size_t collision_id, const std::function<void(Collision&)>& change) {
+    std::lock_guard<std::mutex> lock(*ingest_mutex_);
+    const std::shared_ptr<const CollisionSnapshot> snapshot = snapshot_->load();
+
+    const CollisionProxy* collision = snapshot->find(collision_id);
+    if (collision == nullptr) {
+        return false;
+    }
+
+    Collision updated = to_collision(*collision);
+    change(updated);
+    if (updated.collision_id != collision_id) {
+        throw std::invalid_argument("update must not change the collision_id");
+    }
+
+    Collisions collisions{};
+    collisions.add(updated);
+    const std::uint32_t row = snapshot->get_row(collision);
+    apply_change(std::move(collisions), std::span{&row, 1});
+    return true;
+}
+
+bool CollisionManager::erase(const std::size_t collision_id) {
+    std::lock_guard<std::mutex> lock(*ingest_mutex_);
+    const std::shared_ptr<const CollisionSnapshot> snapshot = snapshot_->load();
+
+    const CollisionProxy* collision = snapshot->find(collision_id);
+    if (collision == nullptr) {
+        return false;
+    }
+
+    const std::uint32_t row = snapshot->get_row(collision);
+    apply_change(Collisions{}, std::span{&row, 1});
+    return true;
+}
+
+void CollisionManager::append_collisions(Collisions collisions) {
+    std::lock_guard<std::mutex> lock(*ingest_mutex_);
+    apply_change(std::move(collisions), {});
+}
+
+void CollisionManager::apply_change(Collisions collisions, std::span<const std::uint32_t> erased_rows) {
+    // Matched before the rows move into the snapshot, where clustering may reorder them
+    const std::vector<SubscriptionMatch> matches = subscription_index_->match(collisions);
+
+    std::vector<std::uint32_t> added_rows;
+    const std::shared_ptr<const CollisionSnapshot> snapshot =
+        snapshot_->load()->apply(std::move(collisions), erased_rows, options_, matches.empty() ? nullptr : &added_rows);
+    publish(snapshot);
+    start_compaction();
+
+    for (const SubscriptionMatch& match : matches) {
+        std::vector<CollisionProxy*> results;
+        results.reserve(match.rows.size());
+        for (const std::uint32_t row : match.rows) {
+            results.push_back(snapshot->get_proxy(added_rows[row]));
+        }
+        notifications_.at(match.subscription_id)(results);
+    }
+}
+
+std::size_t CollisionManager::subscribe(const Query& query, Notify notify) {
+    std::lock_guard<std::mutex> lock(*ingest_mutex_);
+    const std::size_t subscription_id = subscription_index_->subscribe(query);
+    notifications_.emplace(subscription_id, std::move(notify));
+    return subscription_id;
+}
+
+bool CollisionManager::unsubscribe(const std::size_t subscription_id) {
+    std::lock_guard<std::mutex> lock(*ingest_mutex_);
+    notifications_.erase(subscription_id);
+    return subscription_index_->unsubscribe(subscription_id);
+}
+
+void CollisionManager::publish(std::shared_ptr<const CollisionSnapshot> snapshot) {
+    retired_snapshots_.push_back({snapshot_->exchange(std::move(snapshot)), 0});
+
+    // A query hands out its results right before it drops its reference, so a snapshot is kept for two more changes
+    // after the last reference went. No query can load it once it left snapshot_, so its count only goes down.
+    std::erase_if(retired_snapshots_, [](RetiredSnapshot& retired) {
+        retired.num_idle_changes = retired.snapshot.use_count() == 1 ? retired.num_idle_changes + 1 : 0;
+        return retired.num_idle_changes >= 2;
+    });
+
+    // Cache keys carry the snapshot version, so this only frees the results no query can hit anymore
+    query_cache_->clear();
+    start_index_build();
+}
+
+void CollisionManager::start_compaction() {
+    // Called with ingest_mutex_ held. A running compactor checks the latest snapshot before it is done.
+    if ((compactor_.joinable() && !compaction_done_) || !snapshot_->load()->needs_compaction()) {
+        return;
+    }
+
+    if (compactor_.joinable()) {
+        compactor_.join();
+    }
+    compaction_done_ = false;
+    compactor_ = std::jthread([this](std::stop_token stop_token) {
+        compact(stop_token);
+    });
+}
+
+void CollisionManager::compact(std::stop_token stop_token) {
+    while (true) {
+        // Changes go on while segments are rewritten, they only wait for the rewritten ones to be swapped in
+        const std::vector<CompactedSegment> compacted = snapshot_->load()->compact(options_, stop_token);
+        if (stop_token.stop_requested()) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(*ingest_mutex_);
+        if (std::shared_ptr<const CollisionSnapshot> snapshot = snapshot_->load()->replace(compacted)) {
+            publish(std::move(snapshot));
+        }
+        if (!snapshot_->load()->needs_compaction()) {
+            compaction_done_ = true;
+            return;
+        }
+    }
+}
+
+void CollisionManager::stop_compaction() {
+    if (compactor_.joinable()) {
+        compactor_.request_stop();
+        compactor_.join();
+    }
 }
 
 bool CollisionManager::is_initialized() {
@@ -39,41 +373,462 @@ const std::string& CollisionManager::get_initialization_error() {
     return this->initialization_error_;
 }
 
-const std::vector<CollisionProxy*> CollisionManager::searchOpenMp(const Query& query) {
-    const std::vector<FieldQuery>& field_queries = query.get();
-    std::vector<CollisionProxy*> results;
+void CollisionManager::set_query_cache_budget(const std::size_t memory_budget) {
+    query_cache_->set_memory_budget(memory_budget);
+}
+
+const QueryCache& CollisionManager::get_query_cache() const {
+    return *query_cache_;
+}
 
-    unsigned long num_threads = omp_get_max_threads();
-    std::vector<std::vector<CollisionProxy*>> thread_local_results(num_threads);
+void CollisionManager::set_index_advisor(const IndexAdvisorMode mode, const std::size_t memory_budget) {
+    index_advisor_mode_ = mode;
+    index_memory_budget_ = memory_budget;
+}
 
-    // Initialize all matches to true initialially
-    std::vector<std::uint8_t> matches(indexed_collisions_.collisions_.size(), true);
+const IndexAdvisor& CollisionManager::get_index_advisor() const {
+    return *index_advisor_;
+}
 
-    #pragma omp parallel
-    {
-        int thread_id = omp_get_thread_num();
-        int num_threads = omp_get_num_threads();
+std::vector<IndexRecommendation> CollisionManager::get_index_recommendations() const {
+    const std::shared_ptr<const CollisionSnapshot> snapshot = snapshot_->load();
+    const std::vector<CollisionSegment>& segments = snapshot->get_segments();
+    const std::size_t num_rows = snapshot->num_rows();
 
-        int chunk_size = indexed_collisions_.collisions_.size() / num_threads;
-        int start_index = thread_id * chunk_size;
-        int end_index = (thread_id == num_threads - 1) ? indexed_collisions_.collisions_.size() : start_index + chunk_size;
+    std::vector<IndexCandidate> candidates;
+    for (std::size_t field = 0; !segments.empty() && field < static_cast<std::size_t>(CollisionField::UNDEFINED); ++field) {
+        const CollisionField name = static_cast<CollisionField>(field);
+        if (!segments.front().collisions->is_dictionary_field(name)) {
+            continue;
+        }
 
-        for (const FieldQuery& field_query : field_queries) {
-            indexed_collisions_.match(field_query, start_index, end_index, matches);
+        // An index that is not built yet is estimated by its row ids alone, the distinct values are usually few.
+        // It only counts as built once every segment has it.
+        std::size_t memory_usage = 0;
+        bool is_built = true;
+        for (const CollisionSegment& segment : segments) {
+            const std::size_t segment_memory_usage = segment.collisions->dictionary_index_memory(name);
+            memory_usage += segment_memory_usage;
+            is_built = is_built && segment_memory_usage > 0;
         }
+        candidates.push_back({name, is_built, is_built ? memory_usage : num_rows * sizeof(std::uint32_t)});
+    }
+
+    return index_advisor_->recommend(candidates, num_rows, 1.0 / IndexedCollisions::INDEX_SCAN_THRESHOLD, index_memory_budget_);
+}
 
-        #pragma omp barrier
+std::vector<IndexRecommendation> CollisionManager::apply_index_recommendations() {
+    std::lock_guard<std::mutex> lock(*index_advisor_mutex_);
+    const std::shared_ptr<const CollisionSnapshot> snapshot = snapshot_->load();
 
-        for (std::size_t index = 0; index < end_index - start_index; ++index) {
-            if (matches[index + start_index]) {
-                thread_local_results[thread_id].push_back(&indexed_collisions_.proxies_.at(start_index + index));
+    std::vector<IndexRecommendation> applied;
+    for (const IndexRecommendation& recommendation : get_index_recommendations()) {
+        if (recommendation.action == IndexAction::BUILD) {
+            for (const CollisionSegment& segment : snapshot->get_segments()) {
+                if (segment.collisions->dictionary_index_memory(recommendation.field) == 0) {
+                    segment.collisions->build_dictionary_index(recommendation.field);
+                }
             }
+            applied.push_back(recommendation);
+        } else if (recommendation.action == IndexAction::DROP) {
+            for (const CollisionSegment& segment : snapshot->get_segments()) {
+                segment.collisions->drop_dictionary_index(recommendation.field);
+            }
+            applied.push_back(recommendation);
         }
     }
+    index_advisor_->decay();
+    return applied;
+}
 
-    for (const auto& local_results : thread_local_results) {
+void CollisionManager::record_workload(const Query& query,
+                                       std::span<const QueryPlan> plans,
+                                       std::span<const Morsel> morsels,
+                                       std::span<const std::vector<ScanCost>> morsel_scan_costs) {
+    const std::size_t num_queries = index_advisor_->record_query(query);
+
+    // Segments can plan the same predicate differently, its costs are added up over every segment that scanned it
+    std::vector<std::pair<const FieldQuery*, ScanCost>> totals;
+    for (std::size_t morsel = 0; morsel < morsels.size(); ++morsel) {
+        const std::vector<ScanCost>& scan_costs = morsel_scan_costs[morsel];
+        const std::vector<const FieldQuery*>& scanned_queries = plans[morsels[morsel].segment_index].scanned_queries;
+        for (std::size_t scanned_index = 0; scanned_index < scan_costs.size(); ++scanned_index) {
+            auto total = std::find_if(totals.begin(), totals.end(), [&](const auto& entry) {
+                return entry.first == scanned_queries[scanned_index];
+            });
+            if (total == totals.end()) {
+                total = totals.insert(totals.end(), {scanned_queries[scanned_index], ScanCost{}});
+            }
+            total->second.rows_scanned += scan_costs[scanned_index].rows_scanned;
+            total->second.rows_matched += scan_costs[scanned_index].rows_matched;
+            total->second.seconds += scan_costs[scanned_index].seconds;
+        }
+    }
+    for (const auto& [field_query, total] : totals) {
+        index_advisor_->record_scan(field_query->get_name(), total.rows_scanned, total.rows_matched, total.seconds);
+    }
+
+    if (index_advisor_mode_ == IndexAdvisorMode::AUTOMATIC && num_queries % INDEX_ADVISOR_INTERVAL == 0) {
+        start_applying_index_recommendations();
+    }
+}
+
+void CollisionManager::start_applying_index_recommendations() {
+    std::lock_guard<std::mutex> lock(*recommendation_applier_mutex_);
+    if (is_applying_recommendations_) {
+        return;
+    }
+
+    // Cleared as the last thing the previous run does, so this join does not wait for any index build
+    if (recommendation_applier_.joinable()) {
+        recommendation_applier_.join();
+    }
+    is_applying_recommendations_ = true;
+    recommendation_applier_ = std::jthread([this]() {
+        apply_index_recommendations();
+        is_applying_recommendations_ = false;
+    });
+}
+
+void CollisionManager::stop_applying_index_recommendations() {
+    if (recommendation_applier_mutex_ == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(*recommendation_applier_mutex_);
+    if (recommendation_applier_.joinable()) {
+        recommendation_applier_.join();
+    }
+}
+
+std::vector<CollisionManager::Morsel> CollisionManager::make_morsels(const CollisionSnapshot& snapshot) {
+    // Every segment starts at a zone, so no morsel spans two zones
+    std::vector<Morsel> morsels;
+    const std::vector<CollisionSegment>& segments = snapshot.get_segments();
+    for (std::size_t segment_index = 0; segment_index < segments.size(); ++segment_index) {
+        const std::size_t num_rows = segments[segment_index].num_rows();
+        for (std::size_t start_index = 0; start_index < num_rows; start_index += MORSEL_SIZE) {
+            morsels.push_back({segment_index, start_index, std::min(start_index + MORSEL_SIZE, num_rows)});
+        }
+    }
+    return morsels;
+}
+
+std::shared_ptr<CollisionProxy> CollisionManager::get_by_collision_id(const std::size_t collision_id) {
+    const std::shared_ptr<const CollisionSnapshot> snapshot = snapshot_->load();
+    CollisionProxy* collision = snapshot->find(collision_id);
+    if (collision == nullptr) {
+        return nullptr;
+    }
+    return std::shared_ptr<CollisionProxy>(snapshot, collision);
+}
+
+QueryResults CollisionManager::get_by_collision_ids(std::span<const std::size_t> collision_ids) {
+    QueryResults results{};
+    results.snapshot = snapshot_->load();
+    results.resize(collision_ids.size());
+    results.snapshot->find(collision_ids, results);
+    return results;
+}
+
+const std::vector<CollisionProxy*> CollisionManager::to_proxies(const CollisionSnapshot& snapshot, const RowIdSet& rows) {
+    std::vector<CollisionProxy*> results;
+    for (const std::uint32_t row_id : rows.to_row_ids()) {
+        results.push_back(snapshot.get_proxy(row_id));
+    }
+    return results;
+}
+
+void CollisionManager::cache_results(const CollisionSnapshot& snapshot,
+                                     const std::string& key,
+                                     const std::vector<CollisionProxy*>& results) {
+    std::vector<std::uint32_t> row_ids;
+    row_ids.reserve(results.size());
+    for (const CollisionProxy* proxy : results) {
+        row_ids.push_back(snapshot.get_row(proxy));
+    }
+    query_cache_->put(key, row_ids, snapshot.num_rows());
+}
+
+const QueryResults CollisionManager::search_cached(const Query& query, const Evaluate& evaluate) {
+    // Pins the snapshot for as long as the results are used, a change published meanwhile goes to the next query
+    const std::shared_ptr<const CollisionSnapshot> snapshot = snapshot_->load();
+
+    const std::string key = cache_key(*snapshot, query);
+    if (std::shared_ptr<const RowIdSet> cached = query_cache_->get(key)) {
+        return QueryResults{to_proxies(*snapshot, *cached), snapshot};
+    }
+
+    QueryResults results{evaluate(*snapshot, query), snapshot};
+    cache_results(*snapshot, key, results);
+    return results;
+}
+
+const QueryResults CollisionManager::searchOpenMp(const Query& query) {
+    return search_cached(query, [this](const CollisionSnapshot& snapshot, const Query& query) {
+        return evaluate_morsels(snapshot, query, openmp_parallel_for);
+    });
+}
+
+const QueryResults CollisionManager::search(const Query& query) {
+    return search_cached(query, [this](const CollisionSnapshot& snapshot, const Query& query) {
+        return evaluate_morsels(snapshot, query, pool_parallel_for);
+    });
+}
+
+const std::vector<CollisionProxy*> CollisionManager::evaluate_morsels(const CollisionSnapshot& snapshot,
+                                                                      const Query& query,
+                                                                      const ParallelFor& parallel_for) {
+    const std::vector<CollisionSegment>& segments = snapshot.get_segments();
+    const std::vector<Morsel> morsels = make_morsels(snapshot);
+
+    // Index lookups are resolved before any morsel runs, so morsels never write outside of their own rows
+    std::vector<QueryPlan> plans;
+    for (const CollisionSegment& segment : segments) {
+        plans.push_back(segment.collisions->plan(query, segment.get_erased_rows()));
+    }
+
+    const bool record = index_advisor_mode_ != IndexAdvisorMode::OFF;
+    std::vector<std::vector<ScanCost>> morsel_scan_costs(record ? morsels.size() : 0);
+
+    std::vector<std::vector<CollisionProxy*>> morsel_results(morsels.size());
+    parallel_for(morsels.size(), [&](std::size_t morsel) {
+        const QueryPlan& plan = plans[morsels[morsel].segment_index];
+        morsel_results[morsel] = evaluate_morsel(snapshot, plan, morsels[morsel], record ? &morsel_scan_costs[morsel] : nullptr);
+    });
+
+    // Morsel order is row order, so results come out in the same order as a sequential scan
+    std::vector<CollisionProxy*> results;
+    for (const auto& local_results : morsel_results) {
         results.insert(results.end(), local_results.begin(), local_results.end());
     }
 
+    if (record) {
+        record_workload(query, plans, morsels, morsel_scan_costs);
+    }
+
+    return results;
+}
+
+std::vector<CollisionProxy*> CollisionManager::evaluate_morsel(const CollisionSnapshot& snapshot,
+                                                             const QueryPlan& plan,
+                                                             const Morsel& morsel,
+                                                             std::vector<ScanCost>* scan_costs) {
+    const auto [segment_index, start_index, end_index] = morsel;
+    const CollisionSegment& segment = snapshot.get_segments()[segment_index];
+    const IndexedCollisions& collisions = *segment.collisions;
+
+    thread_local std::vector<std::uint8_t> matches;
+    if (!collisions.init_selection(plan, start_index, end_index, matches)) {
+        return {};
+    }
+
+    if (scan_costs == nullptr) {
+        for (const FieldQuery* field_query : plan.scanned_queries) {
+            collisions.match(*field_query, start_index, end_index, matches);
+        }
+    } else {
+        // Rows still selected before and after each predicate give its selectivity for the advisor
+        scan_costs->resize(plan.scanned_queries.size());
+        std::size_t num_selected = std::count(matches.begin(), matches.end(), 1);
+        for (std::size_t scanned_index = 0; scanned_index < plan.scanned_queries.size(); ++scanned_index) {
+            const auto start_time = std::chrono::steady_clock::now();
+            collisions.match(*plan.scanned_queries[scanned_index], start_index, end_index, matches);
+            const std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start_time;
+
+            (*scan_costs)[scanned_index].rows_scanned = num_selected;
+            num_selected = std::count(matches.begin(), matches.end(), 1);
+            (*scan_costs)[scanned_index].rows_matched = num_selected;
+            (*scan_costs)[scanned_index].seconds = duration.count();
+        }
+    }
+
+    std::vector<CollisionProxy*> results;
+    for (std::size_t index = start_index; index < end_index; ++index) {
+        if (matches[index - start_index]) {
+            results.push_back(&segment.collisions->proxies_[index]);
+        }
+    }
     return results;
 }
+
+std::future<SearchResult> CollisionManager::search_async(const Query& query, const SearchOptions& options) {
+    const std::shared_ptr<const CollisionSnapshot> snapshot = snapshot_->load();
+
+    // Everything the morsels use lives until the last of them is done, nothing in it belongs to the manager
+    struct AsyncSearch {
+        std::shared_ptr<const CollisionSnapshot> snapshot;
+        Query query;
+        SearchOptions options;
+        std::vector<Morsel> morsels;
+        std::vector<QueryPlan> plans;
+        std::vector<std::vector<CollisionProxy*>> morsel_results;
+        std::vector<std::uint8_t> searched;
+        std::promise<SearchResult> promise;
+    };
+    const auto search = std::make_shared<AsyncSearch>(AsyncSearch{snapshot, query, options});
+    std::future<SearchResult> future = search->promise.get_future();
+
+    if (std::shared_ptr<const RowIdSet> cached = query_cache_->get(cache_key(*snapshot, query))) {
+        search->promise.set_value({SearchStatus::COMPLETE, to_proxies(*snapshot, *cached), snapshot->num_rows(), snapshot});
+        return future;
+    }
+
+    // Plans point into the query they were made for, so they are made for the copy the morsels keep
+    search->morsels = make_morsels(*snapshot);
+    for (const CollisionSegment& segment : snapshot->get_segments()) {
+        search->plans.push_back(segment.collisions->plan(search->query, segment.get_erased_rows()));
+    }
+    search->morsel_results.resize(search->morsels.size());
+    search->searched.resize(search->morsels.size(), false);
+
+    ThreadPool::shared().submit(search->morsels.size(), [search](std::size_t morsel) {
+        if (search->options.stop_token.stop_requested() || std::chrono::steady_clock::now() >= search->options.deadline) {
+            return;
+        }
+        const QueryPlan& plan = search->plans[search->morsels[morsel].segment_index];
+        search->morsel_results[morsel] = evaluate_morsel(*search->snapshot, plan, search->morsels[morsel], nullptr);
+        search->searched[morsel] = true;
+    }, [search](std::exception_ptr exception) {
+        if (exception) {
+            search->promise.set_exception(exception);
+            return;
+        }
+
+        SearchResult result{.snapshot = search->snapshot};
+        for (std::size_t morsel = 0; morsel < search->morsels.size(); ++morsel) {
+            if (!search->searched[morsel]) {
+                result.status = search->options.stop_token.stop_requested() ? SearchStatus::CANCELLED : SearchStatus::TIMED_OUT;
+                continue;
+            }
+            const std::vector<CollisionProxy*>& morsel_results = search->morsel_results[morsel];
+            result.results.insert(result.results.end(), morsel_results.begin(), morsel_results.end());
+            result.num_rows_searched += search->morsels[morsel].end_index - search->morsels[morsel].start_index;
+        }
+        search->promise.set_value(std::move(result));
+    });
+    return future;
+}
+
+const std::vector<QueryResults> CollisionManager::search_batch(std::span<const Query> all_queries) {
+    const std::shared_ptr<const CollisionSnapshot> snapshot = snapshot_->load();
+    std::vector<QueryResults> all_results(all_queries.size());
+
+    // Only queries that miss the cache take part in the shared scan
+    std::vector<std::string> keys;
+    std::vector<std::size_t> uncached_indexes;
+    std::vector<Query> queries;
+    for (std::size_t query_index = 0; query_index < all_queries.size(); ++query_index) {
+        keys.push_back(cache_key(*snapshot, all_queries[query_index]));
+        if (std::shared_ptr<const RowIdSet> cached = query_cache_->get(keys.back())) {
+            all_results[query_index] = QueryResults{to_proxies(*snapshot, *cached), snapshot};
+        } else {
+            uncached_indexes.push_back(query_index);
+            queries.push_back(all_queries[query_index]);
+        }
+    }
+
+    if (queries.empty()) {
+        return all_results;
+    }
+
+    const std::vector<CollisionSegment>& segments = snapshot->get_segments();
+    const std::vector<Morsel> morsels = make_morsels(*snapshot);
+
+    // Each query still gets its own plan in every segment, but predicates that are scanned are grouped
+    // by field so that a column is streamed through cache once for the whole batch
+    std::vector<std::vector<QueryPlan>> plans(queries.size());
+    std::vector<std::map<CollisionField, std::vector<BatchPredicate>>> scanned_predicates_by_field(segments.size());
+    for (std::size_t segment_index = 0; segment_index < segments.size(); ++segment_index) {
+        for (std::size_t query_index = 0; query_index < queries.size(); ++query_index) {
+            const CollisionSegment& segment = segments[segment_index];
+            plans[query_index].push_back(segment.collisions->plan(queries[query_index], segment.get_erased_rows()));
+            for (const FieldQuery* field_query : plans[query_index].back().scanned_queries) {
+                scanned_predicates_by_field[segment_index][field_query->get_name()].push_back({field_query, query_index});
+            }
+        }
+    }
+
+    // A pass over a column is shared by every predicate on it, each of them is charged an equal part of its time
+    const bool record = index_advisor_mode_ != IndexAdvisorMode::OFF;
+    std::vector<std::vector<std::vector<ScanCost>>> morsel_scan_costs(
+        record ? queries.size() : 0, std::vector<std::vector<ScanCost>>(morsels.size()));
+
+    std::vector<std::vector<std::vector<CollisionProxy*>>> morsel_results(
+        morsels.size(), std::vector<std::vector<CollisionProxy*>>(queries.size()));
+    pool_parallel_for(morsels.size(), [&](std::size_t morsel) {
+        const auto [segment_index, start_index, end_index] = morsels[morsel];
+        const IndexedCollisions& collisions = *segments[segment_index].collisions;
+
+        thread_local std::vector<std::vector<std::uint8_t>> matches;
+        matches.resize(queries.size());
+        bool any_selected = false;
+        for (std::size_t query_index = 0; query_index < queries.size(); ++query_index) {
+            if (collisions.init_selection(plans[query_index][segment_index], start_index, end_index, matches[query_index])) {
+                any_selected = true;
+            }
+        }
+        if (!any_selected) {
+            return;
+        }
+
+        thread_local std::vector<std::size_t> num_selected;
+        if (record) {
+            num_selected.resize(queries.size());
+            for (std::size_t query_index = 0; query_index < queries.size(); ++query_index) {
+                num_selected[query_index] = std::count(matches[query_index].begin(), matches[query_index].end(), 1);
+                morsel_scan_costs[query_index][morsel].resize(plans[query_index][segment_index].scanned_queries.size());
+            }
+        }
+
+        for (const auto& [name, predicates] : scanned_predicates_by_field[segment_index]) {
+            const auto start_time = std::chrono::steady_clock::now();
+            collisions.match_batch(name, predicates, start_index, end_index, std::span{matches.data(), queries.size()});
+            if (!record) {
+                continue;
+            }
+
+            const std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start_time;
+            for (const BatchPredicate& predicate : predicates) {
+                const std::size_t query_index = predicate.query_index;
+                const std::vector<const FieldQuery*>& scanned_queries = plans[query_index][segment_index].scanned_queries;
+                const std::size_t scanned_index = std::find(scanned_queries.begin(), scanned_queries.end(), predicate.query) - scanned_queries.begin();
+                ScanCost& scan_cost = morsel_scan_costs[query_index][morsel][scanned_index];
+                scan_cost.rows_scanned = num_selected[query_index];
+                scan_cost.rows_matched = std::count(matches[query_index].begin(), matches[query_index].end(), 1);
+                scan_cost.seconds = duration.count() / predicates.size();
+            }
+            for (const BatchPredicate& predicate : predicates) {
+                const std::vector<std::uint8_t>& query_matches = matches[predicate.query_index];
+                num_selected[predicate.query_index] = std::count(query_matches.begin(), query_matches.end(), 1);
+            }
+        }
+
+        for (std::size_t query_index = 0; query_index < queries.size(); ++query_index) {
+            for (std::size_t index = start_index; index < end_index; ++index) {
+                if (matches[query_index][index - start_index]) {
+                    morsel_results[morsel][query_index].push_back(&segments[segment_index].collisions->proxies_[index]);
+                }
+            }
+        }
+    });
+
+    for (std::size_t query_index = 0; record && query_index < queries.size(); ++query_index) {
+        record_workload(queries[query_index], plans[query_index], morsels, morsel_scan_costs[query_index]);
+    }
+
+    std::vector<std::vector<CollisionProxy*>> results(queries.size());
+    for (const auto& local_results : morsel_results) {
+        for (std::size_t query_index = 0; query_index < queries.size(); ++query_index) {
+            results[query_index].insert(results[query_index].end(),
+                                        local_results[query_index].begin(),
+                                        local_results[query_index].end());
+        }
+    }
+
+    for (std::size_t query_index = 0; query_index < queries.size(); ++query_index) {
+        cache_results(*snapshot, keys[uncached_indexes[query_index]], results[query_index]);
+        all_results[uncached_indexes[query_index]] = QueryResults{std::move(results[query_index]), snapshot};
+    }
+
+    return all_results;
+}
@@ -1,26 +1,262 @@
 #pragma once
 
 #include "collision.hpp"
+#include "collision_snapshot.hpp"
+#include "index_advisor.hpp"
 #include "query.hpp"
+#include "query_cache.hpp"
+#include "subscription_index.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stop_token>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 
+// Rows a scanned predicate was evaluated on within one morsel, how many matched and how long it took
+struct ScanCost {
+    std::size_t rows_scanned = 0;
+    std::size_t rows_matched = 0;
+    double seconds = 0;
+};
+
+// Rows a refresh changed, by what happened to their collision_id
+struct RefreshResult {
+    std::size_t num_inserted = 0;
+    std::size_t num_updated = 0;
+    std::size_t num_deleted = 0;
+};
+
+// How a search_async ended. CANCELLED and TIMED_OUT searches skipped some morsels.
+enum class SearchStatus { COMPLETE, CANCELLED, TIMED_OUT };
+
+struct SearchOptions {
+    // Checked before every morsel, a search stops taking new morsels once a stop is requested or the deadline passed
+    std::stop_token stop_token;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+};
+
+struct SearchResult {
+    SearchStatus status = SearchStatus::COMPLETE;
+
+    // The matches among the rows that were searched, in row order
+    std::vector<CollisionProxy*> results;
+    std::size_t num_rows_searched = 0;
+
+    // The rows the results point to, which stay valid as long as this does even after the manager is gone
+    std::shared_ptr<const CollisionSnapshot> snapshot;
+};
+
+// Results of a synchronous search or lookup, used like the list of matches it extends. Holds on to the snapshot they
+// point into, so the rows stay valid as long as this does, however many changes are published after the query.
+struct QueryResults : std::vector<CollisionProxy*> {
+    std::shared_ptr<const CollisionSnapshot> snapshot;
+};
+
 class CollisionManager {
 
 public:
-    CollisionManager(const std::string& filename);
+    static constexpr std::size_t DEFAULT_QUERY_CACHE_BUDGET = 64 * 1024 * 1024;
+    static constexpr std::size_t DEFAULT_INDEX_MEMORY_BUDGET = 64 * 1024 * 1024;
+
+    // Queries between two times the AUTOMATIC index advisor applies its recommendations
+    static constexpr std::size_t INDEX_ADVISOR_INTERVAL = 32;
+
+    // Rows of a new release that refresh parses and compares at once
+    static constexpr std::size_t REFRESH_CHUNK_SIZE = 64 * 1024;
+
+    // Number of consecutive rows scanned as one unit of work
+    static constexpr std::size_t MORSEL_SIZE = 16 * 1024;
+    static_assert(IndexedCollisions::ZONE_SIZE % MORSEL_SIZE == 0, "A morsel must not span two zones");
+
+    CollisionManager(const std::string& filename, const LoadOptions& options = LoadOptions{});
+    ~CollisionManager();
+    CollisionManager(CollisionManager&& other) noexcept;
+    CollisionManager& operator=(CollisionManager&& other) noexcept;
 
     bool is_initialized();
     const std::string& get_initialization_error();
-    const std::vector<CollisionProxy*> searchOpenMp(const Query& query);
+    const QueryResults searchOpenMp(const Query& query);
+
+    // Same results as searchOpenMp, but executed as morsels on the shared ThreadPool.
+    // Safe to call from many client threads at once without oversubscribing the cores.
+    const QueryResults search(const Query& query);
+
+    // Same results as search, without waiting for them. The morsels run on the shared ThreadPool and no thread
+    // blocks on the search. A search that is cancelled or runs past its deadline finishes the morsels that are
+    // running and returns what they found. Cached results are used, but results are neither cached nor recorded
+    // by the index advisor, so a search only holds on to its snapshot and may outlive the manager.
+    std::future<SearchResult> search_async(const Query& query, const SearchOptions& options = SearchOptions{});
+
+    // Evaluate many queries with a single pass over every column they touch, one result list per query. Runs on the
+    // shared ThreadPool like search, and the index advisor records its predicates the same way.
+    const std::vector<QueryResults> search_batch(std::span<const Query> queries);
+
+    // Every query and lookup runs on the snapshot that was current when it started and sees none of the changes
+    // published while it runs. Changes never wait for queries and queries never wait for changes, only changes
+    // wait for each other. Results point into the segments of their snapshot and keep it alive, see QueryResults.
+    // A replaced snapshot that nothing holds on to is released once two changes have been published since the
+    // last query on it returned, so pointers copied out of the results stay valid until the second change after
+    // the query that returned them.
+
+    // Add the rows of a csv file, or of a list of collisions, after the loaded ones as a new segment. Only the new
+    // rows are parsed and indexed, see CollisionSnapshot::apply.
+    void append(const std::string& filename);
+    void append(std::span<const Collision> collisions);
+
+    // Bring the loaded data up to date with a new full release of the csv file. The release is streamed
+    // REFRESH_CHUNK_SIZE rows at a time and only rows that are new, changed or gone compared to the live rows
+    // are kept: new rows are appended, changed rows are erased and appended again, rows that are gone are erased.
+    // All of it is published as one snapshot. See CollisionSnapshot::diff. Other writers are only held up while
+    // it is published, if one of them published first the release is compared again.
+    RefreshResult refresh(const std::string& filename);
+
+    // Correct or remove the live row of a collision_id without reloading, false if it has none. The row is erased
+    // through the tombstone bitmap of its segment, which every query ANDs into its selection. update adds the
+    // changed copy as a new segment after all others, a delta that queries scan together with the other segments
+    // until appends merge it. change must keep the collision_id. Segments with more than
+    // CollisionSnapshot::COMPACTION_THRESHOLD of their rows erased are rewritten on a background thread.
+    bool update(const std::size_t collision_id, const std::function<void(Collision&)>& change);
+    bool erase(const std::size_t collision_id);
+
+    // Standing queries, matched against the rows that later appends, refreshes and updates add, see SubscriptionIndex.
+    // Once a change is published, notify gets the rows of the change its query matches, if there are any. It runs on
+    // the thread that made the change, which waits for it, and must neither change the data nor subscribe.
+    using Notify = std::function<void(const std::vector<CollisionProxy*>&)>;
+    std::size_t subscribe(const Query& query, Notify notify);
+    bool unsubscribe(const std::size_t subscription_id);
+
+    // Point lookups through the collision_id hash index, without the query engine or the result cache.
+    // nullptr for ids that do not exist. The row is owned together with its snapshot, like QueryResults.
+    std::shared_ptr<CollisionProxy> get_by_collision_id(const std::size_t collision_id);
+    QueryResults get_by_collision_ids(std::span<const std::size_t> collision_ids);
+
+    // The advisor records the predicates of search() and searchOpenMp(). In AUTOMATIC mode it also builds and
+    // drops dictionary indexes of string fields within memory_budget bytes every INDEX_ADVISOR_INTERVAL queries,
+    // on a background thread. OFF by default, so queries only pay for timing their predicates when asked to.
+    void set_index_advisor(const IndexAdvisorMode mode, const std::size_t memory_budget = DEFAULT_INDEX_MEMORY_BUDGET);
+    const IndexAdvisor& get_index_advisor() const;
+
+    // What the advisor would build, keep and drop for the workload recorded so far
+    std::vector<IndexRecommendation> get_index_recommendations() const;
+
+    // Build and drop dictionary indexes as recommended, returns the recommendations that were applied
+    std::vector<IndexRecommendation> apply_index_recommendations();
+
+    // Memory budget in bytes for cached query results, 0 disables the cache
+    void set_query_cache_budget(const std::size_t memory_budget);
+    const QueryCache& get_query_cache() const;
 
     friend class CollisionManagerTest;
 
 private:
-    CollisionManager(Collisions& collisions);
-    CollisionManager(const std::vector<Collision>& collisions);
+    CollisionManager(Collisions& collisions, const LoadOptions& options = LoadOptions{});
+    CollisionManager(const std::vector<Collision>& collisions, const LoadOptions& options = LoadOptions{});
+
+    // Consecutive rows of one segment scanned as one unit of work, never more than MORSEL_SIZE
+    struct Morsel {
+        std::size_t segment_index;
+        std::size_t start_index;
+        std::size_t end_index;
+    };
+
+    static std::vector<Morsel> make_morsels(const CollisionSnapshot& snapshot);
+
+    // Rows of a morsel that the plan of its segment selects. What each scanned predicate cost is added to
+    // scan_costs unless it is nullptr.
+    static std::vector<CollisionProxy*> evaluate_morsel(const CollisionSnapshot& snapshot,
+                                                        const QueryPlan& plan,
+                                                        const Morsel& morsel,
+                                                        std::vector<ScanCost>* scan_costs);
+
+    using Evaluate = std::function<std::vector<CollisionProxy*>(const CollisionSnapshot&, const Query&)>;
+    const QueryResults search_cached(const Query& query, const Evaluate& evaluate);
+    // Runs func(task_index) for every task in [0, num_tasks) on some set of threads
+    using ParallelFor = std::function<void(std::size_t, const std::function<void(std::size_t)>&)>;
+
+    const std::vector<CollisionProxy*> evaluate_morsels(const CollisionSnapshot& snapshot, const Query& query, const ParallelFor& parallel_for);
+    const std::vector<CollisionProxy*> to_proxies(const CollisionSnapshot& snapshot, const RowIdSet& rows);
+    void cache_results(const CollisionSnapshot& snapshot, const std::string& key, const std::vector<CollisionProxy*>& results);
+    void start_index_build();
+    void append_collisions(Collisions collisions);
+    void apply_change(Collisions collisions, std::span<const std::uint32_t> erased_rows);
+    void publish(std::shared_ptr<const CollisionSnapshot> snapshot);
+    void start_compaction();
+    void compact(std::stop_token stop_token);
+    void stop_compaction();
+    void start_applying_index_recommendations();
+    void stop_applying_index_recommendations();
+    void record_workload(const Query& query,
+                         std::span<const QueryPlan> plans,
+                         std::span<const Morsel> morsels,
+                         std::span<const std::vector<ScanCost>> morsel_scan_costs);
 
     std::string initialization_error_;
-    IndexedCollisions indexed_collisions_;
+
+    LoadOptions options_;
+
+    // The latest snapshot for the index builder to build, nullptr once it took it. Handing it a newer one
+    // stops the build of the one before at its next stop check, most segments of the newer one are built already.
+    struct IndexBuildQueue {
+        std::mutex mutex;
+        std::condition_variable_any snapshot_published;
+        std::shared_ptr<const CollisionSnapshot> snapshot;
+        std::stop_source build_stop;
+    };
+    static void build_indexes(IndexBuildQueue& queue, std::stop_token stop_token);
+
+    // Builds the indexes of every snapshot published for IndexBuild::BACKGROUND. Changes hand it their snapshot
+    // without waiting for it. Started with the first snapshot, on the heap with its queue so the manager can be moved.
+    std::unique_ptr<IndexBuildQueue> index_build_queue_;
+    std::jthread index_builder_;
+
+    // The current snapshot. A query loads it once and runs on it to the end, a change builds the next snapshot
+    // next to it and publishes that with a single store. On the heap so the manager can be moved.
+    std::unique_ptr<std::atomic<std::shared_ptr<const CollisionSnapshot>>> snapshot_;
+
+    // Snapshots that were replaced, with the number of changes published since no query held on to them anymore.
+    // Queries hold a reference to their snapshot, so one only held by this list has no query running on it.
+    // Guarded by ingest_mutex_.
+    struct RetiredSnapshot {
+        std::shared_ptr<const CollisionSnapshot> snapshot;
+        std::size_t num_idle_changes;
+    };
+    std::vector<RetiredSnapshot> retired_snapshots_;
+
+    // Held while a change is built and published, so every change builds on the one before it
+    std::unique_ptr<std::mutex> ingest_mutex_;
+
+    // Rewrites segments with many erased rows and publishes them through the manager, which stops it before it
+    // is moved or destroyed. compaction_done_ is set under ingest_mutex_ once it found nothing left to rewrite.
+    std::jthread compactor_;
+    bool compaction_done_ = true;
+
+    std::unique_ptr<QueryCache> query_cache_;
+
+    std::unique_ptr<IndexAdvisor> index_advisor_;
+    // Read by every query, so they can be changed while queries run
+    std::atomic<IndexAdvisorMode> index_advisor_mode_ = IndexAdvisorMode::OFF;
+    std::atomic<std::size_t> index_memory_budget_ = DEFAULT_INDEX_MEMORY_BUDGET;
+    // Held while recommendations are applied, so only one thread builds and drops indexes at a time
+    std::unique_ptr<std::mutex> index_advisor_mutex_;
+
+    // Applies the recommendations for AUTOMATIC mode, so the query that reaches the interval does not wait for the
+    // index builds. A query that finds it still running leaves the recommendations to the next interval.
+    // Stopped before the manager is moved or destroyed, recommendation_applier_mutex_ guards starting and stopping it.
+    std::jthread recommendation_applier_;
+    std::atomic<bool> is_applying_recommendations_ = false;
+    std::unique_ptr<std::mutex> recommendation_applier_mutex_;
+
+    // Guarded by ingest_mutex_
+    std::unique_ptr<SubscriptionIndex> subscription_index_;
+    std::unordered_map<std::size_t, Notify> notifications_;
 };
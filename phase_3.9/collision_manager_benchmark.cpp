@@ -1,11 +1,18 @@
 #include "collision_manager.hpp"
 
 #include <benchmark/benchmark.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 const static std::size_t NUM_ITERATIONS = 200;
 
 static std::unique_ptr<CollisionManager> collision_manager;
+static std::once_flag collision_manager_loaded;
 
 class CollisionManagerBenchmark : public benchmark::Fixture
 {
@@ -13,9 +20,13 @@ public:
 
     void SetUp(const ::benchmark::State& state)
     {
-        if (collision_manager.get() == nullptr) {
+        // Multi-threaded benchmarks call SetUp from every thread
+        std::call_once(collision_manager_loaded, []() {
             collision_manager = std::make_unique<CollisionManager>(std::string("../Motor_Vehicle_Collisions_-_Crashes_20250123.csv"));
-        }
+        });
+
+        // Measure query evaluation itself, benchmarks of the result cache turn it back on
+        collision_manager->set_query_cache_budget(0);
     }
 };
 
@@ -218,6 +229,227 @@ BENCHMARK_DEFINE_F(CollisionManagerBenchmark, SearchRangeofCoordinates_DateRange
     }
 }
 
+static std::vector<Query> dashboard_queries() {
+    std::chrono::year_month_day date1{
+        std::chrono::year{2021},
+        std::chrono::month{9},
+        std::chrono::day{11}
+    };
+
+    std::vector<Query> queries;
+    for (const char* borough : {"BROOKLYN", "QUEENS", "MANHATTAN", "BRONX", "STATEN ISLAND"}) {
+        queries.push_back(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, borough));
+        queries.push_back(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, borough)
+                              .add(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date1));
+        queries.push_back(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, borough)
+                              .add(CollisionField::VEHICLE_TYPE_CODE_1, QueryType::CONTAINS, "Sedan"));
+        queries.push_back(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, borough)
+                              .add(CollisionField::CONTRIBUTING_FACTOR_VEHICLE_1, QueryType::EQUALS, "Unspecified"));
+    }
+    return queries;
+}
+
+BENCHMARK_DEFINE_F(CollisionManagerBenchmark, SearchDashboardQueriesOneByOne)(benchmark::State& state) {
+    std::vector<Query> queries = dashboard_queries();
+
+    for(auto _ : state) {
+        for (const Query& query : queries) {
+            std::vector<CollisionProxy*> results = collision_manager->searchOpenMp(query);
+            benchmark::DoNotOptimize(results);
+        }
+    }
+}
+
+BENCHMARK_DEFINE_F(CollisionManagerBenchmark, SearchDashboardQueriesBatch)(benchmark::State& state) {
+    std::vector<Query> queries = dashboard_queries();
+
+    for(auto _ : state) {
+        std::vector<QueryResults> results = collision_manager->search_batch(queries);
+        benchmark::DoNotOptimize(results);
+    }
+}
+
+BENCHMARK_DEFINE_F(CollisionManagerBenchmark, SearchRepeatedQueryCached)(benchmark::State& state) {
+    Query query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN")
+                      .add(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208});
+
+    collision_manager->set_query_cache_budget(CollisionManager::DEFAULT_QUERY_CACHE_BUDGET);
+
+    for(auto _ : state) {
+        std::vector<CollisionProxy*> results = collision_manager->searchOpenMp(query);
+        benchmark::DoNotOptimize(results);
+    }
+}
+
+// Point lookup of a single incident, through the query engine and through the collision_id hash index
+BENCHMARK_DEFINE_F(CollisionManagerBenchmark, SearchSingleCollisionId)(benchmark::State& state) {
+    Query query = Query::create(CollisionField::COLLISION_ID, QueryType::EQUALS, std::size_t{4000000});
+
+    for(auto _ : state) {
+        std::vector<CollisionProxy*> results = collision_manager->search(query);
+        benchmark::DoNotOptimize(results);
+    }
+}
+
+BENCHMARK_DEFINE_F(CollisionManagerBenchmark, GetByCollisionId)(benchmark::State& state) {
+    std::size_t collision_id = 4000000;
+
+    for(auto _ : state) {
+        std::shared_ptr<CollisionProxy> result = collision_manager->get_by_collision_id(collision_id++);
+        benchmark::DoNotOptimize(result);
+    }
+}
+
+BENCHMARK_DEFINE_F(CollisionManagerBenchmark, GetByCollisionIds)(benchmark::State& state) {
+    std::vector<std::size_t> collision_ids;
+    for (std::size_t index = 0; index < 1000; ++index) {
+        collision_ids.push_back(3000000 + index * 997);
+    }
+
+    for(auto _ : state) {
+        QueryResults results = collision_manager->get_by_collision_ids(collision_ids);
+        benchmark::DoNotOptimize(results);
+    }
+    state.SetItemsProcessed(state.iterations() * collision_ids.size());
+}
+
+// Small zip code lookups issued by several client threads at once, as a query service would
+BENCHMARK_DEFINE_F(CollisionManagerBenchmark, SearchConcurrentClientsOpenMp)(benchmark::State& state) {
+    Query query = Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208})
+                      .add(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::GREATER_THAN, std::uint8_t{0});
+
+    for(auto _ : state) {
+        std::vector<CollisionProxy*> results = collision_manager->searchOpenMp(query);
+        benchmark::DoNotOptimize(results);
+    }
+}
+
+BENCHMARK_DEFINE_F(CollisionManagerBenchmark, SearchConcurrentClientsThreadPool)(benchmark::State& state) {
+    Query query = Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208})
+                      .add(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::GREATER_THAN, std::uint8_t{0});
+
+    for(auto _ : state) {
+        std::vector<CollisionProxy*> results = collision_manager->search(query);
+        benchmark::DoNotOptimize(results);
+    }
+}
+
+// Keeps half of the hardware threads spinning, like other processes competing for the machine
+class BackgroundLoad {
+public:
+    BackgroundLoad() : stopping_{false} {
+        for (unsigned int index = 0; index < std::max(1u, std::thread::hardware_concurrency() / 2); ++index) {
+            threads_.emplace_back([this]() {
+                volatile std::size_t counter = 0;
+                while (!stopping_.load(std::memory_order_relaxed)) {
+                    counter = counter + 1;
+                }
+            });
+        }
+    }
+
+    ~BackgroundLoad() {
+        stopping_ = true;
+        for (std::thread& thread : threads_) {
+            thread.join();
+        }
+    }
+
+private:
+    std::atomic<bool> stopping_;
+    std::vector<std::thread> threads_;
+};
+
+static void report_latency_percentiles(benchmark::State& state, std::vector<double>& latencies_ms) {
+    std::sort(latencies_ms.begin(), latencies_ms.end());
+    state.counters["p50_ms"] = latencies_ms[latencies_ms.size() / 2];
+    state.counters["p99_ms"] = latencies_ms[latencies_ms.size() * 99 / 100];
+    state.counters["max_ms"] = latencies_ms.back();
+}
+
+template<class Search>
+static void search_with_background_load(benchmark::State& state, Search&& search) {
+    Query query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN")
+                      .add(CollisionField::VEHICLE_TYPE_CODE_1, QueryType::CONTAINS, "Sedan");
+
+    BackgroundLoad background_load;
+    std::vector<double> latencies_ms;
+
+    for(auto _ : state) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<CollisionProxy*> results = search(query);
+        benchmark::DoNotOptimize(results);
+        latencies_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    report_latency_percentiles(state, latencies_ms);
+}
+
+BENCHMARK_DEFINE_F(CollisionManagerBenchmark, SearchOpenMpWithBackgroundLoad)(benchmark::State& state) {
+    search_with_background_load(state, [](const Query& query) { return collision_manager->searchOpenMp(query); });
+}
+
+BENCHMARK_DEFINE_F(CollisionManagerBenchmark, SearchThreadPoolWithBackgroundLoad)(benchmark::State& state) {
+    search_with_background_load(state, [](const Query& query) { return collision_manager->search(query); });
+}
+
+// Nightly refresh with a release that has no changes, against loading that release from scratch.
+// The refresh still parses the whole file and hashes every row of it.
+static void BM_RefreshUnchangedRelease(benchmark::State& state) {
+    const std::string filename{"../Motor_Vehicle_Collisions_-_Crashes_20250123.csv"};
+    CollisionManager manager{filename};
+    manager.refresh(filename);
+
+    for (auto _ : state) {
+        RefreshResult result = manager.refresh(filename);
+        benchmark::DoNotOptimize(result);
+    }
+}
+
+// Query latency on its own (0) and while another thread appends a small file every 10 ms (1). Every append
+// publishes a new snapshot, queries keep running on the one they started on instead of waiting for it.
+static void BM_SearchDuringAppends(benchmark::State& state) {
+    CollisionManager manager{std::string("../Motor_Vehicle_Collisions_-_Crashes_20250123.csv")};
+    manager.set_query_cache_budget(0);
+    Query query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN")
+                      .add(CollisionField::VEHICLE_TYPE_CODE_1, QueryType::CONTAINS, "Sedan");
+
+    std::atomic<bool> stopping{false};
+    std::size_t num_appends = 0;
+    std::thread writer;
+    if (state.range(0) == 1) {
+        writer = std::thread([&]() {
+            while (!stopping) {
+                manager.append(std::string("../MotorVehicleCollisionData_subset.csv"));
+                num_appends++;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        });
+    }
+
+    std::vector<double> latencies_ms;
+    for (auto _ : state) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<CollisionProxy*> results = manager.search(query);
+        benchmark::DoNotOptimize(results);
+        latencies_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    stopping = true;
+    if (writer.joinable()) {
+        writer.join();
+    }
+    report_latency_percentiles(state, latencies_ms);
+    state.counters["appends"] = num_appends;
+}
+
+static void BM_ReloadRelease(benchmark::State& state) {
+    for (auto _ : state) {
+        CollisionManager manager{std::string("../Motor_Vehicle_Collisions_-_Crashes_20250123.csv")};
+        benchmark::DoNotOptimize(manager);
+    }
+}
+
 BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchSingleStringFieldNoMatches)->Iterations(NUM_ITERATIONS);
 BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchSingleStringFieldSomeMatches)->Iterations(NUM_ITERATIONS);
 BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchSingleSizeTFieldNoMatches)->Iterations(NUM_ITERATIONS);
@@ -233,6 +465,59 @@ BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchRangeofCoordinatesSomeMatc
 BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchDatesEqualsSomeMatches)->Iterations(NUM_ITERATIONS);
 BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchDatesRangeSomeMatches)->Iterations(NUM_ITERATIONS);
 BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchRangeofCoordinates_DateRangeSomeMatches)->Iterations(NUM_ITERATIONS);
+BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchDashboardQueriesOneByOne)->Iterations(NUM_ITERATIONS / 10);
+BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchDashboardQueriesBatch)->Iterations(NUM_ITERATIONS / 10);
+BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchRepeatedQueryCached)->Iterations(NUM_ITERATIONS);
+BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchSingleCollisionId)->Iterations(NUM_ITERATIONS);
+BENCHMARK_REGISTER_F(CollisionManagerBenchmark, GetByCollisionId)->Iterations(1000000);
+BENCHMARK_REGISTER_F(CollisionManagerBenchmark, GetByCollisionIds)->Iterations(NUM_ITERATIONS);
+BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchConcurrentClientsOpenMp)->Iterations(NUM_ITERATIONS / 10)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchConcurrentClientsThreadPool)->Iterations(NUM_ITERATIONS / 10)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchOpenMpWithBackgroundLoad)->Iterations(NUM_ITERATIONS)->UseRealTime();
+BENCHMARK_REGISTER_F(CollisionManagerBenchmark, SearchThreadPoolWithBackgroundLoad)->Iterations(NUM_ITERATIONS)->UseRealTime();
+
+BENCHMARK(BM_RefreshUnchangedRelease)->Iterations(3)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_ReloadRelease)->Iterations(3)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SearchDuringAppends)->Arg(0)->Arg(1)->Iterations(NUM_ITERATIONS)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// One update and one erase per iteration, each published as its own snapshot
+static void BM_UpdateAndErase(benchmark::State& state) {
+    CollisionManager manager{std::string("../Motor_Vehicle_Collisions_-_Crashes_20250123.csv")};
+    std::vector<std::size_t> collision_ids;
+    for (const CollisionProxy* collision : manager.search(Query::create(CollisionField::COLLISION_ID, QueryType::HAS_VALUE, std::size_t{0}))) {
+        collision_ids.push_back(collision->collision_id->value());
+    }
+
+    std::size_t next = 0;
+    for (auto _ : state) {
+        manager.update(collision_ids[next++], [](Collision& collision) {
+            collision.number_of_persons_injured = 1;
+        });
+        manager.erase(collision_ids[next++]);
+    }
+}
+BENCHMARK(BM_UpdateAndErase)->Iterations(1000)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+// A substring match on every street name with no index to help, with and without a 5ms deadline
+static void BM_SearchAsyncDeadline(benchmark::State& state) {
+    CollisionManager manager{std::string("../Motor_Vehicle_Collisions_-_Crashes_20250123.csv")};
+    manager.set_query_cache_budget(0);
+    Query query = Query::create(CollisionField::ON_STREET_NAME, QueryType::CONTAINS, "avenue", Qualifier::CASE_INSENSITIVE)
+        .add(CollisionField::OFF_STREET_NAME, QueryType::CONTAINS, "street", Qualifier::CASE_INSENSITIVE);
+
+    SearchResult result{};
+    for (auto _ : state) {
+        SearchOptions options{};
+        if (state.range(0) > 0) {
+            options.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds{state.range(0)};
+        }
+        result = manager.search_async(query, options).get();
+        benchmark::DoNotOptimize(result.results.data());
+    }
+    state.counters["timed_out"] = result.status == SearchStatus::TIMED_OUT;
+    state.counters["rows_searched"] = result.num_rows_searched;
+}
+BENCHMARK(BM_SearchAsyncDeadline)->Arg(0)->Arg(5)->Iterations(NUM_ITERATIONS)->Unit(benchmark::kMillisecond)->UseRealTime();
 
 //BENCHMARK_MAIN();
 int main(int argc, char**argv) {
@@ -1,6 +1,24 @@
+#include "collision_index.hpp"
 #include "collision_manager.hpp"
+#include "collision_snapshot.hpp"
+#include "index_advisor.hpp"
+#include "spatial_index.hpp"
+#include "thread_pool.hpp"
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <future>
 #include <gtest/gtest.h>
+#include <latch>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <utility>
 
 namespace {
     const char* const kSubsetDataset = "../MotorVehicleCollisionData_subset.csv";
@@ -11,12 +29,26 @@ protected:
     CollisionManagerTest() :
         collision_manager_m(CollisionManager("")) {}
 
-    CollisionManager create_collision_manager(std::vector<Collision>& collisions) {
-        return CollisionManager(collisions);
+    CollisionManager create_collision_manager(std::vector<Collision>& collisions, const LoadOptions& options = LoadOptions{}) {
+        return CollisionManager(collisions, options);
     }
 
-    CollisionManager create_collision_manager_from_csv(const std::string& filename) {
-        return CollisionManager(filename);
+    CollisionManager create_collision_manager_from_csv(const std::string& filename, const LoadOptions& options = LoadOptions{}) {
+        return CollisionManager(filename, options);
+    }
+
+    std::shared_ptr<const CollisionSnapshot> get_snapshot(CollisionManager& collision_manager) {
+        return collision_manager.snapshot_->load();
+    }
+
+    void wait_for_compaction(CollisionManager& collision_manager) {
+        if (collision_manager.compactor_.joinable()) {
+            collision_manager.compactor_.join();
+        }
+    }
+
+    void wait_for_index_recommendations(CollisionManager& collision_manager) {
+        collision_manager.stop_applying_index_recommendations();
     }
 
     void SetUp(){
@@ -682,3 +714,1545 @@ TEST_F(CollisionManagerTest, Query_Match_VehicleType) {
 
 }
 
+
+TEST_F(CollisionManagerTest, SearchBatch_MatchesIndividualSearches) {
+
+    std::chrono::year_month_day date1{
+        std::chrono::year{2021},
+        std::chrono::month{9},
+        std::chrono::day{11}
+    };
+
+    std::vector<Query> queries{
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN"),
+        Query::create(CollisionField::BOROUGH, Qualifier::NOT, QueryType::EQUALS, "BROOKLYN"),
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "queens", Qualifier::CASE_INSENSITIVE)
+            .add(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date1),
+        Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208})
+            .add(CollisionField::VEHICLE_TYPE_CODE_1, QueryType::CONTAINS, "Sedan"),
+        Query::create(CollisionField::VEHICLE_TYPE_CODE_1, QueryType::EQUALS, "Nothing should match me")
+    };
+
+    // Disable the cache so that both paths below really evaluate the queries
+    collision_manager_m.set_query_cache_budget(0);
+
+    std::vector<QueryResults> batch_results = collision_manager_m.search_batch(queries);
+    ASSERT_EQ(batch_results.size(), queries.size());
+
+    for (std::size_t index = 0; index < queries.size(); ++index) {
+        std::vector<CollisionProxy*> results = collision_manager_m.searchOpenMp(queries[index]);
+        EXPECT_EQ(batch_results[index], results) << "Batch result differs for query " << index;
+    }
+
+    EXPECT_GT(batch_results[0].size(), 0);
+    EXPECT_EQ(batch_results[4].size(), 0);
+
+    // The index advisor sees the predicates of a batch like those of single searches
+    collision_manager_m.set_index_advisor(IndexAdvisorMode::RECOMMEND);
+    EXPECT_EQ(collision_manager_m.search_batch(queries), batch_results);
+    collision_manager_m.set_index_advisor(IndexAdvisorMode::OFF);
+    const FieldWorkload borough = collision_manager_m.get_index_advisor().get_workload(CollisionField::BOROUGH);
+    EXPECT_EQ(borough.num_predicates, 3);
+    EXPECT_GT(borough.rows_scanned, 0);
+    EXPECT_GT(collision_manager_m.get_index_advisor().get_workload(CollisionField::VEHICLE_TYPE_CODE_1).rows_scanned, 0);
+}
+
+TEST_F(CollisionManagerTest, CanonicalQueryIgnoresPredicateOrderAndCase) {
+
+    Query query1 = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN", Qualifier::CASE_INSENSITIVE)
+        .add(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208});
+    Query query2 = Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208})
+        .add(CollisionField::BOROUGH, QueryType::EQUALS, "brooklyn", Qualifier::CASE_INSENSITIVE)
+        .add(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208});
+    Query query3 = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "brooklyn")
+        .add(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208});
+    Query query4 = Query::create(CollisionField::BOROUGH, Qualifier::NOT, QueryType::EQUALS, "BROOKLYN", Qualifier::CASE_INSENSITIVE)
+        .add(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208});
+
+    EXPECT_EQ(query1.canonical(), query2.canonical());
+    EXPECT_NE(query1.canonical(), query3.canonical());
+    EXPECT_NE(query1.canonical(), query4.canonical());
+}
+
+TEST_F(CollisionManagerTest, QueryCache_RepeatedQueriesAreServedFromCache) {
+
+    Query query1 = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN")
+        .add(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::GREATER_THAN, std::uint8_t{0});
+    Query query2 = Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::GREATER_THAN, std::uint8_t{0})
+        .add(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN");
+
+    EXPECT_EQ(collision_manager_m.get_query_cache().size(), 0);
+
+    std::vector<CollisionProxy*> results1 = collision_manager_m.searchOpenMp(query1);
+    EXPECT_GT(results1.size(), 0) << "Search should return at least one result";
+    EXPECT_EQ(collision_manager_m.get_query_cache().size(), 1);
+
+    std::vector<CollisionProxy*> results2 = collision_manager_m.searchOpenMp(query2);
+    EXPECT_EQ(results1, results2);
+    EXPECT_EQ(collision_manager_m.get_query_cache().size(), 1);
+
+    // Not-equals on borough matches far more rows than can be stored as ids, so it is kept as a bitmap
+    Query query3 = Query::create(CollisionField::BOROUGH, Qualifier::NOT, QueryType::EQUALS, "Nothing should match me");
+    std::vector<CollisionProxy*> results3 = collision_manager_m.searchOpenMp(query3);
+    EXPECT_EQ(collision_manager_m.searchOpenMp(query3), results3);
+    EXPECT_EQ(collision_manager_m.get_query_cache().size(), 2);
+}
+
+TEST_F(CollisionManagerTest, QueryCache_StaysWithinMemoryBudget) {
+
+    const std::size_t memory_budget = 512;
+    collision_manager_m.set_query_cache_budget(memory_budget);
+
+    for (std::uint8_t persons_injured = 0; persons_injured < 10; ++persons_injured) {
+        Query query = Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::LESS_THAN, persons_injured);
+        collision_manager_m.searchOpenMp(query);
+        EXPECT_LE(collision_manager_m.get_query_cache().memory_usage(), memory_budget);
+    }
+
+    EXPECT_LT(collision_manager_m.get_query_cache().size(), 10);
+}
+
+TEST_F(CollisionManagerTest, SearchOnThreadPool_MatchesSearchOpenMp) {
+
+    collision_manager_m.set_query_cache_budget(0);
+
+    std::chrono::year_month_day date1{
+        std::chrono::year{2021},
+        std::chrono::month{9},
+        std::chrono::day{11}
+    };
+
+    std::vector<Query> queries{
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN"),
+        Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208})
+            .add(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date1),
+        Query::create(CollisionField::LATITUDE, QueryType::LESS_THAN, 40.667202f)
+            .add(CollisionField::VEHICLE_TYPE_CODE_2, QueryType::CONTAINS, "Station Wagon"),
+        Query::create(CollisionField::COLLISION_ID, QueryType::EQUALS, 0ULL)
+    };
+
+    std::vector<std::vector<CollisionProxy*>> expected;
+    for (const Query& query : queries) {
+        expected.push_back(collision_manager_m.searchOpenMp(query));
+    }
+
+    // Many clients issuing queries at once share the same pool workers
+    std::vector<std::thread> clients;
+    std::atomic<std::size_t> mismatches{0};
+    for (std::size_t client = 0; client < 8; ++client) {
+        clients.emplace_back([&, client]() {
+            for (std::size_t iteration = 0; iteration < 20; ++iteration) {
+                const std::size_t query_index = (client + iteration) % queries.size();
+                if (collision_manager_m.search(queries[query_index]) != expected[query_index]) {
+                    mismatches++;
+                }
+            }
+        });
+    }
+    for (std::thread& client : clients) {
+        client.join();
+    }
+
+    EXPECT_EQ(mismatches.load(), 0);
+    EXPECT_GT(expected[0].size(), 0);
+    EXPECT_EQ(expected[3].size(), 0);
+}
+
+TEST_F(CollisionManagerTest, ThreadPool_RunsEveryTaskAndRethrows) {
+
+    ThreadPool pool{4};
+
+    std::vector<std::size_t> counts(1000, 0);
+    pool.parallel_for(counts.size(), [&counts](std::size_t task_index) {
+        counts[task_index]++;
+    });
+    EXPECT_EQ(std::count(counts.begin(), counts.end(), 1), counts.size());
+
+    EXPECT_THROW({
+        pool.parallel_for(10, [](std::size_t task_index) {
+            if (task_index == 5) {
+                throw std::runtime_error("task failed");
+            }
+        });
+    }, std::runtime_error);
+
+    // submit hands the first exception to done instead of rethrowing it
+    std::promise<std::exception_ptr> done;
+    std::fill(counts.begin(), counts.end(), 0);
+    pool.submit(counts.size(), [&counts](std::size_t task_index) {
+        counts[task_index]++;
+        if (task_index == 999) {
+            throw std::runtime_error("task failed");
+        }
+    }, [&done](std::exception_ptr exception) { done.set_value(exception); });
+    EXPECT_NE(done.get_future().get(), nullptr);
+    EXPECT_EQ(std::count(counts.begin(), counts.end(), 1), counts.size());
+}
+
+TEST_F(CollisionManagerTest, IndexedQueries_MatchFilteringEveryRow) {
+
+    collision_manager_m.set_query_cache_budget(0);
+
+    // Every row, in row order, found by scanning only
+    std::vector<CollisionProxy*> all_rows = collision_manager_m.search(
+        Query::create(CollisionField::BOROUGH, QueryType::HAS_VALUE, ""));
+    std::vector<CollisionProxy*> rows_without_borough = collision_manager_m.search(
+        Query::create(CollisionField::BOROUGH, Qualifier::NOT, QueryType::HAS_VALUE, ""));
+    all_rows.insert(all_rows.end(), rows_without_borough.begin(), rows_without_borough.end());
+    std::sort(all_rows.begin(), all_rows.end());
+
+    auto filter = [&all_rows](const std::function<bool(const CollisionProxy*)>& predicate) {
+        std::vector<CollisionProxy*> expected;
+        std::copy_if(all_rows.begin(), all_rows.end(), std::back_inserter(expected), predicate);
+        return expected;
+    };
+
+    std::chrono::year_month_day date1{std::chrono::year{2021}, std::chrono::month{9}, std::chrono::day{11}};
+    std::uint32_t zip_code = 11208;
+
+    // Selective lookups use the index, unselective ones fall back to scanning
+    EXPECT_EQ(collision_manager_m.search(Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, zip_code)),
+              filter([&](const CollisionProxy* c) { return c->zip_code->has_value() && c->zip_code->value() == zip_code; }));
+
+    EXPECT_EQ(collision_manager_m.search(Query::create(CollisionField::ZIP_CODE, QueryType::HAS_VALUE, zip_code)),
+              filter([&](const CollisionProxy* c) { return c->zip_code->has_value(); }));
+
+    EXPECT_EQ(collision_manager_m.search(Query::create(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date1)
+                                             .add(CollisionField::ZIP_CODE, QueryType::EQUALS, zip_code)),
+              filter([&](const CollisionProxy* c) {
+                  return c->crash_date->has_value() && c->crash_date->value() > date1 &&
+                         c->zip_code->has_value() && c->zip_code->value() == zip_code;
+              }));
+
+    EXPECT_EQ(collision_manager_m.search(Query::create(CollisionField::NUMBER_OF_PERSONS_KILLED, QueryType::GREATER_THAN, std::uint8_t{0})
+                                             .add(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN")),
+              filter([&](const CollisionProxy* c) {
+                  return c->number_of_persons_killed->has_value() && c->number_of_persons_killed->value() > 0 &&
+                         c->borough->has_value() && c->borough->value() == "BROOKLYN";
+              }));
+
+    EXPECT_EQ(collision_manager_m.search(Query::create(CollisionField::ZIP_CODE, Qualifier::NOT, QueryType::EQUALS, zip_code)),
+              filter([&](const CollisionProxy* c) { return !(c->zip_code->has_value() && c->zip_code->value() == zip_code); }));
+}
+
+TEST_F(CollisionManagerTest, MatchNotOnIndexedFields) {
+    Collision collision1{};
+    collision1.zip_code = 11208;
+    collision1.number_of_persons_killed = 0;
+
+    Collision collision2{};
+    collision2.zip_code = 11201;
+    collision2.number_of_persons_killed = 1;
+
+    Collision collision3{};
+    collision3.number_of_persons_killed = 0;
+
+    std::vector<Collision> collisions{collision1, collision2, collision3, collision1, collision1, collision1, collision1, collision1};
+
+    CollisionManager collision_manager = create_collision_manager(collisions);
+
+    // Rows without a zip code match the negation
+    Query query1 = Query::create(CollisionField::ZIP_CODE, Qualifier::NOT, QueryType::EQUALS, std::uint32_t{11208});
+    std::vector<CollisionProxy*> results1 = collision_manager.search(query1);
+    ASSERT_EQ(results1.size(), 2);
+    EXPECT_EQ(*results1[0]->zip_code, 11201);
+    EXPECT_FALSE(results1[1]->zip_code->has_value());
+
+    Query query2 = Query::create(CollisionField::NUMBER_OF_PERSONS_KILLED, Qualifier::NOT, QueryType::LESS_THAN, std::uint8_t{1});
+    std::vector<CollisionProxy*> results2 = collision_manager.search(query2);
+    ASSERT_EQ(results2.size(), 1);
+    EXPECT_EQ(*results2[0]->number_of_persons_killed, 1);
+
+    Query query3 = Query::create(CollisionField::ZIP_CODE, Qualifier::NOT, QueryType::HAS_VALUE, std::uint32_t{0});
+    std::vector<CollisionProxy*> results3 = collision_manager.search(query3);
+    ASSERT_EQ(results3.size(), 1);
+    EXPECT_FALSE(results3[0]->zip_code->has_value());
+
+    Query query4 = Query::create(CollisionField::ZIP_CODE, Qualifier::NOT, QueryType::GREATER_THAN, std::uint32_t{11200})
+        .add(CollisionField::NUMBER_OF_PERSONS_KILLED, Qualifier::NOT, QueryType::EQUALS, std::uint8_t{1});
+    std::vector<CollisionProxy*> results4 = collision_manager.search(query4);
+    ASSERT_EQ(results4.size(), 1);
+    EXPECT_FALSE(results4[0]->zip_code->has_value());
+}
+
+TEST_F(CollisionManagerTest, ZoneMaps_SkipOnlyZonesWithoutMatches) {
+    Zone zone{};
+    zone.num_rows = 10;
+    zone.null_count = 2;
+    zone.min = std::uint8_t{1};
+    zone.max = std::uint8_t{3};
+
+    EXPECT_FALSE(zone_may_match(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::EQUALS, std::uint8_t{0}).get()[0], zone));
+    EXPECT_TRUE(zone_may_match(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::EQUALS, std::uint8_t{2}).get()[0], zone));
+    EXPECT_FALSE(zone_may_match(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::GREATER_THAN, std::uint8_t{3}).get()[0], zone));
+    EXPECT_FALSE(zone_may_match(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::LESS_THAN, std::uint8_t{1}).get()[0], zone));
+
+    // Rows without a value match any negated query
+    EXPECT_TRUE(zone_may_match(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, Qualifier::NOT, QueryType::LESS_THAN, std::uint8_t{5}).get()[0], zone));
+    zone.null_count = 0;
+    EXPECT_FALSE(zone_may_match(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, Qualifier::NOT, QueryType::LESS_THAN, std::uint8_t{5}).get()[0], zone));
+    EXPECT_FALSE(zone_may_match(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, Qualifier::NOT, QueryType::HAS_VALUE, std::uint8_t{0}).get()[0], zone));
+
+    Zone string_zone{};
+    string_zone.num_rows = 10;
+    string_zone.values = std::vector<std::string>{"BROOKLYN", "QUEENS"};
+
+    EXPECT_TRUE(zone_may_match(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "queens", Qualifier::CASE_INSENSITIVE).get()[0], string_zone));
+    EXPECT_FALSE(zone_may_match(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BRONX").get()[0], string_zone));
+    EXPECT_FALSE(zone_may_match(Query::create(CollisionField::BOROUGH, QueryType::CONTAINS, "BRON").get()[0], string_zone));
+    EXPECT_FALSE(zone_may_match(Query::create(CollisionField::BOROUGH, Qualifier::NOT, QueryType::CONTAINS, "N").get()[0], string_zone));
+
+    string_zone.values.reset();
+    EXPECT_TRUE(zone_may_match(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BRONX").get()[0], string_zone));
+}
+
+TEST_F(CollisionManagerTest, ClusteredLoad_MatchesUnclusteredResults) {
+
+    std::chrono::year_month_day date1{std::chrono::year{2021}, std::chrono::month{9}, std::chrono::day{11}};
+    Query query = Query::create(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date1)
+        .add(CollisionField::BOROUGH, QueryType::HAS_VALUE, "");
+
+    auto collision_ids = [](const std::vector<CollisionProxy*>& results) {
+        std::vector<std::size_t> ids;
+        for (const CollisionProxy* collision : results) {
+            ids.push_back(collision->collision_id->value());
+        }
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+
+    std::vector<CollisionProxy*> expected = collision_manager_m.search(query);
+    ASSERT_GT(expected.size(), 0);
+
+    CollisionManager by_date = create_collision_manager_from_csv(kSubsetDataset, LoadOptions{ClusterKey::CRASH_DATE});
+    std::vector<CollisionProxy*> results1 = by_date.search(query);
+    EXPECT_EQ(collision_ids(results1), collision_ids(expected));
+
+    // Results come out in row order, which is now date order
+    EXPECT_TRUE(std::is_sorted(results1.begin(), results1.end(), [](const CollisionProxy* first, const CollisionProxy* second) {
+        return first->crash_date->value() < second->crash_date->value();
+    }));
+
+    CollisionManager by_borough_and_date = create_collision_manager_from_csv(kSubsetDataset, LoadOptions{ClusterKey::BOROUGH_CRASH_DATE});
+    std::vector<CollisionProxy*> results2 = by_borough_and_date.search(query);
+    EXPECT_EQ(collision_ids(results2), collision_ids(expected));
+
+    EXPECT_TRUE(std::is_sorted(results2.begin(), results2.end(), [](const CollisionProxy* first, const CollisionProxy* second) {
+        if (first->borough->value() != second->borough->value()) {
+            return first->borough->value() < second->borough->value();
+        }
+        return first->crash_date->value() < second->crash_date->value();
+    }));
+
+    // Indexes are built after reordering, so indexed lookups agree as well
+    Query zip_query = Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208});
+    EXPECT_EQ(collision_ids(by_date.search(zip_query)), collision_ids(collision_manager_m.search(zip_query)));
+}
+
+TEST_F(CollisionManagerTest, SpatialGrid_CoverContainsEveryPointInBox) {
+
+    SpatialGrid grid{40.5f, 40.9f, -74.25f, -73.7f};
+
+    const float min_latitude = 40.61f;
+    const float max_latitude = 40.67f;
+    const float min_longitude = -74.02f;
+    const float max_longitude = -73.95f;
+
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> ranges = grid.cover(min_latitude, max_latitude, min_longitude, max_longitude, 64);
+    EXPECT_GT(ranges.size(), 0);
+    EXPECT_LE(ranges.size(), 64);
+    EXPECT_TRUE(std::is_sorted(ranges.begin(), ranges.end()));
+
+    for (float latitude = min_latitude; latitude <= max_latitude; latitude += 0.001f) {
+        for (float longitude = min_longitude; longitude <= max_longitude; longitude += 0.001f) {
+            const std::uint32_t key = grid.key(latitude, longitude);
+            EXPECT_TRUE(std::any_of(ranges.begin(), ranges.end(), [key](const auto& range) {
+                return range.first <= key && key <= range.second;
+            })) << "Point " << latitude << ", " << longitude << " is not covered";
+        }
+    }
+
+    EXPECT_TRUE(grid.cover(max_latitude, min_latitude, min_longitude, max_longitude, 64).empty());
+}
+
+TEST_F(CollisionManagerTest, SpatialClustering_BoxQueriesMatchUnclusteredResults) {
+
+    auto collision_ids = [](const std::vector<CollisionProxy*>& results) {
+        std::vector<std::size_t> ids;
+        for (const CollisionProxy* collision : results) {
+            ids.push_back(collision->collision_id->value());
+        }
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+
+    CollisionManager by_location = create_collision_manager_from_csv(kSubsetDataset, LoadOptions{ClusterKey::LATITUDE_LONGITUDE});
+
+    std::vector<Query> queries{
+        Query::create(CollisionField::LATITUDE, QueryType::GREATER_THAN, 40.6f)
+            .add(CollisionField::LATITUDE, QueryType::LESS_THAN, 40.7f)
+            .add(CollisionField::LONGITUDE, QueryType::GREATER_THAN, -74.0f)
+            .add(CollisionField::LONGITUDE, QueryType::LESS_THAN, -73.9f),
+        Query::create(CollisionField::LATITUDE, QueryType::GREATER_THAN, 40.75f)
+            .add(CollisionField::BOROUGH, QueryType::EQUALS, "BRONX"),
+        Query::create(CollisionField::LONGITUDE, QueryType::LESS_THAN, -73.95f)
+            .add(CollisionField::LATITUDE, Qualifier::NOT, QueryType::GREATER_THAN, 40.65f),
+        Query::create(CollisionField::LATITUDE, QueryType::GREATER_THAN, 41.0f)
+            .add(CollisionField::LATITUDE, QueryType::LESS_THAN, 40.0f)
+    };
+
+    for (std::size_t index = 0; index < queries.size(); ++index) {
+        EXPECT_EQ(collision_ids(by_location.search(queries[index])), collision_ids(collision_manager_m.search(queries[index])))
+            << "Results differ for query " << index;
+    }
+    EXPECT_GT(by_location.search(queries[0]).size(), 0);
+}
+
+TEST_F(CollisionManagerTest, BucketIndex_MatchesEveryQueryType) {
+    std::vector<Collision> collisions;
+    for (std::size_t index = 0; index < 40; ++index) {
+        Collision collision{};
+        collision.collision_id = index;
+        if (index % 10 != 9) {
+            collision.number_of_persons_injured = std::uint8_t(index % 10 == 0 ? 255 : index % 10);
+        }
+        collisions.push_back(collision);
+    }
+
+    CollisionManager collision_manager = create_collision_manager(collisions);
+
+    auto count = [&collision_manager](const Query& query) {
+        return collision_manager.search(query).size();
+    };
+
+    EXPECT_EQ(count(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::EQUALS, std::uint8_t{3})), 4);
+    EXPECT_EQ(count(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::EQUALS, std::uint8_t{255})), 4);
+    EXPECT_EQ(count(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::EQUALS, std::uint8_t{0})), 0);
+    EXPECT_EQ(count(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::LESS_THAN, std::uint8_t{3})), 8);
+    EXPECT_EQ(count(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::GREATER_THAN, std::uint8_t{7})), 8);
+    EXPECT_EQ(count(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::HAS_VALUE, std::uint8_t{0})), 36);
+    EXPECT_EQ(count(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, Qualifier::NOT, QueryType::HAS_VALUE, std::uint8_t{0})), 4);
+    EXPECT_EQ(count(Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, Qualifier::NOT, QueryType::LESS_THAN, std::uint8_t{255})), 8);
+
+    // Rows with equal values come out in row order
+    std::vector<CollisionProxy*> results = collision_manager.search(
+        Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::EQUALS, std::uint8_t{2}));
+    ASSERT_EQ(results.size(), 4);
+    for (std::size_t index = 0; index < results.size(); ++index) {
+        EXPECT_EQ(*results[index]->collision_id, index * 10 + 2);
+    }
+}
+
+TEST_F(CollisionManagerTest, SortedIndex_LayoutsAgreeWithStdBounds) {
+
+    // Many duplicates and a size that does not fill the last level of the Eytzinger tree
+    std::vector<std::uint32_t> keys;
+    for (std::uint32_t index = 0; index < 1000; ++index) {
+        keys.push_back((index * 7919) % 300);
+    }
+    std::sort(keys.begin(), keys.end());
+    std::vector<std::uint32_t> rows(keys.size());
+    std::iota(rows.begin(), rows.end(), 0);
+
+    SortedIndex<std::uint32_t> sorted{keys, rows, IndexLayout::SORTED};
+    SortedIndex<std::uint32_t> eytzinger{keys, rows, IndexLayout::EYTZINGER};
+    SortedIndex<std::uint32_t> learned{keys, rows, IndexLayout::LEARNED};
+
+    for (std::uint32_t key = 0; key <= 301; ++key) {
+        const std::size_t lower_bound = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        const std::size_t upper_bound = std::upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+        EXPECT_EQ(sorted.lower_bound(key), lower_bound) << "key " << key;
+        EXPECT_EQ(sorted.upper_bound(key), upper_bound) << "key " << key;
+        EXPECT_EQ(eytzinger.lower_bound(key), lower_bound) << "key " << key;
+        EXPECT_EQ(eytzinger.upper_bound(key), upper_bound) << "key " << key;
+        EXPECT_EQ(learned.lower_bound(key), lower_bound) << "key " << key;
+        EXPECT_EQ(learned.upper_bound(key), upper_bound) << "key " << key;
+    }
+
+    SortedIndex<std::uint32_t> empty{{}, {}, IndexLayout::EYTZINGER};
+    EXPECT_EQ(empty.lower_bound(5), 0);
+
+    // Keys keep the order of the values they encode
+    EXPECT_LT(index_key(-2.5f), index_key(-1.0f));
+    EXPECT_LT(index_key(-1.0f), index_key(0.0f));
+    EXPECT_EQ(index_key(-0.0f), index_key(0.0f));
+    EXPECT_LT(index_key(0.0f), index_key(40.7f));
+}
+
+TEST_F(CollisionManagerTest, EytzingerLayout_MatchesSortedLayout) {
+
+    CollisionManager eytzinger = create_collision_manager_from_csv(kSubsetDataset, LoadOptions{ClusterKey::NONE, IndexLayout::EYTZINGER});
+
+    std::chrono::year_month_day date1{std::chrono::year{2021}, std::chrono::month{9}, std::chrono::day{11}};
+    std::vector<Query> queries{
+        Query::create(CollisionField::CRASH_DATE, QueryType::EQUALS, date1),
+        Query::create(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date1),
+        Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208}),
+        Query::create(CollisionField::LATITUDE, QueryType::LESS_THAN, 40.6f),
+        Query::create(CollisionField::COLLISION_ID, Qualifier::NOT, QueryType::GREATER_THAN, std::size_t{4400000})
+    };
+
+    for (std::size_t index = 0; index < queries.size(); ++index) {
+        EXPECT_EQ(eytzinger.search(queries[index]).size(), collision_manager_m.search(queries[index]).size())
+            << "Results differ for query " << index;
+    }
+}
+
+TEST_F(CollisionManagerTest, LearnedLayout_MatchesStdBoundsForIrregularKeys) {
+
+    // Runs of near linear keys broken up by large jumps and long runs of duplicates, so there are
+    // several segments and keys between two segments that are not in the index
+    std::vector<std::uint64_t> keys;
+    for (std::uint64_t index = 0; index < 5000; ++index) {
+        keys.push_back(index * 4 + (index % 3));
+    }
+    keys.insert(keys.end(), 500, 20000);
+    for (std::uint64_t index = 0; index < 3000; ++index) {
+        keys.push_back(1000000 + index * index);
+    }
+    keys.push_back(std::numeric_limits<std::uint64_t>::max());
+    std::vector<std::uint32_t> rows(keys.size());
+    std::iota(rows.begin(), rows.end(), 0);
+
+    SortedIndex<std::uint64_t> learned{keys, rows, IndexLayout::LEARNED};
+
+    std::vector<std::uint64_t> lookups{0, 1, 19999, 20000, 20001, 999999, std::numeric_limits<std::uint64_t>::max()};
+    for (std::uint64_t key = 0; key < 21000; key += 3) {
+        lookups.push_back(key);
+    }
+    for (std::uint64_t index = 0; index < 3000; index += 11) {
+        lookups.push_back(1000000 + index * index);
+        lookups.push_back(1000000 + index * index + index);
+    }
+
+    for (const std::uint64_t key : lookups) {
+        EXPECT_EQ(learned.lower_bound(key), std::lower_bound(keys.begin(), keys.end(), key) - keys.begin()) << "key " << key;
+        EXPECT_EQ(learned.upper_bound(key), std::upper_bound(keys.begin(), keys.end(), key) - keys.begin()) << "key " << key;
+    }
+
+    SortedIndex<std::uint64_t> empty{{}, {}, IndexLayout::LEARNED};
+    EXPECT_EQ(empty.lower_bound(5), 0);
+    EXPECT_EQ(empty.upper_bound(5), 0);
+
+    CollisionManager learned_manager = create_collision_manager_from_csv(kSubsetDataset, LoadOptions{ClusterKey::NONE, IndexLayout::LEARNED});
+    std::chrono::year_month_day date1{std::chrono::year{2021}, std::chrono::month{9}, std::chrono::day{11}};
+    std::vector<Query> queries{
+        Query::create(CollisionField::CRASH_DATE, QueryType::EQUALS, date1),
+        Query::create(CollisionField::CRASH_DATE, QueryType::LESS_THAN, date1),
+        Query::create(CollisionField::COLLISION_ID, QueryType::GREATER_THAN, std::size_t{4400000}),
+        Query::create(CollisionField::COLLISION_ID, Qualifier::NOT, QueryType::EQUALS, std::size_t{4455765})
+    };
+    for (std::size_t index = 0; index < queries.size(); ++index) {
+        EXPECT_EQ(learned_manager.search(queries[index]).size(), collision_manager_m.search(queries[index]).size())
+            << "Results differ for query " << index;
+    }
+}
+
+TEST_F(CollisionManagerTest, CompositeIndexes_MatchUncompositeResults) {
+
+    CollisionManager composite = create_collision_manager_from_csv(kSubsetDataset,
+        LoadOptions{ClusterKey::NONE, IndexLayout::SORTED, {CompositeKey::BOROUGH_CRASH_DATE, CompositeKey::ZIP_CODE_CRASH_DATE}});
+    // The learned layout only applies to the columns it is chosen for, composite keys keep their leading field's layout
+    CollisionManager learned_composite = create_collision_manager_from_csv(kSubsetDataset,
+        LoadOptions{ClusterKey::NONE, IndexLayout::LEARNED, {CompositeKey::BOROUGH_CRASH_DATE, CompositeKey::ZIP_CODE_CRASH_DATE}});
+
+    std::chrono::year_month_day date1{std::chrono::year{2021}, std::chrono::month{9}, std::chrono::day{11}};
+    std::chrono::year_month_day date2{std::chrono::year{2022}, std::chrono::month{3}, std::chrono::day{26}};
+    std::vector<Query> queries{
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN")
+            .add(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date1)
+            .add(CollisionField::CRASH_DATE, QueryType::LESS_THAN, date2),
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "QUEENS")
+            .add(CollisionField::CRASH_DATE, QueryType::EQUALS, date1),
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "NOWHERE")
+            .add(CollisionField::CRASH_DATE, QueryType::HAS_VALUE, date1),
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "brooklyn", Qualifier::CASE_INSENSITIVE)
+            .add(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date1),
+        Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208})
+            .add(CollisionField::CRASH_DATE, QueryType::LESS_THAN, date2)
+            .add(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::GREATER_THAN, std::uint8_t{0}),
+        Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208})
+            .add(CollisionField::CRASH_DATE, Qualifier::NOT, QueryType::LESS_THAN, date2),
+        Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11208})
+            .add(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date2)
+            .add(CollisionField::CRASH_DATE, QueryType::LESS_THAN, date1)
+    };
+
+    for (std::size_t index = 0; index < queries.size(); ++index) {
+        EXPECT_EQ(composite.search(queries[index]).size(), collision_manager_m.search(queries[index]).size())
+            << "Results differ for query " << index;
+        EXPECT_EQ(learned_composite.search(queries[index]).size(), collision_manager_m.search(queries[index]).size())
+            << "Learned results differ for query " << index;
+    }
+
+    // Both predicates resolve through the composite index, nothing is left to scan
+    std::vector<Collision> collisions_list(8);
+    for (Collision& collision : collisions_list) {
+        collision.borough = "QUEENS";
+        collision.crash_date = date1;
+    }
+    collisions_list[0].borough = "BROOKLYN";
+    collisions_list[1].borough = "BROOKLYN";
+    collisions_list[1].crash_date = date2;
+    Collisions collisions{};
+    for (const Collision& collision : collisions_list) {
+        collisions.add(collision);
+    }
+    IndexedCollisions indexed{collisions, LoadOptions{ClusterKey::NONE, IndexLayout::SORTED, {CompositeKey::BOROUGH_CRASH_DATE}}};
+
+    Query query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN")
+        .add(CollisionField::CRASH_DATE, QueryType::LESS_THAN, date2);
+    const QueryPlan plan = indexed.plan(query);
+    EXPECT_TRUE(plan.scanned_queries.empty());
+    ASSERT_TRUE(plan.use_candidates);
+    EXPECT_EQ(plan.candidates[0], std::uint64_t{1});
+
+    // A composite range too wide to be worth it leaves the query to the next composite index
+    for (std::size_t index = 0; index < collisions_list.size(); ++index) {
+        collisions_list[index].zip_code = 11200 + index;
+    }
+    Collisions zip_collisions{};
+    for (const Collision& collision : collisions_list) {
+        zip_collisions.add(collision);
+    }
+    IndexedCollisions both{zip_collisions, LoadOptions{ClusterKey::NONE, IndexLayout::SORTED,
+                                                        {CompositeKey::BOROUGH_CRASH_DATE, CompositeKey::ZIP_CODE_CRASH_DATE}}};
+    Query wide_query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "QUEENS")
+        .add(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11203})
+        .add(CollisionField::CRASH_DATE, QueryType::LESS_THAN, date2);
+    const QueryPlan wide_plan = both.plan(wide_query);
+    ASSERT_TRUE(wide_plan.use_candidates);
+    EXPECT_EQ(wide_plan.candidates[0], std::uint64_t{1} << 3);
+    ASSERT_EQ(wide_plan.scanned_queries.size(), 1);
+    EXPECT_EQ(wide_plan.scanned_queries[0]->get_name(), CollisionField::BOROUGH);
+}
+
+TEST_F(CollisionManagerTest, LazyIndexes_BuiltOnFirstUseOrWhenPinned) {
+
+    std::vector<Collision> collisions_list(8);
+    for (std::size_t index = 0; index < collisions_list.size(); ++index) {
+        collisions_list[index].zip_code = 11200 + index;
+        collisions_list[index].collision_id = 100 + index;
+        collisions_list[index].number_of_persons_injured = index % 2;
+    }
+    Collisions collisions{};
+    for (const Collision& collision : collisions_list) {
+        collisions.add(collision);
+    }
+
+    IndexedCollisions indexed{collisions, LoadOptions{.eager_indexes = {CollisionField::NUMBER_OF_PERSONS_INJURED}}};
+    EXPECT_TRUE(indexed.is_index_built(CollisionField::NUMBER_OF_PERSONS_INJURED));
+    EXPECT_FALSE(indexed.is_index_built(CollisionField::ZIP_CODE));
+    EXPECT_FALSE(indexed.is_index_built(CollisionField::COLLISION_ID));
+
+    // The first query scans while the index is built, build_index waits for that build
+    Query query = Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11203});
+    QueryPlan plan = indexed.plan(query);
+    EXPECT_FALSE(plan.use_candidates);
+    EXPECT_EQ(plan.scanned_queries.size(), 1);
+    indexed.build_index(CollisionField::ZIP_CODE);
+    EXPECT_TRUE(indexed.is_index_built(CollisionField::ZIP_CODE));
+    EXPECT_FALSE(indexed.is_index_built(CollisionField::CRASH_DATE));
+
+    plan = indexed.plan(query);
+    EXPECT_TRUE(plan.scanned_queries.empty());
+    ASSERT_TRUE(plan.use_candidates);
+    EXPECT_EQ(plan.candidates[0], std::uint64_t{1} << 3);
+
+    EXPECT_EQ(indexed.get_collision_id_hash().find(105), 5);
+    EXPECT_FALSE(indexed.is_index_built(CollisionField::COLLISION_ID));
+
+    EXPECT_THROW(IndexedCollisions(collisions, LoadOptions{.eager_indexes = {CollisionField::BOROUGH}}), std::runtime_error);
+
+    // Concurrent first uses build the index once and all see the same results
+    CollisionManager lazy = create_collision_manager_from_csv(kSubsetDataset);
+    Query date_query = Query::create(CollisionField::CRASH_DATE, QueryType::EQUALS,
+        std::chrono::year_month_day{std::chrono::year{2021}, std::chrono::month{9}, std::chrono::day{11}});
+    lazy.set_query_cache_budget(0);
+    const std::size_t expected = collision_manager_m.search(date_query).size();
+
+    std::vector<std::size_t> sizes(4);
+    std::vector<std::thread> clients;
+    for (std::size_t client = 0; client < sizes.size(); ++client) {
+        clients.emplace_back([&, client]() { sizes[client] = lazy.search(date_query).size(); });
+    }
+    for (std::thread& client : clients) {
+        client.join();
+    }
+    for (const std::size_t size : sizes) {
+        EXPECT_EQ(size, expected);
+    }
+    get_snapshot(lazy)->get_segments().front().collisions->build_index(CollisionField::CRASH_DATE);
+    EXPECT_EQ(lazy.search(date_query).size(), expected);
+
+    // Builds are queued on the shared pool. Destroying the collisions before a queued build starts drops it
+    // instead of waiting for a worker.
+    ThreadPool& pool = ThreadPool::shared();
+    std::latch workers_busy{static_cast<std::ptrdiff_t>(pool.size())};
+    std::promise<void> release_workers;
+    std::shared_future<void> released = release_workers.get_future().share();
+    std::promise<void> workers_done;
+    pool.submit(pool.size(), [&workers_busy, released](std::size_t) {
+        workers_busy.count_down();
+        released.wait();
+    }, [&workers_done](std::exception_ptr) { workers_done.set_value(); });
+    workers_busy.wait();
+
+    auto queued = std::make_unique<IndexedCollisions>(collisions);
+    EXPECT_FALSE(queued->plan(query).use_candidates);
+    queued.reset();
+
+    release_workers.set_value();
+    workers_done.get_future().wait();
+}
+
+TEST_F(CollisionManagerTest, BackgroundIndexBuild_ScansUntilIndexesArePublished) {
+
+    std::vector<Collision> collisions_list(8);
+    for (std::size_t index = 0; index < collisions_list.size(); ++index) {
+        collisions_list[index].zip_code = 11200 + index;
+        collisions_list[index].borough = "QUEENS";
+        collisions_list[index].crash_date = std::chrono::year_month_day{std::chrono::year{2021}, std::chrono::month{9}, std::chrono::day{1}};
+        collisions_list[index].collision_id = 100 + index % 6;
+    }
+    Collisions collisions{};
+    for (const Collision& collision : collisions_list) {
+        collisions.add(collision);
+    }
+
+    IndexedCollisions indexed{collisions, LoadOptions{.composite_indexes = {CompositeKey::ZIP_CODE_CRASH_DATE},
+                                                      .index_build = IndexBuild::BACKGROUND}};
+    Query query = Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11203});
+
+    // Nothing is built yet, so the planner neither waits nor uses an index
+    QueryPlan plan = indexed.plan(query);
+    EXPECT_FALSE(indexed.is_index_built(CollisionField::ZIP_CODE));
+    EXPECT_FALSE(plan.use_candidates);
+    EXPECT_EQ(plan.scanned_queries.size(), 1);
+    EXPECT_TRUE(plan.zones.empty());
+
+    // Point lookups scan instead of building the collision_id hash, and find the same first rows it would
+    EXPECT_EQ(indexed.find_collision_id(103), 3);
+    std::vector<std::size_t> collision_ids{101, 99, 105, 101};
+    std::vector<std::uint32_t> rows(collision_ids.size());
+    indexed.find_collision_ids(collision_ids, rows);
+    EXPECT_EQ(rows, (std::vector<std::uint32_t>{1, HashIndex::NOT_FOUND, 5, 1}));
+    EXPECT_FALSE(indexed.collision_id_hash.is_built());
+
+    std::stop_source stopped;
+    stopped.request_stop();
+    indexed.build_all_indexes(stopped.get_token());
+    EXPECT_FALSE(indexed.is_index_built(CollisionField::ZIP_CODE));
+    EXPECT_FALSE(indexed.plan(query).zones.empty());
+
+    indexed.build_all_indexes(std::stop_token{});
+    EXPECT_TRUE(indexed.is_index_built(CollisionField::ZIP_CODE));
+    EXPECT_TRUE(indexed.is_index_built(CollisionField::COLLISION_ID));
+    EXPECT_TRUE(indexed.collision_id_hash.is_built());
+    indexed.find_collision_ids(collision_ids, rows);
+    EXPECT_EQ(rows, (std::vector<std::uint32_t>{1, HashIndex::NOT_FOUND, 5, 1}));
+    plan = indexed.plan(query);
+    EXPECT_TRUE(plan.scanned_queries.empty());
+    ASSERT_TRUE(plan.use_candidates);
+    EXPECT_EQ(plan.candidates[0], std::uint64_t{1} << 3);
+
+    Query composite_query = Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11203})
+        .add(CollisionField::CRASH_DATE, QueryType::HAS_VALUE, std::chrono::year_month_day{});
+    EXPECT_TRUE(indexed.plan(composite_query).scanned_queries.empty());
+
+    // Queries return the same results whether or not the builder has published anything yet
+    CollisionManager background = create_collision_manager_from_csv(kSubsetDataset, LoadOptions{.index_build = IndexBuild::BACKGROUND});
+    background.set_query_cache_budget(0);
+    Query date_query = Query::create(CollisionField::CRASH_DATE, QueryType::GREATER_THAN,
+        std::chrono::year_month_day{std::chrono::year{2021}, std::chrono::month{9}, std::chrono::day{11}});
+    const std::size_t expected = collision_manager_m.search(date_query).size();
+    for (std::size_t repeat = 0; repeat < 3; ++repeat) {
+        EXPECT_EQ(background.search(date_query).size(), expected);
+    }
+
+    // Appends hand the builder their snapshot without waiting for the build of the one before
+    for (std::size_t copy = 2; copy <= 3; ++copy) {
+        background.append(std::string(kSubsetDataset));
+        EXPECT_EQ(background.search(date_query).size(), copy * expected);
+    }
+}
+
+TEST_F(CollisionManagerTest, DictionaryIndex_MatchesEveryStringPredicate) {
+
+    const std::vector<std::optional<std::string>> boroughs{"QUEENS", "BROOKLYN", std::nullopt, "QUEENS", "BRONX", "brooklyn", std::nullopt, "QUEENS"};
+    std::vector<Collision> collisions_list(boroughs.size());
+    for (std::size_t index = 0; index < boroughs.size(); ++index) {
+        collisions_list[index].borough = boroughs[index];
+    }
+    Collisions collisions{};
+    for (const Collision& collision : collisions_list) {
+        collisions.add(collision);
+    }
+    IndexedCollisions indexed{collisions};
+    EXPECT_TRUE(indexed.is_dictionary_field(CollisionField::BOROUGH));
+    EXPECT_FALSE(indexed.is_dictionary_field(CollisionField::ZIP_CODE));
+    EXPECT_THROW(indexed.build_dictionary_index(CollisionField::ZIP_CODE), std::runtime_error);
+
+    std::vector<std::uint64_t> rows;
+    Query query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN");
+    EXPECT_FALSE(indexed.lookup(query.get()[0], boroughs.size(), rows));
+
+    indexed.build_dictionary_index(CollisionField::BOROUGH);
+    EXPECT_GT(indexed.dictionary_index_memory(CollisionField::BOROUGH), 0);
+
+    auto expect_rows = [&](const Query& query, const std::uint64_t expected) {
+        std::vector<std::uint64_t> rows;
+        ASSERT_TRUE(indexed.lookup(query.get()[0], boroughs.size(), rows));
+        EXPECT_EQ(rows[0], expected);
+    };
+    expect_rows(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN"), 0b00000010);
+    expect_rows(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "brooklyn", Qualifier::CASE_INSENSITIVE), 0b00100010);
+    expect_rows(Query::create(CollisionField::BOROUGH, QueryType::CONTAINS, "BR"), 0b00010010);
+    expect_rows(Query::create(CollisionField::BOROUGH, QueryType::HAS_VALUE, ""), 0b10111011);
+    expect_rows(Query::create(CollisionField::BOROUGH, Qualifier::NOT, QueryType::EQUALS, "QUEENS"), 0b01110110);
+    expect_rows(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "NOWHERE"), 0);
+
+    // More matches than allowed falls back to scanning
+    EXPECT_FALSE(indexed.lookup(Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "QUEENS").get()[0], 2, rows));
+
+    indexed.drop_dictionary_index(CollisionField::BOROUGH);
+    EXPECT_EQ(indexed.dictionary_index_memory(CollisionField::BOROUGH), 0);
+    EXPECT_FALSE(indexed.lookup(query.get()[0], boroughs.size(), rows));
+}
+
+TEST_F(CollisionManagerTest, IndexAdvisor_BuildsAndDropsIndexesForTheWorkload) {
+
+    IndexAdvisor advisor;
+    Query street_query = Query::create(CollisionField::ON_STREET_NAME, QueryType::EQUALS, "BROADWAY");
+    Query borough_query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "QUEENS");
+    for (std::size_t repeat = 0; repeat < 10; ++repeat) {
+        advisor.record_query(street_query);
+        advisor.record_query(borough_query);
+    }
+    advisor.record_scan(CollisionField::ON_STREET_NAME, 1000, 10, 0.01);
+    advisor.record_scan(CollisionField::BOROUGH, 1000, 500, 0.01);
+
+    // Borough filters match too many rows for the planner to use an index, the street index does not fit in 100 bytes
+    std::vector<IndexCandidate> candidates{{CollisionField::ON_STREET_NAME, false, 400},
+                                           {CollisionField::BOROUGH, true, 400},
+                                           {CollisionField::OFF_STREET_NAME, false, 400}};
+    std::vector<IndexRecommendation> recommendations = advisor.recommend(candidates, 1000, 0.25, 1000);
+    ASSERT_EQ(recommendations.size(), 3);
+    EXPECT_EQ(recommendations[0].action, IndexAction::BUILD);
+    EXPECT_GT(recommendations[0].benefit_seconds, 0);
+    EXPECT_EQ(recommendations[1].action, IndexAction::DROP);
+    EXPECT_EQ(recommendations[1].benefit_seconds, 0);
+    EXPECT_EQ(recommendations[2].action, IndexAction::NONE);
+    EXPECT_EQ(advisor.recommend(candidates, 1000, 0.25, 100)[0].action, IndexAction::NONE);
+
+    advisor.decay();
+    EXPECT_EQ(advisor.get_workload(CollisionField::ON_STREET_NAME).num_predicates, 5);
+    EXPECT_EQ(advisor.recommend(candidates, 1000, 0.25, 1000)[0].action, IndexAction::NONE);
+
+    // The manager only records its workload when asked to. It then applies the recommendations every
+    // INDEX_ADVISOR_INTERVAL queries on a background thread.
+    CollisionManager automatic = create_collision_manager_from_csv(kSubsetDataset);
+    automatic.set_query_cache_budget(0);
+    const std::size_t expected = collision_manager_m.search(street_query).size();
+    ASSERT_GT(expected, 0);
+    EXPECT_EQ(automatic.search(street_query).size(), expected);
+    EXPECT_EQ(automatic.get_index_advisor().get_workload(CollisionField::ON_STREET_NAME).num_predicates, 0);
+
+    automatic.set_index_advisor(IndexAdvisorMode::AUTOMATIC);
+    for (std::size_t repeat = 0; repeat < CollisionManager::INDEX_ADVISOR_INTERVAL; ++repeat) {
+        EXPECT_EQ(automatic.search(street_query).size(), expected);
+    }
+    wait_for_index_recommendations(automatic);
+    EXPECT_GT(automatic.get_index_advisor().get_workload(CollisionField::ON_STREET_NAME).rows_scanned, 0);
+
+    auto action_for = [](const std::vector<IndexRecommendation>& recommendations, const CollisionField& field) {
+        for (const IndexRecommendation& recommendation : recommendations) {
+            if (recommendation.field == field) {
+                return recommendation.action;
+            }
+        }
+        return IndexAction::NONE;
+    };
+    EXPECT_EQ(action_for(automatic.get_index_recommendations(), CollisionField::ON_STREET_NAME), IndexAction::KEEP);
+    EXPECT_EQ(automatic.search(street_query).size(), expected);
+
+    automatic.set_index_advisor(IndexAdvisorMode::RECOMMEND, 0);
+    EXPECT_EQ(action_for(automatic.apply_index_recommendations(), CollisionField::ON_STREET_NAME), IndexAction::DROP);
+    EXPECT_EQ(automatic.search(street_query).size(), expected);
+}
+
+TEST_F(CollisionManagerTest, GetByCollisionId_MatchesSearch) {
+
+    std::vector<CollisionProxy*> all_rows = collision_manager_m.search(
+        Query::create(CollisionField::COLLISION_ID, QueryType::HAS_VALUE, std::size_t{0}));
+    ASSERT_GT(all_rows.size(), 0);
+
+    std::vector<std::size_t> collision_ids;
+    for (const CollisionProxy* collision : all_rows) {
+        std::shared_ptr<CollisionProxy> found = collision_manager_m.get_by_collision_id(collision->collision_id->value());
+        ASSERT_NE(found, nullptr);
+        EXPECT_EQ(found->collision_id->value(), collision->collision_id->value());
+        collision_ids.push_back(collision->collision_id->value());
+    }
+
+    EXPECT_EQ(collision_manager_m.get_by_collision_id(std::numeric_limits<std::size_t>::max() - 1), nullptr);
+
+    collision_ids.push_back(1);
+    QueryResults results = collision_manager_m.get_by_collision_ids(collision_ids);
+    ASSERT_EQ(results.size(), collision_ids.size());
+    for (std::size_t index = 0; index + 1 < collision_ids.size(); ++index) {
+        ASSERT_NE(results[index], nullptr);
+        EXPECT_EQ(results[index]->collision_id->value(), collision_ids[index]);
+    }
+    EXPECT_EQ(results.back(), nullptr);
+
+    std::vector<Collision> no_collisions{};
+    CollisionManager empty = create_collision_manager(no_collisions);
+    EXPECT_EQ(empty.get_by_collision_id(1), nullptr);
+}
+
+TEST_F(CollisionManagerTest, CrackingIndex_RefinesWithEveryRangeQuery) {
+
+    // Keys 0..999 shuffled, plus two rows without a value
+    std::vector<std::uint32_t> keys(1000);
+    std::vector<std::uint32_t> rows(1000);
+    for (std::uint32_t index = 0; index < keys.size(); ++index) {
+        keys[index] = (index * 617) % 1000;
+        rows[index] = index;
+    }
+    rows.push_back(1000);
+    rows.push_back(1001);
+
+    CrackingIndex index{keys, rows};
+    EXPECT_EQ(index.num_values(), 1000);
+    EXPECT_EQ(index.num_pieces(), 1);
+
+    auto expect_range = [&](const std::uint64_t low, const std::uint64_t high) {
+        index.with_range(low, high, [&](const std::size_t first, const std::size_t last, const std::vector<std::uint32_t>& rows_by_value) {
+            ASSERT_EQ(last - first, std::min<std::uint64_t>(high, 1000) - std::min<std::uint64_t>(low, 1000));
+            for (std::size_t position = first; position < last; ++position) {
+                const std::uint32_t key = keys[rows_by_value[position]];
+                EXPECT_TRUE(key >= low && key < high) << key;
+            }
+        });
+    };
+    expect_range(100, 200);
+    EXPECT_EQ(index.num_pieces(), 3);
+    expect_range(150, 900);
+    expect_range(0, 50);
+    expect_range(990, std::uint64_t{1} << 32);
+    expect_range(500, 500);
+    EXPECT_GT(index.num_pieces(), 5);
+
+    std::chrono::hh_mm_ss<std::chrono::minutes> time1{std::chrono::hours{0} + std::chrono::minutes{30}};
+    std::chrono::hh_mm_ss<std::chrono::minutes> time2{std::chrono::hours{23} + std::chrono::minutes{30}};
+    std::chrono::hh_mm_ss<std::chrono::minutes> time3{std::chrono::hours{9} + std::chrono::minutes{35}};
+    std::vector<Query> queries{
+        Query::create(CollisionField::CRASH_TIME, QueryType::LESS_THAN, time1),
+        Query::create(CollisionField::CRASH_TIME, QueryType::GREATER_THAN, time2),
+        Query::create(CollisionField::CRASH_TIME, QueryType::EQUALS, time3),
+        Query::create(CollisionField::CRASH_TIME, Qualifier::NOT, QueryType::EQUALS, time3),
+        Query::create(CollisionField::CRASH_TIME, QueryType::HAS_VALUE, time3),
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN").add(CollisionField::CRASH_TIME, QueryType::LESS_THAN, time1),
+    };
+
+    auto collision_ids = [](const std::vector<CollisionProxy*>& results) {
+        std::vector<std::size_t> ids;
+        for (const CollisionProxy* collision : results) {
+            ids.push_back(collision->collision_id->value());
+        }
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+
+    CollisionManager cracked = create_collision_manager_from_csv(kSubsetDataset, LoadOptions{.cracked_indexes={CollisionField::CRASH_TIME}});
+    for (const Query& query : queries) {
+        EXPECT_EQ(collision_ids(cracked.search(query)), collision_ids(collision_manager_m.search(query)));
+    }
+
+    // Fields with a sorted index or no numeric order cannot be cracked
+    EXPECT_FALSE(create_collision_manager_from_csv(kSubsetDataset, LoadOptions{.cracked_indexes={CollisionField::CRASH_DATE}}).is_initialized());
+    EXPECT_FALSE(create_collision_manager_from_csv(kSubsetDataset, LoadOptions{.cracked_indexes={CollisionField::BOROUGH}}).is_initialized());
+}
+
+TEST_F(CollisionManagerTest, Append_MatchesLoadingEverythingAtOnce) {
+
+    const std::vector<std::string> boroughs{"QUEENS", "BROOKLYN", "BRONX", "MANHATTAN"};
+    std::vector<Collision> collisions_list(2000);
+    for (std::size_t index = 0; index < collisions_list.size(); ++index) {
+        Collision& collision = collisions_list[index];
+        collision.crash_date = std::chrono::year_month_day{std::chrono::year{2021}, std::chrono::month(index % 12 + 1), std::chrono::day(index % 28 + 1)};
+        collision.crash_time = std::chrono::hh_mm_ss<std::chrono::minutes>{std::chrono::minutes{(index * 37) % 1440}};
+        if (index % 5 != 0) {
+            collision.borough = boroughs[index % 4];
+        }
+        collision.zip_code = 11200 + index % 50;
+        collision.number_of_persons_injured = index % 7;
+        collision.on_street_name = "STREET " + std::to_string(index % 100);
+        collision.collision_id = 1000000 + index;
+    }
+
+    std::chrono::year_month_day date1{std::chrono::year{2021}, std::chrono::month{3}, std::chrono::day{1}};
+    std::chrono::year_month_day date2{std::chrono::year{2021}, std::chrono::month{6}, std::chrono::day{1}};
+    std::vector<Query> queries{
+        Query::create(CollisionField::CRASH_DATE, QueryType::EQUALS, date1),
+        Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11211}),
+        Query::create(CollisionField::ZIP_CODE, Qualifier::NOT, QueryType::EQUALS, std::uint32_t{11211}),
+        Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::EQUALS, std::uint8_t{6}),
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "QUEENS")
+            .add(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date1)
+            .add(CollisionField::CRASH_DATE, QueryType::LESS_THAN, date2),
+        Query::create(CollisionField::CRASH_TIME, QueryType::LESS_THAN,
+                      std::chrono::hh_mm_ss<std::chrono::minutes>{std::chrono::minutes{60}}),
+    };
+
+    auto collision_ids = [](const std::vector<CollisionProxy*>& results) {
+        std::vector<std::size_t> ids;
+        for (const CollisionProxy* collision : results) {
+            ids.push_back(collision->collision_id->value());
+        }
+        return ids;
+    };
+
+    const LoadOptions options{.composite_indexes = {CompositeKey::BOROUGH_CRASH_DATE},
+                              .eager_indexes = {CollisionField::CRASH_DATE},
+                              .cracked_indexes = {CollisionField::CRASH_TIME}};
+    std::vector<Collision> first_collisions(collisions_list.begin(), collisions_list.begin() + 1000);
+    CollisionManager appended = create_collision_manager(first_collisions, options);
+    for (const Query& query : queries) {
+        appended.search(query);
+    }
+    ASSERT_NE(appended.get_by_collision_id(1000000), nullptr);
+
+    // A small segment after the loaded one, then a large one that merges with both of them, the same results either way
+    for (const auto& [num_rows, num_segments] : {std::pair<std::size_t, std::size_t>{1020, 2}, {2000, 1}}) {
+        const std::size_t first_row = appended.search(Query::create(CollisionField::COLLISION_ID, QueryType::HAS_VALUE, std::size_t{0})).size();
+        appended.append(std::span{collisions_list.begin() + first_row, collisions_list.begin() + num_rows});
+        EXPECT_EQ(get_snapshot(appended)->get_segments().size(), num_segments);
+
+        std::vector<Collision> all_collisions(collisions_list.begin(), collisions_list.begin() + num_rows);
+        CollisionManager expected = create_collision_manager(all_collisions, options);
+        for (const Query& query : queries) {
+            EXPECT_EQ(collision_ids(appended.search(query)), collision_ids(expected.search(query))) << query.canonical();
+        }
+
+        const std::shared_ptr<CollisionProxy> collision = appended.get_by_collision_id(1000000 + num_rows - 1);
+        ASSERT_NE(collision, nullptr);
+        EXPECT_EQ(collision->collision_id->value(), 1000000 + num_rows - 1);
+    }
+}
+
+TEST_F(CollisionManagerTest, Append_CsvAddsEveryRowOfTheFile) {
+
+    CollisionManager appended = create_collision_manager_from_csv(kSubsetDataset);
+    Query query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN");
+    const std::size_t num_matches = appended.search(query).size();
+    ASSERT_GT(num_matches, 0);
+
+    appended.append(std::string(kSubsetDataset));
+    EXPECT_EQ(appended.search(query).size(), 2 * num_matches);
+
+    EXPECT_THROW(appended.append(std::string("does_not_exist.csv")), std::runtime_error);
+}
+
+TEST_F(CollisionManagerTest, Refresh_AppliesOnlyTheRowsThatChanged) {
+
+    // Next release of the subset: the first row is gone, one row has another street name and a new row
+    // has the old contents of that row
+    std::ifstream subset{kSubsetDataset};
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(subset, line);) {
+        lines.push_back(line);
+    }
+    ASSERT_GT(lines.size(), 3);
+    const std::string updated_line = lines[2];
+    lines.erase(lines.begin() + 1);
+    lines[1].replace(lines[1].find("QUEENSBORO BRIDGE UPPER"), 23, "QUEENSBORO BRIDGE LOWER");
+    std::string inserted_line = updated_line;
+    inserted_line.replace(inserted_line.find(",4513547,"), 9, ",9999999,");
+    lines.push_back(inserted_line);
+
+    const std::string snapshot_filename = "refresh_snapshot.csv";
+    {
+        std::ofstream snapshot{snapshot_filename};
+        for (const std::string& line : lines) {
+            snapshot << line << '\n';
+        }
+    }
+
+    CollisionManager refreshed = create_collision_manager_from_csv(kSubsetDataset, LoadOptions{.composite_indexes = {CompositeKey::BOROUGH_CRASH_DATE}});
+    Query all_query = Query::create(CollisionField::COLLISION_ID, QueryType::HAS_VALUE, std::size_t{0});
+    Query lower_query = Query::create(CollisionField::ON_STREET_NAME, QueryType::EQUALS, "QUEENSBORO BRIDGE LOWER");
+    Query upper_query = Query::create(CollisionField::ON_STREET_NAME, QueryType::EQUALS, "QUEENSBORO BRIDGE UPPER");
+    const std::size_t num_rows = refreshed.search(all_query).size();
+    ASSERT_NE(refreshed.get_by_collision_id(4455765), nullptr);
+    ASSERT_EQ(refreshed.search(upper_query).size(), 1);
+
+    const RefreshResult result = refreshed.refresh(snapshot_filename);
+    EXPECT_EQ(result.num_inserted, 1);
+    EXPECT_EQ(result.num_updated, 1);
+    EXPECT_EQ(result.num_deleted, 1);
+
+    EXPECT_EQ(refreshed.search(all_query).size(), num_rows);
+    EXPECT_EQ(refreshed.search(lower_query).size(), 1);
+    EXPECT_EQ(refreshed.search(upper_query).size(), 1);
+    EXPECT_EQ(refreshed.get_by_collision_id(4455765), nullptr);
+    ASSERT_NE(refreshed.get_by_collision_id(4513547), nullptr);
+    EXPECT_EQ(refreshed.get_by_collision_id(4513547)->on_street_name->value(), "QUEENSBORO BRIDGE LOWER");
+    ASSERT_NE(refreshed.get_by_collision_id(9999999), nullptr);
+    EXPECT_EQ(refreshed.get_by_collision_id(9999999)->on_street_name->value(), "QUEENSBORO BRIDGE UPPER");
+
+    // Same rows as loading the new release from scratch, updated rows only move to the end
+    auto collision_ids = [](const std::vector<CollisionProxy*>& results) {
+        std::vector<std::size_t> ids;
+        for (const CollisionProxy* collision : results) {
+            ids.push_back(collision->collision_id->value());
+        }
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+    CollisionManager reloaded = create_collision_manager_from_csv(snapshot_filename);
+    Query brooklyn_query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN");
+    EXPECT_EQ(collision_ids(refreshed.search(all_query)), collision_ids(reloaded.search(all_query)));
+    EXPECT_EQ(collision_ids(refreshed.search(brooklyn_query)), collision_ids(reloaded.search(brooklyn_query)));
+
+    // Refreshing with the same release again changes nothing
+    const RefreshResult unchanged = refreshed.refresh(snapshot_filename);
+    EXPECT_EQ(unchanged.num_inserted + unchanged.num_updated + unchanged.num_deleted, 0);
+
+    // A new collision_id that the release repeats is inserted once, with its first row
+    std::string repeated_line = updated_line;
+    repeated_line.replace(repeated_line.find(",4513547,"), 9, ",9999998,");
+    lines.push_back(repeated_line);
+    repeated_line.replace(repeated_line.find("QUEENSBORO BRIDGE UPPER"), 23, "QUEENSBORO BRIDGE LOWER");
+    lines.push_back(repeated_line);
+    {
+        std::ofstream snapshot{snapshot_filename};
+        for (const std::string& line : lines) {
+            snapshot << line << '\n';
+        }
+    }
+    const RefreshResult repeated = refreshed.refresh(snapshot_filename);
+    EXPECT_EQ(repeated.num_inserted, 1);
+    EXPECT_EQ(repeated.num_updated + repeated.num_deleted, 0);
+    EXPECT_EQ(refreshed.search(Query::create(CollisionField::COLLISION_ID, QueryType::EQUALS, std::size_t{9999998})).size(), 1);
+    ASSERT_NE(refreshed.get_by_collision_id(9999998), nullptr);
+    EXPECT_EQ(refreshed.get_by_collision_id(9999998)->on_street_name->value(), "QUEENSBORO BRIDGE UPPER");
+
+    std::remove(snapshot_filename.c_str());
+}
+
+TEST_F(CollisionManagerTest, Snapshot_QueriesNeverSeeHalfOfAChange) {
+
+    CollisionManager manager = create_collision_manager_from_csv(kSubsetDataset);
+    Query all_query = Query::create(CollisionField::COLLISION_ID, QueryType::HAS_VALUE, std::size_t{0});
+    Query brooklyn_query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN");
+    const std::size_t num_rows = manager.search(all_query).size();
+    const std::size_t num_brooklyn = manager.search(brooklyn_query).size();
+    ASSERT_GT(num_brooklyn, 0);
+
+    const std::shared_ptr<const CollisionSnapshot> pinned = get_snapshot(manager);
+    std::shared_ptr<CollisionProxy> collision = manager.get_by_collision_id(4455765);
+    ASSERT_NE(collision, nullptr);
+
+    // Every copy of the file is appended at once, so both queries of a batch always see the same number of copies
+    std::atomic<bool> stopping{false};
+    std::atomic<std::size_t> mismatches{0};
+    std::thread reader([&]() {
+        const std::vector<Query> queries{all_query, brooklyn_query};
+        do {
+            const std::vector<QueryResults> results = manager.search_batch(queries);
+            const std::size_t num_copies = results[0].size() / num_rows;
+            if (results[0].size() % num_rows != 0 || results[1].size() != num_copies * num_brooklyn) {
+                mismatches++;
+            }
+            if (!results[1].empty() && results[1].back()->borough->value() != "BROOKLYN") {
+                mismatches++;
+            }
+            if (manager.search(all_query).size() % num_rows != 0) {
+                mismatches++;
+            }
+        } while (!stopping);
+    });
+
+    for (std::size_t copy = 0; copy < 4; ++copy) {
+        manager.append(std::string(kSubsetDataset));
+    }
+    stopping = true;
+    reader.join();
+
+    EXPECT_EQ(mismatches, 0);
+    EXPECT_EQ(manager.search(all_query).size(), 5 * num_rows);
+    EXPECT_EQ(manager.search(brooklyn_query).size(), 5 * num_brooklyn);
+
+    // A pinned snapshot keeps its rows and proxies through every later change
+    EXPECT_EQ(pinned->num_rows(), num_rows);
+    EXPECT_EQ(pinned->find(4455765), collision.get());
+    EXPECT_EQ(collision->collision_id->value(), 4455765);
+
+    // However many changes a query outlasts, its snapshot is kept for two more after it is done
+    std::shared_ptr<const CollisionSnapshot> running = get_snapshot(manager);
+    const std::weak_ptr<const CollisionSnapshot> released = running;
+    for (std::size_t change = 0; change < 3; ++change) {
+        manager.append(std::string(kSubsetDataset));
+    }
+    running.reset();
+    manager.append(std::string(kSubsetDataset));
+    EXPECT_FALSE(released.expired());
+    manager.append(std::string(kSubsetDataset));
+    EXPECT_TRUE(released.expired());
+
+    // Results of synchronous searches and lookups own their snapshot and outlast any number of changes
+    const QueryResults held = manager.search(brooklyn_query);
+    const std::shared_ptr<CollisionProxy> held_collision = manager.get_by_collision_id(4455765);
+    ASSERT_NE(held_collision, nullptr);
+    ASSERT_FALSE(held.empty());
+    EXPECT_EQ(held.snapshot, get_snapshot(manager));
+    for (std::size_t change = 0; change < 3; ++change) {
+        manager.erase(4455765);
+        manager.append(std::string(kSubsetDataset));
+    }
+    EXPECT_EQ(held.size(), 10 * num_brooklyn);
+    EXPECT_EQ(held.back()->borough->value(), "BROOKLYN");
+    EXPECT_EQ(held_collision->collision_id->value(), 4455765);
+}
+
+TEST_F(CollisionManagerTest, UpdateAndErase_MatchLoadingTheCorrectedRows) {
+
+    const std::vector<std::string> boroughs{"QUEENS", "BROOKLYN", "BRONX", "MANHATTAN"};
+    std::vector<Collision> collisions_list(2000);
+    for (std::size_t index = 0; index < collisions_list.size(); ++index) {
+        Collision& collision = collisions_list[index];
+        collision.crash_date = std::chrono::year_month_day{std::chrono::year{2021}, std::chrono::month(index % 12 + 1), std::chrono::day(index % 28 + 1)};
+        collision.borough = boroughs[index % 4];
+        collision.zip_code = 11200 + index % 50;
+        collision.number_of_persons_injured = index % 7;
+        collision.collision_id = 1000000 + index;
+    }
+
+    CollisionManager corrected = create_collision_manager(collisions_list);
+    const std::shared_ptr<const CollisionSnapshot> pinned = get_snapshot(corrected);
+
+    // Updated rows move after all others, in the order they were updated
+    std::vector<Collision> expected_list;
+    std::vector<Collision> updated_list;
+    for (std::size_t index = 0; index < collisions_list.size(); ++index) {
+        Collision collision = collisions_list[index];
+        if (index % 10 == 3) {
+            EXPECT_TRUE(corrected.update(*collision.collision_id, [](Collision& row) {
+                row.borough = "STATEN ISLAND";
+                row.number_of_persons_injured = 9;
+            }));
+            collision.borough = "STATEN ISLAND";
+            collision.number_of_persons_injured = 9;
+            updated_list.push_back(collision);
+        } else if (index % 10 == 7) {
+            EXPECT_TRUE(corrected.erase(*collision.collision_id));
+        } else {
+            expected_list.push_back(collision);
+        }
+    }
+    expected_list.insert(expected_list.end(), updated_list.begin(), updated_list.end());
+    CollisionManager expected = create_collision_manager(expected_list);
+
+    auto collision_ids = [](const std::vector<CollisionProxy*>& results) {
+        std::vector<std::size_t> ids;
+        for (const CollisionProxy* collision : results) {
+            ids.push_back(collision->collision_id->value());
+        }
+        return ids;
+    };
+
+    std::vector<Query> queries{
+        Query::create(CollisionField::COLLISION_ID, QueryType::HAS_VALUE, std::size_t{0}),
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "STATEN ISLAND"),
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "QUEENS"),
+        Query::create(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::GREATER_THAN, std::uint8_t{5}),
+        Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11217}),
+    };
+    for (const Query& query : queries) {
+        EXPECT_EQ(collision_ids(corrected.search(query)), collision_ids(expected.search(query))) << query.canonical();
+    }
+    EXPECT_EQ(collision_ids(corrected.search_batch(queries)[1]), collision_ids(expected.search(queries[1])));
+
+    const std::shared_ptr<CollisionProxy> updated = corrected.get_by_collision_id(1000003);
+    ASSERT_NE(updated, nullptr);
+    EXPECT_EQ(updated->borough->value(), "STATEN ISLAND");
+    EXPECT_EQ(updated->number_of_persons_injured->value(), 9);
+    EXPECT_EQ(updated->zip_code->value(), 11203);
+    EXPECT_EQ(corrected.get_by_collision_id(1000007), nullptr);
+
+    EXPECT_FALSE(corrected.erase(1000007));
+    EXPECT_FALSE(corrected.update(1000007, [](Collision&) {}));
+    EXPECT_FALSE(corrected.erase(42));
+    EXPECT_THROW(corrected.update(1000004, [](Collision& row) { row.collision_id = 42; }), std::invalid_argument);
+
+    // The snapshot from before the corrections still has the old rows
+    EXPECT_EQ(pinned->find(1000003)->borough->value(), "MANHATTAN");
+    EXPECT_NE(pinned->find(1000007), nullptr);
+}
+
+TEST_F(CollisionManagerTest, Compaction_RewritesSegmentsWithManyErasedRows) {
+
+    std::vector<Collision> collisions_list(1000);
+    for (std::size_t index = 0; index < collisions_list.size(); ++index) {
+        collisions_list[index].zip_code = 11200 + index % 50;
+        collisions_list[index].borough = index % 2 == 0 ? "QUEENS" : "BRONX";
+        collisions_list[index].crash_date = std::chrono::year_month_day{std::chrono::year{2021}, std::chrono::month{9}, std::chrono::day{1}};
+        collisions_list[index].collision_id = 1000000 + index;
+    }
+    Collisions collisions{};
+    for (const Collision& collision : collisions_list) {
+        collisions.add(collision);
+    }
+
+    const auto snapshot = std::make_shared<const CollisionSnapshot>(collisions);
+    std::vector<std::uint32_t> erased_rows(200);
+    std::iota(erased_rows.begin(), erased_rows.end(), 0);
+    const std::shared_ptr<const CollisionSnapshot> few_erased = snapshot->apply(Collisions{}, erased_rows, LoadOptions{});
+    EXPECT_FALSE(few_erased->needs_compaction());
+
+    erased_rows.resize(300);
+    std::iota(erased_rows.begin(), erased_rows.end(), 0);
+    const std::shared_ptr<const CollisionSnapshot> many_erased = snapshot->apply(Collisions{}, erased_rows, LoadOptions{});
+    ASSERT_TRUE(many_erased->needs_compaction());
+
+    const std::vector<CompactedSegment> compacted = many_erased->compact(LoadOptions{}, std::stop_token{});
+    ASSERT_EQ(compacted.size(), 1);
+    EXPECT_EQ(compacted[0].compacted.num_rows(), 700);
+
+    const std::shared_ptr<const CollisionSnapshot> rewritten = many_erased->replace(compacted);
+    ASSERT_NE(rewritten, nullptr);
+    EXPECT_EQ(rewritten->num_rows(), 700);
+    EXPECT_EQ(rewritten->get_segments()[0].num_erased_rows, 0);
+    EXPECT_FALSE(rewritten->needs_compaction());
+    EXPECT_EQ(rewritten->find(1000299), nullptr);
+    ASSERT_NE(rewritten->find(1000300), nullptr);
+    EXPECT_EQ(rewritten->get_row(rewritten->find(1000300)), 0);
+
+    // A row erased after the segment was read is erased in its compacted segment as well
+    const std::uint32_t row = 500;
+    const std::shared_ptr<const CollisionSnapshot> erased_since = many_erased->apply(Collisions{}, std::span{&row, 1}, LoadOptions{});
+    const std::shared_ptr<const CollisionSnapshot> carried_over = erased_since->replace(compacted);
+    ASSERT_NE(carried_over, nullptr);
+    EXPECT_EQ(carried_over->num_rows(), 700);
+    EXPECT_EQ(carried_over->get_segments()[0].num_erased_rows, 1);
+    EXPECT_TRUE(carried_over->get_segments()[0].is_erased(200));
+    EXPECT_EQ(carried_over->find(1000500), nullptr);
+    ASSERT_NE(carried_over->find(1000501), nullptr);
+    EXPECT_EQ(carried_over->get_row(carried_over->find(1000501)), 201);
+
+    // The manager compacts on its own once enough rows are erased, queries see the same rows before and after
+    CollisionManager manager = create_collision_manager(collisions_list);
+    Query query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "QUEENS");
+    for (std::size_t index = 0; index < 400; ++index) {
+        EXPECT_TRUE(manager.erase(1000000 + index));
+    }
+    wait_for_compaction(manager);
+
+    // The compactor may finish at any point during the erases, the rows erased after it stay in their bitmap
+    const std::shared_ptr<const CollisionSnapshot> compacted_snapshot = get_snapshot(manager);
+    std::size_t num_live_rows = 0;
+    for (const CollisionSegment& segment : compacted_snapshot->get_segments()) {
+        num_live_rows += segment.num_live_rows();
+    }
+    EXPECT_EQ(num_live_rows, 600);
+    EXPECT_LT(compacted_snapshot->num_rows(), 1000);
+    EXPECT_FALSE(compacted_snapshot->needs_compaction());
+    EXPECT_EQ(manager.search(query).size(), 300);
+    EXPECT_EQ(manager.get_by_collision_id(1000399), nullptr);
+    ASSERT_NE(manager.get_by_collision_id(1000400), nullptr);
+    EXPECT_EQ(manager.get_by_collision_id(1000400)->collision_id->value(), 1000400);
+}
+
+TEST_F(CollisionManagerTest, Subscriptions_MatchSearchingTheNewRows) {
+
+    const std::vector<std::string> boroughs{"QUEENS", "BROOKLYN", "BRONX", "MANHATTAN"};
+    const std::vector<std::string> vehicles{"Sedan", "Station Wagon/Sport Utility Vehicle", "Bike", "Taxi"};
+    std::vector<Collision> collisions_list(3000);
+    for (std::size_t index = 0; index < collisions_list.size(); ++index) {
+        Collision& collision = collisions_list[index];
+        collision.crash_date = std::chrono::year_month_day{std::chrono::year{2021}, std::chrono::month(index % 12 + 1), std::chrono::day(index % 28 + 1)};
+        collision.crash_time = std::chrono::hh_mm_ss<std::chrono::minutes>{std::chrono::minutes{(index * 37) % 1440}};
+        if (index % 5 != 0) {
+            collision.borough = boroughs[index % 4];
+        }
+        collision.zip_code = 11200 + index % 20;
+        collision.latitude = 40.5f + (index % 100) * 0.005f;
+        collision.number_of_cyclist_killed = index % 13 == 0 ? 1 : 0;
+        collision.vehicle_type_code_1 = vehicles[index % 4];
+        collision.collision_id = 1000000 + index;
+    }
+
+    std::chrono::year_month_day date1{std::chrono::year{2021}, std::chrono::month{3}, std::chrono::day{1}};
+    std::chrono::year_month_day date2{std::chrono::year{2021}, std::chrono::month{6}, std::chrono::day{1}};
+    std::vector<Query> queries{
+        Query::create(CollisionField::NUMBER_OF_CYCLIST_KILLED, QueryType::GREATER_THAN, std::uint8_t{0})
+            .add(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11211}),
+        Query::create(CollisionField::CRASH_DATE, QueryType::GREATER_THAN, date1)
+            .add(CollisionField::CRASH_DATE, QueryType::LESS_THAN, date2),
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "queens", Qualifier::CASE_INSENSITIVE),
+        Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "QUEENS"),
+        Query::create(CollisionField::BOROUGH, Qualifier::NOT, QueryType::EQUALS, "QUEENS"),
+        Query::create(CollisionField::BOROUGH, Qualifier::NOT, QueryType::HAS_VALUE, "")
+            .add(CollisionField::ZIP_CODE, Qualifier::NOT, QueryType::LESS_THAN, std::uint32_t{11210}),
+        Query::create(CollisionField::VEHICLE_TYPE_CODE_1, QueryType::CONTAINS, "sport", Qualifier::CASE_INSENSITIVE)
+            .add(CollisionField::LATITUDE, QueryType::LESS_THAN, 40.7f),
+        Query::create(CollisionField::VEHICLE_TYPE_CODE_1, QueryType::CONTAINS, "Bike")
+            .add(CollisionField::CRASH_TIME, QueryType::GREATER_THAN, std::chrono::hh_mm_ss<std::chrono::minutes>{std::chrono::minutes{720}}),
+        Query::create(CollisionField::COLLISION_ID, QueryType::EQUALS, std::size_t{1002500}),
+        Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{99999}),
+    };
+
+    auto collision_ids = [](const std::vector<CollisionProxy*>& results) {
+        std::vector<std::size_t> ids;
+        for (const CollisionProxy* collision : results) {
+            ids.push_back(collision->collision_id->value());
+        }
+        return ids;
+    };
+
+    std::vector<Collision> loaded(collisions_list.begin(), collisions_list.begin() + 1000);
+    std::vector<Collision> added(collisions_list.begin() + 1000, collisions_list.end());
+    CollisionManager manager = create_collision_manager(loaded);
+    CollisionManager expected = create_collision_manager(added);
+
+    // Every subscription is notified at most once per change, with the rows in the order they were added
+    std::vector<std::vector<std::size_t>> notified(queries.size());
+    std::vector<std::size_t> subscription_ids;
+    for (std::size_t index = 0; index < queries.size(); ++index) {
+        subscription_ids.push_back(manager.subscribe(queries[index], [&notified, &collision_ids, index](const std::vector<CollisionProxy*>& results) {
+            EXPECT_TRUE(notified[index].empty());
+            EXPECT_FALSE(results.empty());
+            notified[index] = collision_ids(results);
+        }));
+    }
+    EXPECT_THROW(manager.subscribe(Query::create(CollisionField::ZIP_CODE, QueryType::CONTAINS, std::uint32_t{1}), [](const auto&) {}), std::runtime_error);
+    EXPECT_THROW(manager.subscribe(Query::create(CollisionField::BOROUGH, QueryType::LESS_THAN, "B"), [](const auto&) {}), std::runtime_error);
+
+    manager.append(std::span<const Collision>{added});
+    for (std::size_t index = 0; index < queries.size(); ++index) {
+        EXPECT_EQ(notified[index], collision_ids(expected.search(queries[index]))) << queries[index].canonical();
+        EXPECT_EQ(notified[index].empty(), index == queries.size() - 1);
+    }
+
+    // Updated rows are matched with their new contents, erased rows are not matched at all
+    std::fill(notified.begin(), notified.end(), std::vector<std::size_t>{});
+    EXPECT_TRUE(manager.unsubscribe(subscription_ids[3]));
+    EXPECT_FALSE(manager.unsubscribe(subscription_ids[3]));
+    EXPECT_TRUE(manager.erase(1000000));
+    EXPECT_TRUE(manager.update(1000001, [](Collision& collision) {
+        collision.borough = "QUEENS";
+        collision.zip_code = 11211;
+        collision.number_of_cyclist_killed = 2;
+    }));
+    EXPECT_EQ(notified[0], std::vector<std::size_t>{1000001});
+    EXPECT_EQ(notified[2], std::vector<std::size_t>{1000001});
+    EXPECT_TRUE(notified[3].empty());
+    EXPECT_TRUE(notified[4].empty());
+    EXPECT_TRUE(notified[8].empty());
+}
+
+TEST_F(CollisionManagerTest, Subscriptions_FollowRowsReorderedByClustering) {
+
+    std::vector<Collision> collisions_list(3000);
+    for (std::size_t index = 0; index < collisions_list.size(); ++index) {
+        Collision& collision = collisions_list[index];
+        // Dates run backwards, so clustering reverses the rows of every segment
+        collision.crash_date = std::chrono::year_month_day{std::chrono::sys_days{std::chrono::year{2024} / 1 / 1} - std::chrono::days{index}};
+        collision.zip_code = 11200 + index % 20;
+        collision.collision_id = 1000000 + index;
+    }
+    Query query = Query::create(CollisionField::ZIP_CODE, QueryType::EQUALS, std::uint32_t{11211});
+
+    auto collision_ids = [](const std::vector<CollisionProxy*>& results) {
+        std::vector<std::size_t> ids;
+        for (const CollisionProxy* collision : results) {
+            ids.push_back(collision->collision_id->value());
+        }
+        return ids;
+    };
+    auto expected_ids = [&collisions_list](const std::size_t first, const std::size_t last) {
+        std::vector<std::size_t> ids;
+        for (std::size_t index = first; index < last; ++index) {
+            if (collisions_list[index].zip_code == 11211) {
+                ids.push_back(collisions_list[index].collision_id.value());
+            }
+        }
+        return ids;
+    };
+
+    std::vector<Collision> loaded(collisions_list.begin(), collisions_list.begin() + 2000);
+    CollisionManager manager = create_collision_manager(loaded, LoadOptions{ClusterKey::CRASH_DATE});
+    std::vector<std::size_t> notified;
+    manager.subscribe(query, [&notified, &collision_ids](const std::vector<CollisionProxy*>& results) {
+        notified = collision_ids(results);
+    });
+
+    // A small append gets a clustered segment of its own
+    std::vector<Collision> appended(collisions_list.begin() + 2000, collisions_list.begin() + 2100);
+    manager.append(std::span<const Collision>{appended});
+    EXPECT_EQ(get_snapshot(manager)->get_segments().size(), 2);
+    EXPECT_EQ(notified, expected_ids(2000, 2100));
+
+    // A large one is merged with the segments before it and clustered together with them
+    std::vector<Collision> merged(collisions_list.begin() + 2100, collisions_list.end());
+    manager.append(std::span<const Collision>{merged});
+    EXPECT_EQ(get_snapshot(manager)->get_segments().size(), 1);
+    EXPECT_EQ(notified, expected_ids(2100, 3000));
+}
+
+TEST_F(CollisionManagerTest, SearchAsync_StopsAtCancellationOrDeadline) {
+
+    CollisionManager manager = create_collision_manager_from_csv(kSubsetDataset);
+    manager.set_query_cache_budget(0);
+    Query query = Query::create(CollisionField::BOROUGH, QueryType::EQUALS, "BROOKLYN")
+        .add(CollisionField::NUMBER_OF_PERSONS_INJURED, QueryType::GREATER_THAN, std::uint8_t{0});
+    const std::vector<CollisionProxy*> expected = manager.search(query);
+    const std::size_t num_rows = get_snapshot(manager)->num_rows();
+
+    SearchResult complete = manager.search_async(query).get();
+    EXPECT_EQ(complete.status, SearchStatus::COMPLETE);
+    EXPECT_EQ(complete.results, expected);
+    EXPECT_EQ(complete.num_rows_searched, num_rows);
+
+    std::stop_source cancelled;
+    cancelled.request_stop();
+    SearchResult stopped = manager.search_async(query, SearchOptions{.stop_token = cancelled.get_token()}).get();
+    EXPECT_EQ(stopped.status, SearchStatus::CANCELLED);
+    EXPECT_TRUE(stopped.results.empty());
+    EXPECT_EQ(stopped.num_rows_searched, 0);
+
+    SearchResult timed_out = manager.search_async(query, SearchOptions{.deadline = std::chrono::steady_clock::now()}).get();
+    EXPECT_EQ(timed_out.status, SearchStatus::TIMED_OUT);
+    EXPECT_TRUE(timed_out.results.empty());
+
+    // Whatever morsels ran before the stop still give their matches in row order
+    std::stop_source stop_source;
+    std::future<SearchResult> future = manager.search_async(query, SearchOptions{.stop_token = stop_source.get_token()});
+    stop_source.request_stop();
+    SearchResult partial = future.get();
+    EXPECT_LE(partial.num_rows_searched, num_rows);
+    EXPECT_EQ(partial.status == SearchStatus::COMPLETE, partial.num_rows_searched == num_rows);
+    std::size_t next = 0;
+    for (CollisionProxy* collision : partial.results) {
+        while (next < expected.size() && expected[next] != collision) {
+            ++next;
+        }
+        ASSERT_LT(next, expected.size());
+    }
+
+    // The search holds on to its snapshot, so the manager can go away before it is done
+    std::future<SearchResult> orphaned;
+    {
+        CollisionManager temporary = create_collision_manager_from_csv(kSubsetDataset);
+        temporary.set_query_cache_budget(0);
+        orphaned = temporary.search_async(query);
+    }
+    SearchResult orphaned_result = orphaned.get();
+    EXPECT_EQ(orphaned_result.status, SearchStatus::COMPLETE);
+    ASSERT_EQ(orphaned_result.results.size(), expected.size());
+    for (std::size_t index = 0; index < expected.size(); ++index) {
+        EXPECT_EQ(orphaned_result.results[index]->collision_id->value(), expected[index]->collision_id->value());
+    }
+}
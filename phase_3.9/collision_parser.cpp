@@ -227,6 +227,25 @@ void parseline(const std::string& line, Collisions& collisions) {
     collisions.add(collision);
 }
 
+Collisions parse_lines(const std::vector<std::string>& lines) {
+    Collisions collisions{};
+
+    unsigned long num_threads = omp_get_max_threads();
+    std::vector<Collisions> thread_local_collisions{num_threads};
+
+    #pragma omp parallel for schedule(static)
+    for (const std::string& line : lines) {
+        int thread_id = omp_get_thread_num();
+        parseline(line, thread_local_collisions[thread_id]);
+    }
+
+    for (const auto& thread_collisions : thread_local_collisions) {
+        collisions.combine(thread_collisions);
+    }
+
+    return collisions;
+}
+
 }  // namespace
 
 CollisionParser::CollisionParser(const std::string& filename)
@@ -252,20 +271,31 @@ Collisions CollisionParser::parse() {
         lines.push_back(line);
     }
 
-    Collisions collisions{};
+    return parse_lines(lines);
+}
 
-    unsigned long num_threads = omp_get_max_threads();
-    std::vector<Collisions> thread_local_collisions{num_threads};
+void CollisionParser::parse_chunks(const std::size_t chunk_size, const std::function<void(Collisions&)>& consume) {
+    std::ifstream file{std::string(this->filename)};
 
-    #pragma omp parallel for schedule(static)
-    for (const std::string& line : lines) {
-        int thread_id = omp_get_thread_num();
-        parseline(line, thread_local_collisions[thread_id]);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open file " + this->filename);
     }
 
-    for (const auto& thread_collisions : thread_local_collisions) {
-        collisions.combine(thread_collisions);
+    std::string line;
+    std::vector<std::string> lines;
+    std::getline(file, line);
+
+    while (std::getline(file, line)) {
+        lines.push_back(line);
+        if (lines.size() == chunk_size) {
+            Collisions collisions = parse_lines(lines);
+            consume(collisions);
+            lines.clear();
+        }
     }
 
-    return collisions;
+    if (!lines.empty()) {
+        Collisions collisions = parse_lines(lines);
+        consume(collisions);
+    }
 }
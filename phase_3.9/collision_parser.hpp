@@ -2,6 +2,7 @@
 
 #include "collision.hpp"
 
+#include <functional>
 #include <string>
 
 
@@ -11,6 +12,9 @@ public:
     CollisionParser(const std::string& filename);
     Collisions parse();
 
+    // Parse the file chunk_size rows at a time and hand each chunk to consume, so only one chunk is in memory at once
+    void parse_chunks(const std::size_t chunk_size, const std::function<void(Collisions&)>& consume);
+
 private:
     std::string filename;
 };
@@ -0,0 +1,357 @@
+#include "collision_snapshot.hpp"
+
+#include "collision_index.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <functional>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+// The rows of a segment that are not erased, in their order
+Collisions live_collisions(const CollisionSegment& segment) {
+    Collisions collisions = segment.collisions->collisions_;
+    if (segment.num_erased_rows > 0) {
+        std::vector<std::uint32_t> order;
+        order.reserve(segment.num_live_rows());
+        for (std::uint32_t row = 0; row < segment.num_rows(); ++row) {
+            if (!segment.is_erased(row)) {
+                order.push_back(row);
+            }
+        }
+        collisions.permute(order);
+    }
+    return collisions;
+}
+
+// String fields that have a dictionary index in the segment
+std::vector<CollisionField> dictionary_fields(const CollisionSegment& segment) {
+    std::vector<CollisionField> fields;
+    for (std::size_t field = 0; field < static_cast<std::size_t>(CollisionField::UNDEFINED); ++field) {
+        if (segment.collisions->dictionary_index_memory(static_cast<CollisionField>(field)) > 0) {
+            fields.push_back(static_cast<CollisionField>(field));
+        }
+    }
+    return fields;
+}
+
+CollisionSegment make_segment(Collisions collisions,
+                              const LoadOptions& options,
+                              const std::vector<CollisionField>& fields) {
+    CollisionSegment segment{std::make_shared<IndexedCollisions>(std::move(collisions), options)};
+    for (const CollisionField& field : fields) {
+        segment.collisions->build_dictionary_index(field);
+    }
+    return segment;
+}
+
+// Turn positions among the collisions a segment was made from into its rows, which clustering may have reordered
+void to_segment_rows(const CollisionSegment& segment, std::vector<std::uint32_t>& positions) {
+    const std::vector<std::uint32_t>& cluster_order = segment.collisions->get_cluster_order();
+    if (positions.empty() || cluster_order.empty()) {
+        return;
+    }
+
+    std::vector<std::uint32_t> rows(cluster_order.size());
+    for (std::uint32_t row = 0; row < cluster_order.size(); ++row) {
+        rows[cluster_order[row]] = row;
+    }
+    for (std::uint32_t& position : positions) {
+        position = rows[position];
+    }
+}
+
+// compacted, made from base, with the rows that segment erased since base erased in it as well. Compacting keeps
+// the live rows of base in their order, so a live row of base is row number its rank among them in compacted.
+CollisionSegment carry_over_erased_rows(const CollisionSegment& base, const CollisionSegment& segment, CollisionSegment compacted) {
+    if (segment.erased_rows == base.erased_rows) {
+        return compacted;
+    }
+
+    const std::span<const std::uint64_t> base_erased = base.get_erased_rows();
+    const std::span<const std::uint64_t> erased = segment.get_erased_rows();
+    std::shared_ptr<std::vector<std::uint64_t>> bitmap;
+    std::size_t first_row = 0;
+    for (std::size_t word = 0; word < erased.size(); ++word) {
+        const std::uint64_t live = word < base_erased.size() ? ~base_erased[word] : ~std::uint64_t{0};
+        for (std::uint64_t newly_erased = erased[word] & live; newly_erased != 0; newly_erased &= newly_erased - 1) {
+            const std::uint64_t rows_before = (std::uint64_t{1} << std::countr_zero(newly_erased)) - 1;
+            const std::size_t row = first_row + std::popcount(live & rows_before);
+            if (bitmap == nullptr) {
+                bitmap = std::make_shared<std::vector<std::uint64_t>>((compacted.num_rows() + 63) / 64, 0);
+                compacted.erased_rows = bitmap;
+            }
+            (*bitmap)[row / 64] |= std::uint64_t{1} << (row % 64);
+            compacted.num_erased_rows++;
+        }
+        first_row += std::popcount(live);
+    }
+    return compacted;
+}
+
+}  // namespace
+
+std::size_t CollisionSegment::num_rows() const {
+    return collisions->proxies_.size();
+}
+
+std::size_t CollisionSegment::num_live_rows() const {
+    return num_rows() - num_erased_rows;
+}
+
+bool CollisionSegment::is_erased(const std::size_t row) const {
+    return erased_rows != nullptr && ((*erased_rows)[row / 64] >> (row % 64)) & 1;
+}
+
+std::span<const std::uint64_t> CollisionSegment::get_erased_rows() const {
+    return erased_rows != nullptr ? std::span<const std::uint64_t>{*erased_rows} : std::span<const std::uint64_t>{};
+}
+
+CollisionSnapshot::CollisionSnapshot()
+  : first_rows_{0}
+{
+}
+
+CollisionSnapshot::CollisionSnapshot(Collisions collisions, const LoadOptions& options)
+  : CollisionSnapshot({CollisionSegment{std::make_shared<IndexedCollisions>(std::move(collisions), options)}}, 0)
+{
+}
+
+CollisionSnapshot::CollisionSnapshot(std::vector<CollisionSegment> segments, const std::uint64_t version)
+  : segments_{std::move(segments)},
+    first_rows_{0},
+    version_{version}
+{
+    for (const CollisionSegment& segment : segments_) {
+        first_rows_.push_back(first_rows_.back() + segment.num_rows());
+    }
+}
+
+std::uint64_t CollisionSnapshot::get_version() const {
+    return version_;
+}
+
+const std::vector<CollisionSegment>& CollisionSnapshot::get_segments() const {
+    return segments_;
+}
+
+std::size_t CollisionSnapshot::get_first_row(const std::size_t segment_index) const {
+    return first_rows_[segment_index];
+}
+
+std::size_t CollisionSnapshot::num_rows() const {
+    return first_rows_.back();
+}
+
+std::size_t CollisionSnapshot::find_segment(const std::size_t row) const {
+    return std::upper_bound(first_rows_.begin(), first_rows_.end(), row) - first_rows_.begin() - 1;
+}
+
+CollisionProxy* CollisionSnapshot::get_proxy(const std::size_t row) const {
+    const std::size_t segment_index = find_segment(row);
+    return &segments_[segment_index].collisions->proxies_[row - first_rows_[segment_index]];
+}
+
+std::uint32_t CollisionSnapshot::get_row(const CollisionProxy* proxy) const {
+    // Proxies of different segments live in different arrays, std::less orders pointers across them
+    const std::less<const CollisionProxy*> less{};
+    for (std::size_t segment_index = 0; segment_index < segments_.size(); ++segment_index) {
+        const std::vector<CollisionProxy>& proxies = segments_[segment_index].collisions->proxies_;
+        if (!less(proxy, proxies.data()) && less(proxy, proxies.data() + proxies.size())) {
+            return first_rows_[segment_index] + (proxy - proxies.data());
+        }
+    }
+    throw std::runtime_error("CollisionProxy is not part of the snapshot");
+}
+
+std::pair<std::size_t, std::uint32_t> CollisionSnapshot::find_live_row(const std::size_t collision_id) const {
+    for (std::size_t segment_index = 0; segment_index < segments_.size(); ++segment_index) {
+        const CollisionSegment& segment = segments_[segment_index];
+        const std::uint32_t row = segment.collisions->find_collision_id(collision_id);
+        if (row != HashIndex::NOT_FOUND && !segment.is_erased(row)) {
+            return {segment_index, row};
+        }
+    }
+    return {segments_.size(), HashIndex::NOT_FOUND};
+}
+
+CollisionProxy* CollisionSnapshot::find(const std::size_t collision_id) const {
+    const auto [segment_index, row] = find_live_row(collision_id);
+    return segment_index == segments_.size() ? nullptr : &segments_[segment_index].collisions->proxies_[row];
+}
+
+void CollisionSnapshot::find(std::span<const std::size_t> collision_ids, std::span<CollisionProxy*> proxies) const {
+    std::fill(proxies.begin(), proxies.end(), nullptr);
+
+    std::vector<std::uint32_t> rows(collision_ids.size());
+    for (const CollisionSegment& segment : segments_) {
+        segment.collisions->find_collision_ids(collision_ids, rows);
+        for (std::size_t index = 0; index < rows.size(); ++index) {
+            if (proxies[index] == nullptr && rows[index] != HashIndex::NOT_FOUND && !segment.is_erased(rows[index])) {
+                proxies[index] = &segment.collisions->proxies_[rows[index]];
+            }
+        }
+    }
+}
+
+ReleaseDiff CollisionSnapshot::diff(const Collisions& chunk,
+                                    std::vector<std::uint8_t>& in_release,
+                                    std::unordered_set<std::size_t>& inserted_ids) const {
+    const std::vector<std::uint64_t> chunk_hashes = hash_rows(chunk);
+
+    // Every row of a release is looked up, which is worth building the missing hashes for
+    for (const CollisionSegment& segment : segments_) {
+        segment.collisions->get_collision_id_hash();
+    }
+
+    ReleaseDiff diff{};
+    for (std::uint32_t chunk_row = 0; chunk_row < chunk.collision_ids.size(); ++chunk_row) {
+        if (!chunk.collision_ids[chunk_row].has_value()) {
+            continue;
+        }
+
+        // A collision_id seen earlier in the release keeps its first row there
+        const auto [segment_index, row] = find_live_row(*chunk.collision_ids[chunk_row]);
+        if (segment_index == segments_.size()) {
+            if (inserted_ids.insert(*chunk.collision_ids[chunk_row]).second) {
+                diff.inserted.push_back(chunk_row);
+            }
+            continue;
+        }
+
+        const std::size_t snapshot_row = first_rows_[segment_index] + row;
+        if (!in_release[snapshot_row]) {
+            in_release[snapshot_row] = true;
+            if (segments_[segment_index].collisions->get_row_hashes()[row] != chunk_hashes[chunk_row]) {
+                diff.updated.push_back(chunk_row);
+                diff.replaced.push_back(snapshot_row);
+            }
+        }
+    }
+    return diff;
+}
+
+std::vector<std::uint32_t> CollisionSnapshot::missing_rows(const std::vector<std::uint8_t>& in_release) const {
+    std::vector<std::uint32_t> rows;
+    for (std::size_t segment_index = 0; segment_index < segments_.size(); ++segment_index) {
+        const CollisionSegment& segment = segments_[segment_index];
+        const std::vector<std::optional<std::size_t>>& collision_ids = segment.collisions->collisions_.collision_ids;
+        for (std::uint32_t row = 0; row < segment.num_rows(); ++row) {
+            const std::size_t snapshot_row = first_rows_[segment_index] + row;
+            if (!in_release[snapshot_row] && !segment.is_erased(row) && collision_ids[row].has_value() &&
+                find_live_row(*collision_ids[row]) == std::pair<std::size_t, std::uint32_t>{segment_index, row}) {
+                rows.push_back(snapshot_row);
+            }
+        }
+    }
+    return rows;
+}
+
+std::shared_ptr<const CollisionSnapshot> CollisionSnapshot::apply(Collisions collisions,
+                                                                  std::span<const std::uint32_t> erased_rows,
+                                                                  const LoadOptions& options,
+                                                                  std::vector<std::uint32_t>* added_rows) const {
+    std::vector<CollisionSegment> segments = segments_;
+
+    // A segment gets a copy of its bitmap on the first row erased in it
+    std::vector<std::shared_ptr<std::vector<std::uint64_t>>> bitmaps(segments.size());
+    for (const std::uint32_t row : erased_rows) {
+        const std::size_t segment_index = find_segment(row);
+        CollisionSegment& segment = segments[segment_index];
+        std::shared_ptr<std::vector<std::uint64_t>>& bitmap = bitmaps[segment_index];
+        if (bitmap == nullptr) {
+            bitmap = segment.erased_rows != nullptr ? std::make_shared<std::vector<std::uint64_t>>(*segment.erased_rows)
+                                                    : std::make_shared<std::vector<std::uint64_t>>((segment.num_rows() + 63) / 64, 0);
+            segment.erased_rows = bitmap;
+        }
+
+        const std::size_t segment_row = row - first_rows_[segment_index];
+        if (!segment.is_erased(segment_row)) {
+            (*bitmap)[segment_row / 64] |= std::uint64_t{1} << (segment_row % 64);
+            segment.num_erased_rows++;
+        }
+    }
+
+    const std::vector<CollisionField> fields = segments_.empty() ? std::vector<CollisionField>{} : dictionary_fields(segments_.front());
+
+    // Rows of the last segment that hold the added rows. Segments made here have nothing erased yet, so merging puts
+    // the added rows right after the live rows of the segment before.
+    std::vector<std::uint32_t> added_positions;
+    std::erase_if(segments, [](const CollisionSegment& segment) { return segment.num_live_rows() == 0; });
+    if (!collisions.crash_dates.empty()) {
+        if (added_rows != nullptr) {
+            added_positions.resize(collisions.crash_dates.size());
+            std::iota(added_positions.begin(), added_positions.end(), 0);
+        }
+        segments.push_back(make_segment(std::move(collisions), options, fields));
+        to_segment_rows(segments.back(), added_positions);
+    }
+
+    while (segments.size() >= 2 &&
+           segments[segments.size() - 2].num_live_rows() <= SEGMENT_MERGE_RATIO * segments.back().num_live_rows()) {
+        const std::uint32_t num_leading_rows = segments[segments.size() - 2].num_live_rows();
+        Collisions merged = live_collisions(segments[segments.size() - 2]);
+        merged.combine(live_collisions(segments.back()));
+        segments.pop_back();
+        segments.back() = make_segment(std::move(merged), options, fields);
+
+        for (std::uint32_t& position : added_positions) {
+            position += num_leading_rows;
+        }
+        to_segment_rows(segments.back(), added_positions);
+    }
+
+    std::shared_ptr<const CollisionSnapshot> snapshot(new CollisionSnapshot(std::move(segments), version_ + 1));
+    if (added_rows != nullptr) {
+        const std::size_t first_row = added_positions.empty() ? 0 : snapshot->get_first_row(snapshot->segments_.size() - 1);
+        added_rows->clear();
+        for (const std::uint32_t position : added_positions) {
+            added_rows->push_back(first_row + position);
+        }
+    }
+    return snapshot;
+}
+
+bool CollisionSnapshot::needs_compaction() const {
+    return std::any_of(segments_.begin(), segments_.end(), [](const CollisionSegment& segment) {
+        return segment.num_erased_rows > COMPACTION_THRESHOLD * segment.num_rows();
+    });
+}
+
+std::vector<CompactedSegment> CollisionSnapshot::compact(const LoadOptions& options, std::stop_token stop_token) const {
+    std::vector<CompactedSegment> compacted;
+    for (const CollisionSegment& segment : segments_) {
+        if (stop_token.stop_requested()) {
+            break;
+        }
+        if (segment.num_erased_rows > COMPACTION_THRESHOLD * segment.num_rows()) {
+            compacted.push_back({segment, make_segment(live_collisions(segment), options, dictionary_fields(segment))});
+        }
+    }
+    return compacted;
+}
+
+std::shared_ptr<const CollisionSnapshot> CollisionSnapshot::replace(std::span<const CompactedSegment> compacted) const {
+    std::vector<CollisionSegment> segments = segments_;
+
+    // Changes only add erased rows to a segment, merging makes a new one, so rows a compaction dropped never come back
+    bool replaced = false;
+    for (const CompactedSegment& compacted_segment : compacted) {
+        auto segment = std::find_if(segments.begin(), segments.end(), [&](const CollisionSegment& segment) {
+            return segment.collisions == compacted_segment.segment.collisions;
+        });
+        if (segment != segments.end()) {
+            *segment = carry_over_erased_rows(compacted_segment.segment, *segment, compacted_segment.compacted);
+            replaced = true;
+        }
+    }
+    if (!replaced) {
+        return nullptr;
+    }
+
+    std::erase_if(segments, [](const CollisionSegment& segment) { return segment.num_live_rows() == 0; });
+    return std::shared_ptr<const CollisionSnapshot>(new CollisionSnapshot(std::move(segments), version_ + 1));
+}
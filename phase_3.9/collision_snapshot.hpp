@@ -0,0 +1,132 @@
+#pragma once
+
+#include "collision.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stop_token>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+
+// Rows that never change once they are published, so any number of snapshots and queries can share them. Only
+// their indexes are still built, lazily. Erasing rows gives the segment a new tombstone bitmap instead of changing
+// the one older snapshots see.
+struct CollisionSegment {
+    std::shared_ptr<IndexedCollisions> collisions;
+
+    // One bit per row, set for erased rows. nullptr if no row of the segment is erased.
+    std::shared_ptr<const std::vector<std::uint64_t>> erased_rows;
+    std::size_t num_erased_rows = 0;
+
+    std::size_t num_rows() const;
+    std::size_t num_live_rows() const;
+    bool is_erased(const std::size_t row) const;
+    std::span<const std::uint64_t> get_erased_rows() const;
+};
+
+// How one chunk of rows of a new full release of the data differs from the live rows of a snapshot, matching rows
+// by collision_id and comparing the hashes of their contents. Rows without a collision_id cannot be matched and are left out.
+struct ReleaseDiff {
+    // Rows of the chunk with a collision_id that has no live row
+    std::vector<std::uint32_t> inserted;
+
+    // Rows of the chunk whose live row has different contents, and those live rows in the same order
+    std::vector<std::uint32_t> updated;
+    std::vector<std::uint32_t> replaced;
+};
+
+// A segment rewritten with only its live rows, together with the segment it was made from
+struct CompactedSegment {
+    CollisionSegment segment;
+    CollisionSegment compacted;
+};
+
+// One consistent version of the data, made of segments in row order. Row ids count through the segments in order.
+// A snapshot never changes: ingestion builds the next snapshot from it, sharing every segment it leaves alone,
+// while queries keep running on the snapshot they started on.
+class CollisionSnapshot {
+public:
+    // After a change the newest segment is merged into the one before it for as long as that one has at most
+    // SEGMENT_MERGE_RATIO times as many live rows. A run of appends then keeps a logarithmic number of segments
+    // and rewrites every row a logarithmic number of times. Merging drops the erased rows.
+    static constexpr std::size_t SEGMENT_MERGE_RATIO = 2;
+
+    // Older segments are only rewritten without their erased rows by compact, once more than this fraction
+    // of their rows is erased
+    static constexpr double COMPACTION_THRESHOLD = 0.25;
+
+    CollisionSnapshot();
+
+    // Version 0, with all of collisions in one segment
+    CollisionSnapshot(Collisions collisions, const LoadOptions& options = LoadOptions{});
+
+    std::uint64_t get_version() const;
+    const std::vector<CollisionSegment>& get_segments() const;
+
+    // Row id of the first row of a segment
+    std::size_t get_first_row(const std::size_t segment_index) const;
+
+    // Rows of every segment, erased ones included
+    std::size_t num_rows() const;
+
+    CollisionProxy* get_proxy(const std::size_t row) const;
+
+    // Row id of a proxy of one of the segments
+    std::uint32_t get_row(const CollisionProxy* proxy) const;
+
+    // The live row of a collision_id, nullptr if there is none. A collision_id with several live rows leads to the
+    // first of them. Segments are probed in row order through IndexedCollisions::find_collision_ids, so a
+    // collision_id without a live row costs a probe of every segment, a scan of those whose hash index is not built.
+    CollisionProxy* find(const std::size_t collision_id) const;
+    void find(std::span<const std::size_t> collision_ids, std::span<CollisionProxy*> proxies) const;
+
+    // Compare the next chunk of rows of a release against the live rows. in_release holds one entry per row and
+    // marks the live rows found in the release so far, inserted_ids holds the collision_ids without a live row
+    // inserted so far. Content hashes of the rows of a segment are computed on the first diff and kept with it,
+    // so later diffs only hash segments added in between. The collision_id hash indexes that are not built yet are
+    // built by the first diff.
+    ReleaseDiff diff(const Collisions& chunk,
+                     std::vector<std::uint8_t>& in_release,
+                     std::unordered_set<std::size_t>& inserted_ids) const;
+
+    // Live rows with a collision_id that the whole release did not contain
+    std::vector<std::uint32_t> missing_rows(const std::vector<std::uint8_t>& in_release) const;
+
+    // The next version: erased_rows erased, and collisions added after all other rows as a new segment loaded with
+    // options, which also gets the dictionary indexes of the first segment. Takes time in proportion to the changed
+    // and merged rows. If given, added_rows is set to the row id in the next version of every row of collisions, in
+    // their order. Clustering may reorder them, both in the new segment and in a segment it is merged into.
+    std::shared_ptr<const CollisionSnapshot> apply(Collisions collisions,
+                                                   std::span<const std::uint32_t> erased_rows,
+                                                   const LoadOptions& options,
+                                                   std::vector<std::uint32_t>* added_rows = nullptr) const;
+
+    // Whether any segment has more than COMPACTION_THRESHOLD of its rows erased
+    bool needs_compaction() const;
+
+    // Every segment over COMPACTION_THRESHOLD rewritten with only its live rows and loaded with options, keeping its
+    // dictionary indexes. Returns the segments rewritten so far once stop_token is requested.
+    std::vector<CompactedSegment> compact(const LoadOptions& options, std::stop_token stop_token) const;
+
+    // The next version with compacted segments in place of the ones they were made from. Rows erased since compact
+    // read a segment are erased in its compacted segment too, a segment that was merged since is left out.
+    // nullptr if no segment was replaced.
+    std::shared_ptr<const CollisionSnapshot> replace(std::span<const CompactedSegment> compacted) const;
+
+private:
+    CollisionSnapshot(std::vector<CollisionSegment> segments, const std::uint64_t version);
+
+    std::size_t find_segment(const std::size_t row) const;
+
+    // Segment and row within it of the live row of collision_id, segment is segments_.size() if there is none
+    std::pair<std::size_t, std::uint32_t> find_live_row(const std::size_t collision_id) const;
+
+    std::vector<CollisionSegment> segments_;
+
+    // Row id of the first row of every segment, followed by the number of rows
+    std::vector<std::size_t> first_rows_;
+    std::uint64_t version_ = 0;
+};
@@ -0,0 +1,88 @@
+#include "index_advisor.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <span>
+#include <vector>
+
+
+std::size_t IndexAdvisor::record_query(const Query& query) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const FieldQuery& field_query : query.get()) {
+        workloads_[static_cast<std::size_t>(field_query.get_name())].num_predicates += 1;
+    }
+    return ++num_queries_;
+}
+
+void IndexAdvisor::record_scan(const CollisionField& field,
+                               const std::size_t rows_scanned,
+                               const std::size_t rows_matched,
+                               const double seconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    FieldWorkload& workload = workloads_[static_cast<std::size_t>(field)];
+    workload.rows_scanned += rows_scanned;
+    workload.rows_matched += rows_matched;
+    workload.scan_seconds += seconds;
+}
+
+FieldWorkload IndexAdvisor::get_workload(const CollisionField& field) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return workloads_[static_cast<std::size_t>(field)];
+}
+
+std::vector<IndexRecommendation> IndexAdvisor::recommend(std::span<const IndexCandidate> candidates,
+                                                         const std::size_t num_rows,
+                                                         const double max_selectivity,
+                                                         const std::size_t memory_budget) const {
+    std::vector<IndexRecommendation> recommendations;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const IndexCandidate& candidate : candidates) {
+            const FieldWorkload& workload = workloads_[static_cast<std::size_t>(candidate.field)];
+
+            // Selectivity and cost per row are only known once the field has been scanned. They are kept
+            // after an index is built, so an index that stays in use keeps its benefit.
+            double benefit_seconds = 0;
+            if (workload.rows_scanned > 0 && workload.num_predicates >= MIN_PREDICATES) {
+                const double selectivity = static_cast<double>(workload.rows_matched) / workload.rows_scanned;
+                const double seconds_per_row = workload.scan_seconds / workload.rows_scanned;
+                if (selectivity <= max_selectivity) {
+                    benefit_seconds = workload.num_predicates * num_rows * seconds_per_row * (1 - selectivity);
+                }
+            }
+            recommendations.push_back({candidate.field, IndexAction::NONE, benefit_seconds, candidate.memory_bytes});
+        }
+    }
+
+    // Greedy by benefit per byte, which is close to the best choice as long as every index is small next to the budget
+    std::vector<IndexRecommendation*> by_benefit;
+    for (IndexRecommendation& recommendation : recommendations) {
+        by_benefit.push_back(&recommendation);
+    }
+    std::sort(by_benefit.begin(), by_benefit.end(), [](const IndexRecommendation* first, const IndexRecommendation* second) {
+        return first->benefit_seconds / std::max<std::size_t>(first->memory_bytes, 1) >
+               second->benefit_seconds / std::max<std::size_t>(second->memory_bytes, 1);
+    });
+
+    std::size_t memory_usage = 0;
+    for (IndexRecommendation* recommendation : by_benefit) {
+        const bool built = std::find_if(candidates.begin(), candidates.end(), [&](const IndexCandidate& candidate) {
+            return candidate.field == recommendation->field;
+        })->built;
+
+        if (recommendation->benefit_seconds > 0 && memory_usage + recommendation->memory_bytes <= memory_budget) {
+            memory_usage += recommendation->memory_bytes;
+            recommendation->action = built ? IndexAction::KEEP : IndexAction::BUILD;
+        } else if (built) {
+            recommendation->action = IndexAction::DROP;
+        }
+    }
+    return recommendations;
+}
+
+void IndexAdvisor::decay() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (FieldWorkload& workload : workloads_) {
+        workload.num_predicates /= 2;
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "collision_field_enum.hpp"
+#include "query.hpp"
+
+#include <array>
+#include <cstddef>
+#include <mutex>
+#include <span>
+#include <vector>
+
+
+// What the advisor recorded about the predicates on one field
+struct FieldWorkload {
+    // Predicates on the field, whether they were answered by an index or by scanning.
+    // Halved every time the advisor applies its recommendations, so recent queries weigh more.
+    double num_predicates = 0;
+
+    // Rows that scanned predicates on the field were evaluated on, how many of them matched and how long it took
+    std::size_t rows_scanned = 0;
+    std::size_t rows_matched = 0;
+    double scan_seconds = 0;
+};
+
+enum class IndexAction { NONE, BUILD, KEEP, DROP };
+
+struct IndexRecommendation {
+    CollisionField field;
+    IndexAction action;
+
+    // Scan time an index would save on the recorded workload, 0 if it would not be used
+    double benefit_seconds;
+
+    // Memory of the index if it is built, an estimate otherwise
+    std::size_t memory_bytes;
+};
+
+// A field the advisor may build or drop an index for
+struct IndexCandidate {
+    CollisionField field;
+    bool built;
+    std::size_t memory_bytes;
+};
+
+// OFF records nothing, RECOMMEND only records the workload, AUTOMATIC also builds and drops indexes
+enum class IndexAdvisorMode { OFF, RECOMMEND, AUTOMATIC };
+
+// Tracks how often each field is filtered on, how selective those filters are and what scanning them costs,
+// and from that picks the indexes that save the most scan time per byte within a memory budget.
+// Safe to use from many threads at once.
+class IndexAdvisor {
+public:
+    // Fewer predicates than this on a field are not enough to justify an index
+    static constexpr double MIN_PREDICATES = 8;
+
+    // Returns the number of queries recorded so far, including this one
+    std::size_t record_query(const Query& query);
+    void record_scan(const CollisionField& field, const std::size_t rows_scanned, const std::size_t rows_matched, const double seconds);
+
+    FieldWorkload get_workload(const CollisionField& field) const;
+
+    // An index is only worth building if the planner would use it, which it does for predicates matching at most
+    // max_selectivity of all rows. num_rows is the number of rows a predicate on an unindexed field is scanned on.
+    std::vector<IndexRecommendation> recommend(std::span<const IndexCandidate> candidates,
+                                               const std::size_t num_rows,
+                                               const double max_selectivity,
+                                               const std::size_t memory_budget) const;
+
+    // Halve the predicate counts so the workload from now on outweighs older queries
+    void decay();
+
+private:
+    mutable std::mutex mutex_;
+    std::size_t num_queries_ = 0;
+    std::array<FieldWorkload, static_cast<std::size_t>(CollisionField::UNDEFINED)> workloads_{};
+};
@@ -2,6 +2,8 @@
 
 #include "collision_field_enum.hpp"
 
+#include <algorithm>
+#include <bit>
 #include <chrono>
 #include <stdexcept>
 #include <string>
@@ -85,6 +87,65 @@ const std::vector<FieldQuery>& Query::get() const {
     return queries;
 }
 
+namespace {
+
+std::string canonical_value(const FieldQuery& query) {
+    return std::visit([&query](auto&& val) -> std::string {
+        using T = std::decay_t<decltype(val)>;
+
+        if constexpr (std::is_same_v<T, float>) {
+            // Bit pattern keeps the key exact, -0.0f is normalized since it compares equal to 0.0f
+            return std::to_string(std::bit_cast<std::uint32_t>(val == 0.0f ? 0.0f : val));
+        } else if constexpr (std::is_same_v<T, std::string>) {
+            std::string value = val;
+            if (query.case_insensitive()) {
+                std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+            }
+            // Length prefix so that no string value can be confused with the key separators
+            return std::to_string(value.size()) + ":" + value;
+        } else if constexpr (std::is_same_v<T, std::chrono::year_month_day>) {
+            return std::to_string(std::chrono::sys_days{val}.time_since_epoch().count());
+        } else if constexpr (std::is_same_v<T, std::chrono::hh_mm_ss<std::chrono::minutes>>) {
+            return std::to_string(val.to_duration().count());
+        } else {
+            return std::to_string(val);
+        }
+    }, query.get_value());
+}
+
+std::string canonical_field_query(const FieldQuery& query) {
+    std::string key = std::to_string(static_cast<int>(query.get_name())) + "," +
+                      std::to_string(static_cast<int>(query.get_type())) + "," +
+                      (query.invert_match() ? "!" : "");
+
+    // The value of a HAS_VALUE query is never looked at. Values of different types can print the same, so the
+    // type is part of the key too.
+    if (query.get_type() != QueryType::HAS_VALUE) {
+        key += (query.case_insensitive() && std::holds_alternative<std::string>(query.get_value()) ? "i" : "") +
+               std::string(",") + std::to_string(query.get_value().index()) + ":" + canonical_value(query);
+    }
+    return key;
+}
+
+}  // namespace
+
+std::string Query::canonical() const {
+    std::vector<std::string> keys;
+    for (const FieldQuery& query : queries) {
+        keys.push_back(canonical_field_query(query));
+    }
+
+    // Predicates are ANDed together so their order and duplicates do not matter
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    std::string key;
+    for (const std::string& field_key : keys) {
+        key += field_key + ";";
+    }
+    return key;
+}
+
 Query& Query::add(const CollisionField& name, const QueryType& type, const Value value) {
     return add(name, Qualifier::NONE, type, value, Qualifier::NONE);
 }
@@ -54,6 +54,9 @@ private:
 public:
     const std::vector<FieldQuery>& get() const;
 
+    // Order and case independent representation, equal for queries that always match the same rows
+    std::string canonical() const;
+
     Query& add(const CollisionField& name, const QueryType& type, const Value value);
     Query& add(const CollisionField& name, const Qualifier& not_qualifier, const QueryType& type, const Value value);
     Query& add(const CollisionField& name, const QueryType& type, const Value value, const Qualifier& case_insensitive_qualifier);
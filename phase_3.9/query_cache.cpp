@@ -0,0 +1,118 @@
+#include "query_cache.hpp"
+
+#include <bit>
+#include <memory>
+#include <mutex>
+#include <string>
+
+
+RowIdSet::RowIdSet(const std::vector<std::uint32_t>& row_ids, const std::size_t num_rows)
+  : size_{row_ids.size()}
+{
+    const std::size_t bitmap_words = (num_rows + 63) / 64;
+
+    if (bitmap_words * sizeof(std::uint64_t) < row_ids.size() * sizeof(std::uint32_t)) {
+        bitmap_ = std::vector<std::uint64_t>(bitmap_words, 0);
+        for (const std::uint32_t row_id : row_ids) {
+            bitmap_[row_id / 64] |= std::uint64_t{1} << (row_id % 64);
+        }
+    } else {
+        row_ids_ = row_ids;
+    }
+}
+
+std::vector<std::uint32_t> RowIdSet::to_row_ids() const {
+    if (bitmap_.empty()) {
+        return row_ids_;
+    }
+
+    std::vector<std::uint32_t> row_ids;
+    row_ids.reserve(size_);
+    for (std::size_t word_index = 0; word_index < bitmap_.size(); ++word_index) {
+        std::uint64_t word = bitmap_[word_index];
+        while (word != 0) {
+            row_ids.push_back(word_index * 64 + std::countr_zero(word));
+            word &= word - 1;
+        }
+    }
+    return row_ids;
+}
+
+std::size_t RowIdSet::memory_usage() const {
+    return sizeof(RowIdSet) + row_ids_.size() * sizeof(std::uint32_t) + bitmap_.size() * sizeof(std::uint64_t);
+}
+
+QueryCache::QueryCache(const std::size_t memory_budget)
+  : memory_budget_{memory_budget},
+    memory_usage_{0} {}
+
+std::shared_ptr<const RowIdSet> QueryCache::get(const std::string& key) {
+    std::lock_guard<std::mutex> lock{mutex_};
+
+    auto entry = entries_.find(key);
+    if (entry == entries_.end()) {
+        return nullptr;
+    }
+
+    lru_.splice(lru_.begin(), lru_, entry->second);
+    return entry->second->rows;
+}
+
+void QueryCache::put(const std::string& key, const std::vector<std::uint32_t>& row_ids, const std::size_t num_rows) {
+    // Build the compact representation outside of the lock
+    std::shared_ptr<const RowIdSet> rows = std::make_shared<const RowIdSet>(row_ids, num_rows);
+    const std::size_t entry_memory_usage = rows->memory_usage() + 2 * key.size() + sizeof(Entry);
+
+    std::lock_guard<std::mutex> lock{mutex_};
+
+    if (entry_memory_usage > memory_budget_) {
+        return;
+    }
+
+    auto entry = entries_.find(key);
+    if (entry != entries_.end()) {
+        memory_usage_ -= entry->second->memory_usage;
+        lru_.erase(entry->second);
+        entries_.erase(entry);
+    }
+
+    lru_.push_front(Entry{key, rows, entry_memory_usage});
+    entries_[key] = lru_.begin();
+    memory_usage_ += entry_memory_usage;
+
+    evict();
+}
+
+void QueryCache::clear() {
+    std::lock_guard<std::mutex> lock{mutex_};
+
+    lru_.clear();
+    entries_.clear();
+    memory_usage_ = 0;
+}
+
+void QueryCache::set_memory_budget(const std::size_t memory_budget) {
+    std::lock_guard<std::mutex> lock{mutex_};
+
+    memory_budget_ = memory_budget;
+    evict();
+}
+
+std::size_t QueryCache::memory_usage() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    return memory_usage_;
+}
+
+std::size_t QueryCache::size() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    return entries_.size();
+}
+
+void QueryCache::evict() {
+    while (memory_usage_ > memory_budget_ && !lru_.empty()) {
+        const Entry& least_recently_used = lru_.back();
+        memory_usage_ -= least_recently_used.memory_usage;
+        entries_.erase(least_recently_used.key);
+        lru_.pop_back();
+    }
+}
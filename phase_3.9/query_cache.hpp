@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Matching row ids of a query, stored as either a sorted id list or a bitmap over
+// all rows depending on which of the two is smaller for the number of matches
+class RowIdSet {
+public:
+    RowIdSet(const std::vector<std::uint32_t>& row_ids, const std::size_t num_rows);
+
+    std::vector<std::uint32_t> to_row_ids() const;
+    std::size_t memory_usage() const;
+
+private:
+    std::vector<std::uint32_t> row_ids_;
+    std::vector<std::uint64_t> bitmap_;
+    std::size_t size_;
+};
+
+// LRU cache of query results keyed on Query::canonical(), bounded by a memory budget in bytes
+class QueryCache {
+public:
+    QueryCache(const std::size_t memory_budget);
+
+    std::shared_ptr<const RowIdSet> get(const std::string& key);
+    void put(const std::string& key, const std::vector<std::uint32_t>& row_ids, const std::size_t num_rows);
+
+    // Must be called whenever the underlying collisions change
+    void clear();
+
+    void set_memory_budget(const std::size_t memory_budget);
+    std::size_t memory_usage() const;
+    std::size_t size() const;
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const RowIdSet> rows;
+        std::size_t memory_usage;
+    };
+
+    void evict();
+
+    mutable std::mutex mutex_;
+    std::size_t memory_budget_;
+    std::size_t memory_usage_;
+
+    // Most recently used entries at the front
+    std::list<Entry> lru_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+};
@@ -0,0 +1,127 @@
+#include "spatial_index.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr unsigned GRID_BITS = 16;
+constexpr std::uint32_t GRID_MAX = (std::uint32_t{1} << GRID_BITS) - 1;
+
+// Spread the 16 bits of value out to the even bits of the result
+std::uint32_t spread_bits(std::uint32_t value) {
+    value = (value | (value << 8)) & 0x00FF00FF;
+    value = (value | (value << 4)) & 0x0F0F0F0F;
+    value = (value | (value << 2)) & 0x33333333;
+    value = (value | (value << 1)) & 0x55555555;
+    return value;
+}
+
+// A square of the grid at some level of the quadtree, level 0 is the whole grid
+struct Cell {
+    std::uint32_t x;
+    std::uint32_t y;
+    unsigned level;
+
+    std::uint32_t first_x() const { return x << (GRID_BITS - level); }
+    std::uint32_t last_x() const { return ((x + 1) << (GRID_BITS - level)) - 1; }
+    std::uint32_t first_y() const { return y << (GRID_BITS - level); }
+    std::uint32_t last_y() const { return ((y + 1) << (GRID_BITS - level)) - 1; }
+
+    // All keys of a cell are contiguous on the Z-order curve
+    std::pair<std::uint32_t, std::uint32_t> key_range() const {
+        const std::uint32_t first_key = spread_bits(first_x()) | (spread_bits(first_y()) << 1);
+        const std::uint64_t num_keys = std::uint64_t{1} << (2 * (GRID_BITS - level));
+        return {first_key, static_cast<std::uint32_t>(first_key + num_keys - 1)};
+    }
+};
+
+}  // namespace
+
+SpatialGrid::SpatialGrid()
+  : SpatialGrid(0.0f, 0.0f, 0.0f, 0.0f) {}
+
+SpatialGrid::SpatialGrid(const float min_latitude, const float max_latitude, const float min_longitude, const float max_longitude)
+  : min_latitude_{min_latitude},
+    max_latitude_{max_latitude},
+    min_longitude_{min_longitude},
+    max_longitude_{max_longitude} {}
+
+std::uint32_t SpatialGrid::quantize(const float value, const float min, const float max) const {
+    if (!(value > min) || max <= min) {
+        return 0;
+    }
+    if (value >= max) {
+        return GRID_MAX;
+    }
+    return static_cast<std::uint32_t>((static_cast<double>(value) - min) / (static_cast<double>(max) - min) * GRID_MAX);
+}
+
+std::uint32_t SpatialGrid::key(const float latitude, const float longitude) const {
+    const std::uint32_t x = quantize(longitude, min_longitude_, max_longitude_);
+    const std::uint32_t y = quantize(latitude, min_latitude_, max_latitude_);
+    return spread_bits(x) | (spread_bits(y) << 1);
+}
+
+std::vector<std::pair<std::uint32_t, std::uint32_t>> SpatialGrid::cover(const float min_latitude,
+                                                                        const float max_latitude,
+                                                                        const float min_longitude,
+                                                                        const float max_longitude,
+                                                                        const std::size_t max_ranges) const {
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> ranges;
+    if (min_latitude > max_latitude || min_longitude > max_longitude) {
+        return ranges;
+    }
+
+    // Quantizing is monotonic, so every point of the box falls into these cells
+    const std::uint32_t first_x = quantize(min_longitude, min_longitude_, max_longitude_);
+    const std::uint32_t last_x = quantize(max_longitude, min_longitude_, max_longitude_);
+    const std::uint32_t first_y = quantize(min_latitude, min_latitude_, max_latitude_);
+    const std::uint32_t last_y = quantize(max_latitude, min_latitude_, max_latitude_);
+
+    std::vector<Cell> cells{{0, 0, 0}};
+    while (!cells.empty()) {
+        std::vector<Cell> partial_cells;
+        for (const Cell& cell : cells) {
+            if (cell.last_x() < first_x || cell.first_x() > last_x || cell.last_y() < first_y || cell.first_y() > last_y) {
+                continue;
+            }
+
+            if (cell.first_x() >= first_x && cell.last_x() <= last_x && cell.first_y() >= first_y && cell.last_y() <= last_y) {
+                ranges.push_back(cell.key_range());
+            } else {
+                partial_cells.push_back(cell);
+            }
+        }
+
+        // Splitting a cell makes four, stop once that would produce too many ranges and take partial cells whole
+        if (partial_cells.empty() || ranges.size() + 4 * partial_cells.size() > max_ranges) {
+            for (const Cell& cell : partial_cells) {
+                ranges.push_back(cell.key_range());
+            }
+            break;
+        }
+
+        cells.clear();
+        for (const Cell& cell : partial_cells) {
+            for (std::uint32_t child = 0; child < 4; ++child) {
+                cells.push_back({2 * cell.x + (child & 1), 2 * cell.y + (child >> 1), cell.level + 1});
+            }
+        }
+    }
+
+    // Merge ranges that touch on the curve
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> merged_ranges;
+    for (const auto& range : ranges) {
+        if (!merged_ranges.empty() && static_cast<std::uint64_t>(merged_ranges.back().second) + 1 >= range.first) {
+            merged_ranges.back().second = std::max(merged_ranges.back().second, range.second);
+        } else {
+            merged_ranges.push_back(range);
+        }
+    }
+    return merged_ranges;
+}
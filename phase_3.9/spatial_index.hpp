@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+
+// Quantizes coordinates onto a 2^16 x 2^16 grid over a bounding box and numbers the
+// cells along a Z-order (Morton) curve. Points that are close on the map mostly get
+// close keys, so sorting rows by key keeps the rows of a small map area together.
+class SpatialGrid {
+public:
+    SpatialGrid();
+    SpatialGrid(const float min_latitude, const float max_latitude, const float min_longitude, const float max_longitude);
+
+    std::uint32_t key(const float latitude, const float longitude) const;
+
+    // Sorted, disjoint key ranges [first, last] that together contain the key of every point in the box.
+    // Cells partially inside the box are only split while there are fewer than max_ranges of them,
+    // so the ranges may also contain some points outside of the box.
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> cover(const float min_latitude,
+                                                                const float max_latitude,
+                                                                const float min_longitude,
+                                                                const float max_longitude,
+                                                                const std::size_t max_ranges) const;
+
+private:
+    std::uint32_t quantize(const float value, const float min, const float max) const;
+
+    float min_latitude_;
+    float max_latitude_;
+    float min_longitude_;
+    float max_longitude_;
+};
@@ -0,0 +1,400 @@
+#include "subscription_index.hpp"
+
+#include "collision_index.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+
+std::string to_lower(std::string value) {
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+    return value;
+}
+
+std::uint64_t value_key(const FieldQuery& query) {
+    return std::visit([](auto&& value) -> std::uint64_t {
+        using T = std::decay_t<decltype(value)>;
+
+        if constexpr (std::is_same_v<T, std::string>) {
+            throw std::runtime_error("Strings have no index_key");
+        } else {
+            return index_key(value);
+        }
+    }, query.get_value());
+}
+
+// The value of a string predicate as it is compared
+std::string string_value(const FieldQuery& query) {
+    const std::string& value = std::get<std::string>(query.get_value());
+    return query.case_insensitive() ? to_lower(value) : value;
+}
+
+// Same result as the query engine for one predicate and one value, before the NOT of the predicate is applied
+template<class T>
+bool satisfies(const FieldQuery& query, const std::optional<T>& value) {
+    if (query.get_type() == QueryType::HAS_VALUE) {
+        return value.has_value();
+    }
+    if (!value.has_value()) {
+        return false;
+    }
+
+    if constexpr (std::is_same_v<T, std::string>) {
+        const std::string& query_value = std::get<std::string>(query.get_value());
+        if (query.case_insensitive()) {
+            const std::string lower_value = to_lower(*value);
+            const std::string lower_query_value = to_lower(query_value);
+            return query.get_type() == QueryType::EQUALS ? lower_value == lower_query_value
+                                                         : lower_value.find(lower_query_value) != std::string::npos;
+        }
+        return query.get_type() == QueryType::EQUALS ? *value == query_value : value->find(query_value) != std::string::npos;
+    } else {
+        const std::uint64_t key = index_key(*value);
+        const std::uint64_t query_key = index_key(std::get<T>(query.get_value()));
+        switch (query.get_type()) {
+        case QueryType::EQUALS:
+            return key == query_key;
+        case QueryType::LESS_THAN:
+            return key < query_key;
+        case QueryType::GREATER_THAN:
+            return key > query_key;
+        default:
+            return false;
+        }
+    }
+}
+
+// Access predicates in the order they are preferred. Among equalities and intervals the one fewer other
+// subscriptions are filed next to is picked, the rest only come into question without either.
+enum class AccessKind { EQUALS, INTERVAL, CONTAINS, BOUND, HAS_VALUE, NONE };
+
+struct Access {
+    AccessKind kind = AccessKind::NONE;
+    const FieldQuery* query = nullptr;
+
+    // LESS_THAN bound of an interval, query is its GREATER_THAN bound
+    const FieldQuery* upper_query = nullptr;
+    std::size_t cost = std::numeric_limits<std::size_t>::max();
+};
+
+std::string equals_bucket(const FieldQuery& query) {
+    const std::string value = std::holds_alternative<std::string>(query.get_value())
+                            ? (query.case_insensitive() ? "i" : "s") + string_value(query)
+                            : std::to_string(value_key(query));
+    return std::to_string(static_cast<int>(query.get_name())) + ":" + value;
+}
+
+// The first GREATER_THAN and LESS_THAN bound on each field, for the fields that have both
+std::vector<std::pair<const FieldQuery*, const FieldQuery*>> find_intervals(const Query& query) {
+    std::vector<std::pair<const FieldQuery*, const FieldQuery*>> intervals;
+    for (const FieldQuery& lower : query.get()) {
+        if (lower.get_type() != QueryType::GREATER_THAN || lower.invert_match()) {
+            continue;
+        }
+        auto upper = std::find_if(query.get().begin(), query.get().end(), [&](const FieldQuery& upper) {
+            return upper.get_name() == lower.get_name() && upper.get_type() == QueryType::LESS_THAN && !upper.invert_match();
+        });
+        auto is_first = [&](const auto& interval) { return interval.first->get_name() == lower.get_name(); };
+        if (upper != query.get().end() && std::none_of(intervals.begin(), intervals.end(), is_first)) {
+            intervals.push_back({&lower, &*upper});
+        }
+    }
+    return intervals;
+}
+
+}  // namespace
+
+std::size_t SubscriptionIndex::subscribe(const Query& query) {
+    for (const FieldQuery& field_query : query.get()) {
+        const bool is_string = std::holds_alternative<std::string>(field_query.get_value());
+        if (field_query.get_type() == QueryType::CONTAINS && !is_string) {
+            throw std::runtime_error("CONTAINS is only supported for string fields");
+        }
+        if ((field_query.get_type() == QueryType::LESS_THAN || field_query.get_type() == QueryType::GREATER_THAN) && is_string) {
+            throw std::runtime_error("LESS_THAN and GREATER_THAN are not supported for string fields");
+        }
+    }
+
+    subscriptions_.push_back({next_id_, query});
+    is_built_ = false;
+    return next_id_++;
+}
+
+bool SubscriptionIndex::unsubscribe(const std::size_t subscription_id) {
+    const std::size_t num_subscriptions = subscriptions_.size();
+    std::erase_if(subscriptions_, [subscription_id](const Subscription& subscription) {
+        return subscription.id == subscription_id;
+    });
+    is_built_ = is_built_ && subscriptions_.size() == num_subscriptions;
+    return subscriptions_.size() != num_subscriptions;
+}
+
+std::size_t SubscriptionIndex::size() const {
+    return subscriptions_.size();
+}
+
+SubscriptionIndex::FieldTables& SubscriptionIndex::get_tables(const CollisionField& field) {
+    auto tables = std::find_if(fields_.begin(), fields_.end(), [&](const auto& entry) { return entry.first == field; });
+    if (tables == fields_.end()) {
+        tables = fields_.insert(fields_.end(), {field, FieldTables{}});
+    }
+    return tables->second;
+}
+
+void SubscriptionIndex::build() {
+    if (is_built_) {
+        return;
+    }
+
+    // How many subscriptions share each equality, and the bounds of every interval on each field, so an interval
+    // knows how many others it overlaps
+    std::unordered_map<std::string, std::size_t> num_equals;
+    std::unordered_map<CollisionField, std::pair<std::vector<std::uint64_t>, std::vector<std::uint64_t>>> interval_bounds;
+    for (const Subscription& subscription : subscriptions_) {
+        for (const FieldQuery& field_query : subscription.query.get()) {
+            if (field_query.get_type() == QueryType::EQUALS && !field_query.invert_match()) {
+                num_equals[equals_bucket(field_query)]++;
+            }
+        }
+        for (const auto& [lower, upper] : find_intervals(subscription.query)) {
+            auto& [lows, highs] = interval_bounds[lower->get_name()];
+            lows.push_back(value_key(*lower));
+            highs.push_back(value_key(*upper));
+        }
+    }
+    for (auto& [field, bounds] : interval_bounds) {
+        std::sort(bounds.first.begin(), bounds.first.end());
+        std::sort(bounds.second.begin(), bounds.second.end());
+    }
+
+    fields_.clear();
+    unconditional_.clear();
+    for (std::uint32_t subscription = 0; subscription < subscriptions_.size(); ++subscription) {
+        const Query& query = subscriptions_[subscription].query;
+
+        Access access{};
+        for (const FieldQuery& field_query : query.get()) {
+            if (field_query.invert_match()) {
+                continue;
+            }
+            switch (field_query.get_type()) {
+            case QueryType::EQUALS:
+                if (access.kind > AccessKind::INTERVAL || num_equals[equals_bucket(field_query)] < access.cost) {
+                    access = {AccessKind::EQUALS, &field_query, nullptr, num_equals[equals_bucket(field_query)]};
+                }
+                break;
+            case QueryType::CONTAINS:
+                if (access.kind > AccessKind::CONTAINS) {
+                    access = {AccessKind::CONTAINS, &field_query};
+                }
+                break;
+            case QueryType::LESS_THAN:
+            case QueryType::GREATER_THAN:
+                if (access.kind > AccessKind::BOUND) {
+                    access = {AccessKind::BOUND, &field_query};
+                }
+                break;
+            case QueryType::HAS_VALUE:
+                if (access.kind > AccessKind::HAS_VALUE) {
+                    access = {AccessKind::HAS_VALUE, &field_query};
+                }
+                break;
+            }
+        }
+        for (const auto& [lower, upper] : find_intervals(query)) {
+            // Intervals that start before this one ends, less those that end before it starts
+            const auto& [lows, highs] = interval_bounds[lower->get_name()];
+            const std::size_t num_overlaps = (std::lower_bound(lows.begin(), lows.end(), value_key(*upper)) - lows.begin()) -
+                                             (std::upper_bound(highs.begin(), highs.end(), value_key(*lower)) - highs.begin());
+            if (access.kind > AccessKind::INTERVAL || num_overlaps < access.cost) {
+                access = {AccessKind::INTERVAL, lower, upper, num_overlaps};
+            }
+        }
+
+        if (access.kind == AccessKind::NONE) {
+            unconditional_.push_back(subscription);
+            continue;
+        }
+
+        FieldTables& tables = get_tables(access.query->get_name());
+        const bool is_string = std::holds_alternative<std::string>(access.query->get_value());
+        switch (access.kind) {
+        case AccessKind::EQUALS:
+            if (!is_string) {
+                tables.equals[value_key(*access.query)].push_back(subscription);
+            } else if (access.query->case_insensitive()) {
+                tables.string_equals_case_insensitive[string_value(*access.query)].push_back(subscription);
+            } else {
+                tables.string_equals[string_value(*access.query)].push_back(subscription);
+            }
+            break;
+        case AccessKind::INTERVAL: {
+            const Interval interval{value_key(*access.query), value_key(*access.upper_query), subscription};
+            const std::uint64_t width = interval.high > interval.low ? interval.high - interval.low : 0;
+            const unsigned width_log2 = width == 0 ? 0 : std::bit_width(width - 1);
+            auto interval_class = std::find_if(tables.intervals.begin(), tables.intervals.end(), [&](const IntervalClass& interval_class) {
+                return interval_class.width_log2 == width_log2;
+            });
+            if (interval_class == tables.intervals.end()) {
+                interval_class = tables.intervals.insert(tables.intervals.end(), IntervalClass{width_log2, {}});
+            }
+            interval_class->intervals.push_back(interval);
+            break;
+        }
+        case AccessKind::CONTAINS:
+            if (access.query->case_insensitive()) {
+                tables.contains_case_insensitive.push_back({string_value(*access.query), subscription});
+            } else {
+                tables.contains.push_back({string_value(*access.query), subscription});
+            }
+            break;
+        case AccessKind::BOUND:
+            if (access.query->get_type() == QueryType::LESS_THAN) {
+                tables.less_than.push_back({value_key(*access.query), subscription});
+            } else {
+                tables.greater_than.push_back({value_key(*access.query), subscription});
+            }
+            break;
+        case AccessKind::HAS_VALUE:
+            tables.has_value.push_back(subscription);
+            break;
+        case AccessKind::NONE:
+            break;
+        }
+    }
+
+    auto by_bound = [](const auto& first, const auto& second) { return first.first < second.first; };
+    for (auto& [field, tables] : fields_) {
+        std::sort(tables.less_than.begin(), tables.less_than.end(), by_bound);
+        std::sort(tables.greater_than.begin(), tables.greater_than.end(), by_bound);
+        for (IntervalClass& interval_class : tables.intervals) {
+            std::sort(interval_class.intervals.begin(), interval_class.intervals.end(), [](const Interval& first, const Interval& second) {
+                return first.low < second.low;
+            });
+        }
+    }
+    is_built_ = true;
+}
+
+template<class T, class Candidate>
+void SubscriptionIndex::probe(const FieldTables& tables, const std::optional<T>& value, Candidate&& candidate) {
+    if (!value.has_value()) {
+        return;
+    }
+
+    for (const std::uint32_t subscription : tables.has_value) {
+        candidate(subscription);
+    }
+
+    auto candidates = [&](const auto& table, const auto& key) {
+        if (auto entry = table.find(key); entry != table.end()) {
+            for (const std::uint32_t subscription : entry->second) {
+                candidate(subscription);
+            }
+        }
+    };
+
+    if constexpr (std::is_same_v<T, std::string>) {
+        candidates(tables.string_equals, *value);
+        for (const auto& [needle, subscription] : tables.contains) {
+            if (value->find(needle) != std::string::npos) {
+                candidate(subscription);
+            }
+        }
+
+        if (!tables.string_equals_case_insensitive.empty() || !tables.contains_case_insensitive.empty()) {
+            const std::string lower_value = to_lower(*value);
+            candidates(tables.string_equals_case_insensitive, lower_value);
+            for (const auto& [needle, subscription] : tables.contains_case_insensitive) {
+                if (lower_value.find(needle) != std::string::npos) {
+                    candidate(subscription);
+                }
+            }
+        }
+    } else {
+        const std::uint64_t key = index_key(*value);
+        candidates(tables.equals, key);
+
+        for (const IntervalClass& interval_class : tables.intervals) {
+            const std::uint64_t max_width = interval_class.width_log2 >= 64 ? std::numeric_limits<std::uint64_t>::max()
+                                                                            : std::uint64_t{1} << interval_class.width_log2;
+            const std::uint64_t min_low = key > max_width ? key - max_width : 0;
+            auto interval = std::lower_bound(interval_class.intervals.begin(), interval_class.intervals.end(), min_low,
+                                             [](const Interval& interval, const std::uint64_t low) { return interval.low < low; });
+            for (; interval != interval_class.intervals.end() && interval->low < key; ++interval) {
+                if (key < interval->high) {
+                    candidate(interval->subscription);
+                }
+            }
+        }
+
+        // value < bound for every bound after the last one at most value, value > bound for every bound before the first one at least value
+        auto less_than = std::upper_bound(tables.less_than.begin(), tables.less_than.end(), key,
+                                          [](const std::uint64_t key, const auto& entry) { return key < entry.first; });
+        for (; less_than != tables.less_than.end(); ++less_than) {
+            candidate(less_than->second);
+        }
+        auto greater_than_end = std::lower_bound(tables.greater_than.begin(), tables.greater_than.end(), key,
+                                                 [](const auto& entry, const std::uint64_t key) { return entry.first < key; });
+        for (auto greater_than = tables.greater_than.begin(); greater_than != greater_than_end; ++greater_than) {
+            candidate(greater_than->second);
+        }
+    }
+}
+
+bool SubscriptionIndex::matches(const std::uint32_t subscription, const Collisions& collisions, const std::uint32_t row) const {
+    for (const FieldQuery& field_query : subscriptions_[subscription].query.get()) {
+        bool match = false;
+        visit_column(collisions, field_query.get_name(), [&](const auto& column) {
+            match = satisfies(field_query, column[row]);
+        });
+        if (match == field_query.invert_match()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<SubscriptionMatch> SubscriptionIndex::match(const Collisions& collisions) {
+    if (subscriptions_.empty()) {
+        return {};
+    }
+    build();
+
+    // A subscription is filed under one predicate only, so it is a candidate at most once per row
+    std::vector<std::vector<std::uint32_t>> rows(subscriptions_.size());
+    const std::size_t num_rows = collisions.crash_dates.size();
+    for (std::uint32_t row = 0; row < num_rows; ++row) {
+        auto candidate = [&](const std::uint32_t subscription) {
+            if (matches(subscription, collisions, row)) {
+                rows[subscription].push_back(row);
+            }
+        };
+
+        for (const auto& [field, tables] : fields_) {
+            visit_column(collisions, field, [&](const auto& column) {
+                probe(tables, column[row], candidate);
+            });
+        }
+        for (const std::uint32_t subscription : unconditional_) {
+            candidate(subscription);
+        }
+    }
+
+    std::vector<SubscriptionMatch> results;
+    for (std::size_t subscription = 0; subscription < subscriptions_.size(); ++subscription) {
+        if (!rows[subscription].empty()) {
+            results.push_back({subscriptions_[subscription].id, std::move(rows[subscription])});
+        }
+    }
+    return results;
+}
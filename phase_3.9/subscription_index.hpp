@@ -0,0 +1,101 @@
+#pragma once
+
+#include "collision.hpp"
+#include "collision_field_enum.hpp"
+#include "query.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+// Rows of a batch that one subscription matched, in row order
+struct SubscriptionMatch {
+    std::size_t subscription_id;
+    std::vector<std::uint32_t> rows;
+};
+
+// Standing queries indexed by their predicates, so that a batch of rows is matched against all of them in one pass.
+// Every subscription is filed under one access predicate in the tables of its field: equalities in a hash table by
+// value, crash_date windows and other ranges with both bounds in interval tables, and single bounds in arrays
+// sorted by bound. Each row looks its values up in the tables of the fields any subscription is filed under and
+// only checks the other predicates of the subscriptions it finds, so a row costs about the same for one
+// subscription as for thousands of them that it does not match.
+// Not safe to use from many threads at once.
+class SubscriptionIndex {
+public:
+    // Returns the id of the new subscription. Throws for predicates the query engine rejects too, like CONTAINS on
+    // a number or LESS_THAN on a string.
+    std::size_t subscribe(const Query& query);
+    bool unsubscribe(const std::size_t subscription_id);
+    std::size_t size() const;
+
+    // The rows of collisions each subscription matches, only for subscriptions that match any
+    std::vector<SubscriptionMatch> match(const Collisions& collisions);
+
+private:
+    struct Subscription {
+        std::size_t id;
+        Query query;
+    };
+
+    // Subscriptions filed under a range (low, high) on the field, by index in subscriptions_
+    struct Interval {
+        std::uint64_t low;
+        std::uint64_t high;
+        std::uint32_t subscription;
+    };
+
+    // Intervals no longer than 2^width_log2, sorted by low. A value can only be within those whose low is at most
+    // that much below it, so a lookup reads at most about twice as many intervals as the value is in.
+    struct IntervalClass {
+        unsigned width_log2;
+        std::vector<Interval> intervals;
+    };
+
+    // Access predicates on one field. Numbers, dates and times are compared by their index_key, which keeps their order.
+    struct FieldTables {
+        std::vector<std::uint32_t> has_value;
+        std::unordered_map<std::uint64_t, std::vector<std::uint32_t>> equals;
+        std::unordered_map<std::string, std::vector<std::uint32_t>> string_equals;
+
+        // Keyed by the lower case value
+        std::unordered_map<std::string, std::vector<std::uint32_t>> string_equals_case_insensitive;
+
+        std::vector<IntervalClass> intervals;
+
+        // Sorted by bound, a value is below the LESS_THAN bounds after it and above the GREATER_THAN ones before it
+        std::vector<std::pair<std::uint64_t, std::uint32_t>> less_than;
+        std::vector<std::pair<std::uint64_t, std::uint32_t>> greater_than;
+
+        // Lower case values for case insensitive predicates
+        std::vector<std::pair<std::string, std::uint32_t>> contains;
+        std::vector<std::pair<std::string, std::uint32_t>> contains_case_insensitive;
+    };
+
+    // Rebuilds the tables after subscriptions changed
+    void build();
+
+    FieldTables& get_tables(const CollisionField& field);
+
+    // Calls candidate with every subscription filed under a predicate on the field that value satisfies
+    template<class T, class Candidate>
+    static void probe(const FieldTables& tables, const std::optional<T>& value, Candidate&& candidate);
+
+    // Whether a row satisfies every predicate of a subscription
+    bool matches(const std::uint32_t subscription, const Collisions& collisions, const std::uint32_t row) const;
+
+    std::vector<Subscription> subscriptions_;
+    std::size_t next_id_ = 0;
+
+    // Only the fields some subscription is filed under
+    std::vector<std::pair<CollisionField, FieldTables>> fields_;
+
+    // Subscriptions with only inverted predicates, which every row is checked against
+    std::vector<std::uint32_t> unconditional_;
+    bool is_built_ = true;
+};
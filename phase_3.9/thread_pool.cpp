@@ -0,0 +1,162 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+// Set on pool workers so that nested parallel_for calls run inline instead of deadlocking
+thread_local bool is_pool_worker = false;
+
+}  // namespace
+
+ThreadPool::ThreadPool(const std::size_t num_threads)
+  : next_job_{0},
+    stopping_{false}
+{
+    for (std::size_t index = 0; index < std::max<std::size_t>(num_threads, 1); ++index) {
+        workers_.emplace_back([this]() { worker_loop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        stopping_ = true;
+    }
+    work_available_.notify_all();
+
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+ThreadPool& ThreadPool::shared() {
+    static ThreadPool pool{std::thread::hardware_concurrency()};
+    return pool;
+}
+
+std::size_t ThreadPool::size() const {
+    return workers_.size();
+}
+
+bool ThreadPool::is_worker() {
+    return is_pool_worker;
+}
+
+void ThreadPool::parallel_for(const std::size_t num_tasks, const std::function<void(std::size_t)>& func) {
+    if (num_tasks == 0) {
+        return;
+    }
+
+    if (is_pool_worker) {
+        for (std::size_t task_index = 0; task_index < num_tasks; ++task_index) {
+            func(task_index);
+        }
+        return;
+    }
+
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->func = func;
+    job->num_tasks = num_tasks;
+
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        jobs_.push_back(job);
+    }
+    work_available_.notify_all();
+
+    {
+        std::unique_lock<std::mutex> lock{job->mutex};
+        job->done.wait(lock, [&job]() { return job->finished_tasks.load() == job->num_tasks; });
+    }
+
+    if (job->exception) {
+        std::rethrow_exception(job->exception);
+    }
+}
+
+void ThreadPool::submit(const std::size_t num_tasks,
+                        const std::function<void(std::size_t)>& func,
+                        const std::function<void(std::exception_ptr)>& done) {
+    if (num_tasks == 0) {
+        done(nullptr);
+        return;
+    }
+
+    // Nothing waits here, so unlike parallel_for this cannot deadlock when called from a worker
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->func = func;
+    job->num_tasks = num_tasks;
+    job->done_callback = done;
+
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        jobs_.push_back(job);
+    }
+    work_available_.notify_all();
+}
+
+void ThreadPool::worker_loop() {
+    is_pool_worker = true;
+
+    while (true) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock{mutex_};
+            work_available_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+
+            if (jobs_.empty()) {
+                return;
+            }
+
+            // Round robin over the active jobs, one task at a time
+            job = jobs_[next_job_++ % jobs_.size()];
+        }
+
+        const std::size_t task_index = job->next_task.fetch_add(1);
+        if (task_index >= job->num_tasks) {
+            // Every task has been handed out, the remaining ones are finishing on other workers
+            remove_job(job);
+            continue;
+        }
+
+        run_task(*job, task_index);
+    }
+}
+
+void ThreadPool::run_task(Job& job, const std::size_t task_index) {
+    try {
+        // Once a task has failed the result is discarded anyway, so skip the remaining work
+        if (!job.failed.load()) {
+            job.func(task_index);
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock{job.mutex};
+        if (!job.failed.exchange(true)) {
+            job.exception = std::current_exception();
+        }
+    }
+
+    if (job.finished_tasks.fetch_add(1) + 1 == job.num_tasks) {
+        if (job.done_callback) {
+            job.done_callback(job.exception);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock{job.mutex};
+        job.done.notify_all();
+    }
+}
+
+void ThreadPool::remove_job(const std::shared_ptr<Job>& job) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto position = std::find(jobs_.begin(), jobs_.end(), job);
+    if (position != jobs_.end()) {
+        jobs_.erase(position);
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Persistent pool of worker threads shared by all queries.
+//
+// Work is submitted as jobs made of independent tasks (morsels). Idle workers take
+// the next task from the active jobs in round robin order, so concurrent queries
+// share the workers fairly and a long query cannot starve short ones. The number of
+// threads doing query work never exceeds the pool size, no matter how many client
+// threads are waiting on their queries.
+class ThreadPool {
+public:
+    ThreadPool(const std::size_t num_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Process wide pool sized to the number of hardware threads
+    static ThreadPool& shared();
+
+    // Run func(task_index) for every task_index in [0, num_tasks) and block until all have finished.
+    // The first exception thrown by a task is rethrown here.
+    void parallel_for(const std::size_t num_tasks, const std::function<void(std::size_t)>& func);
+
+    // Like parallel_for, but returns right away. Once every task has finished, done is called on the thread that
+    // finished the last one, with the first exception thrown by a task or nullptr.
+    void submit(const std::size_t num_tasks,
+                const std::function<void(std::size_t)>& func,
+                const std::function<void(std::exception_ptr)>& done);
+
+    std::size_t size() const;
+
+    // True on the worker threads of any pool
+    static bool is_worker();
+
+private:
+    struct Job {
+        std::function<void(std::size_t)> func;
+
+        // Set for jobs nobody waits for
+        std::function<void(std::exception_ptr)> done_callback;
+        std::size_t num_tasks;
+        std::atomic<std::size_t> next_task{0};
+        std::atomic<std::size_t> finished_tasks{0};
+        std::atomic<bool> failed{false};
+
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr exception;
+    };
+
+    void worker_loop();
+    void run_task(Job& job, const std::size_t task_index);
+    void remove_job(const std::shared_ptr<Job>& job);
+
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable work_available_;
+    std::vector<std::shared_ptr<Job>> jobs_;
+    std::size_t next_job_;
+    bool stopping_;
+};